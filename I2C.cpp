@@ -60,6 +60,8 @@
 #endif
 
 #include <inttypes.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
 #include "I2C.h"
 
 uint8_t I2C::bytesAvailable = 0;
@@ -67,8 +69,60 @@ uint8_t I2C::bufferIndex = 0;
 uint8_t I2C::totalBytes = 0;
 uint16_t I2C::timeOutDelay = 0;
 
+//CRC-8 with polynomial x^8 + x^2 + x + 1 for the SMBus PEC, one entry per
+//value of the CRC so far XORed with the next byte
+static const uint8_t pecTable[256] PROGMEM = {
+  0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+  0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+  0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+  0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+  0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+  0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+  0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+  0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+  0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+  0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+  0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+  0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+  0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+  0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+  0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+  0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
+
+//transfer() flag for reads of words with a CRC each, see I2c.readWords()
+#define TRANSFER_WORD_CRC 0x80
+
+//Flags for I2C::smbus()
+#define SMBUS_SEND_COUNT 0x01    //a count byte goes before the bytes sent
+#define SMBUS_RECEIVE_COUNT 0x02 //the slave sends a count byte first
+
 I2C::I2C()
 {
+  queueHead = 0;
+  muxSelected = MUX_UNKNOWN;
+  muxUsed = 0;
+  currentDevice = 0;
+  busTWBR = ((F_CPU / 100000) - 16) / 2;
+  adaptive = 0;
+  twiInterrupt = 0;
+  captureSink = 0;
+  retryMax = 0;
+  retryOn = RETRY_NACK;
+  retryDelay = 0;
+  retryMaxDelay = 0;
+  clearRetryCounts();
+  breakerThreshold = 0;
+  breakerBackoff = 0;
+  breakerMaxBackoff = 0;
+  healthSink = 0;
+  for (uint8_t i = 0; i < MAX_DEVICES; i++)
+  {
+    devices[i].address = FREE_SLOT;
+    health[i].state = HEALTH_OK;
+    health[i].failures = 0;
+    health[i].answered = 0;
+  }
 }
 
 ////////////// Public Methods ////////////////////////////////////////
@@ -88,7 +142,8 @@ void I2C::begin()
   // initialize twi prescaler and bit rate
   cbi(TWSR, TWPS0);
   cbi(TWSR, TWPS1);
-  TWBR = ((F_CPU / 100000) - 16) / 2;
+  busTWBR = ((F_CPU / 100000) - 16) / 2;
+  TWBR = busTWBR;
   // enable twi module and acks
   TWCR = _BV(TWEN) | _BV(TWEA);
 }
@@ -125,6 +180,8 @@ void I2C::end()
  *      timeOut - uint16_t
  *          The amount of time to wait before timing out. Can range from
  *          0 - 65535 milliseconds. If it's set to 0 it will be disabled.
+ *          Per-device timeouts (deviceTimeOut(), profile()) are set in
+ *          microseconds instead.
  *  Returns:
  *      none
  */
@@ -133,6 +190,114 @@ void I2C::timeOut(uint16_t _timeOut)
   timeOutDelay = _timeOut;
 }
 
+/*
+ *  Description:
+ *      Lets blocking calls sleep instead of polling TWINT. While a bus step
+ *      runs the MCU goes to idle sleep, with the TWI interrupt enabled to
+ *      wake it when the step is done. Other interrupts are served as soon
+ *      as they occur and the CPU draws idle current for most of a transfer.
+ *      Calls made with interrupts disabled keep polling.
+ *
+ *      There is no timer of its own to wake the CPU for a timeout: timeouts
+ *      are checked on every wakeup, at the latest on the Timer0 overflow
+ *      behind millis() about every millisecond, so Timer0 must keep running
+ *      for them to fire. Steps with a timeout below IDLE_SLEEP_MIN_TIMEOUT,
+ *      e.g. learned adaptive timeouts of fast devices, poll instead so they
+ *      still time out in microseconds.
+ *
+ *      Only available when the library is built with I2C_IDLE_SLEEP defined
+ *      (see I2C.h), otherwise this does nothing. The library then provides
+ *      ISR(TWI_vect), so it can not be linked together with another TWI
+ *      library like Wire.
+ *  Parameters:
+ *      enable - uint8_t
+ *          0: Poll TWINT (default)
+ *          1 - 0xFF: Sleep while waiting
+ *  Returns:
+ *      none
+ */
+void I2C::idleSleep(uint8_t enable)
+{
+#ifdef I2C_IDLE_SLEEP
+  twiInterrupt = enable ? (1 << TWIE) : 0;
+#endif
+}
+
+/*
+ *  Description:
+ *      Enables/disables adaptive per-device timeouts. While enabled the library
+ *      measures how long each device keeps the TWI hardware waiting (including
+ *      clock stretching) and, once ADAPTIVE_MIN_SAMPLES steps have been seen,
+ *      times out steps to that device after ADAPTIVE_TIMEOUT_MARGIN times the
+ *      longest wait seen plus ADAPTIVE_TIMEOUT_SLACK microseconds. A dead fast
+ *      device is then detected in microseconds while slow devices keep the
+ *      time they need. The learned value never exceeds the global timeOut().
+ *
+ *      Up to MAX_DEVICES devices are tracked, others use the global timeOut().
+ *      A device that answers gets a free slot, or the slot of a device that
+ *      never answered or has fewer than ADAPTIVE_MIN_SAMPLES steps measured,
+ *      so probing many addresses (e.g. scan()) does not push out a device
+ *      that has learned its timeout.
+ *      Make sure the slowest operations of a device (e.g. a measurement with
+ *      clock stretching) are exercised while learning, or set its timeout
+ *      explicitly with I2c.deviceTimeOut(address, timeOutUs).
+ *  Parameters:
+ *      enable - Boolean
+ *          True: Learn and use per-device timeouts
+ *          False: Use the global timeOut() (default)
+ *  Returns:
+ *      none
+ */
+void I2C::adaptiveTimeOut(uint8_t enable)
+{
+  adaptive = enable;
+}
+
+/*
+ *  Description:
+ *      Sets the timeout for a single device, overriding both the global
+ *      timeOut() and the learned adaptive timeout.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      timeOutUs - uint32_t
+ *          The time to wait for each step of a transmission with this device
+ *          in microseconds, unlike timeOut() which takes milliseconds. If
+ *          it's set to 0 the override is removed.
+ *  Returns:
+ *      none
+ */
+void I2C::deviceTimeOut(uint8_t address, uint32_t timeOutUs)
+{
+  I2CDevice *device = findDevice(address, timeOutUs ? SLOT_KEEP : SLOT_NONE);
+  if (device)
+  {
+    device->timeOutUs = timeOutUs;
+    device->flags |= PROFILE_KEPT;
+  }
+}
+
+/*
+ *  Description:
+ *      Returns the timeout currently used for each step of a transmission with
+ *      a device: its override, its learned adaptive timeout or the global
+ *      timeOut().
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *  Returns:
+ *      uint32_t
+ *          Timeout in microseconds, 0 if disabled
+ */
+uint32_t I2C::deviceTimeOut(uint8_t address)
+{
+  I2CDevice *previous = currentDevice;
+  currentDevice = findDevice(address, 0);
+  uint32_t limit = stepTimeOut();
+  currentDevice = previous;
+  return (limit);
+}
+
 /*
  *  Description:
  *      Enables high speed mode (400kHz)
@@ -147,12 +312,267 @@ void I2C::setSpeed(uint8_t _fast)
 {
   if (!_fast)
   {
-    TWBR = ((F_CPU / 100000) - 16) / 2;
+    busTWBR = ((F_CPU / 100000) - 16) / 2;
   }
   else
   {
-    TWBR = ((F_CPU / 400000) - 16) / 2;
+    busTWBR = ((F_CPU / 400000) - 16) / 2;
+  }
+  TWBR = busTWBR;
+}
+
+/*
+ *  Description:
+ *      Registers the profile of a device. The profile is applied automatically
+ *      on every transaction with that device made through the read/write
+ *      methods: the bus speed is switched (TWBR is only written when the speed
+ *      actually changes) and the timeout is set. Devices without a profile run
+ *      at the speed set with setSpeed().
+ *
+ *      The register address width and byte order are used by readRegister()
+ *      and writeRegister(), the byte order also by the write/write16 methods
+ *      that send a uint16_t, uint32_t or uint64_t. The retry count replaces
+ *      the limit of retryPolicy() for the device.
+ *
+ *      Up to MAX_DEVICES devices can have a profile, the table is shared with
+ *      adaptiveTimeOut() and circuitBreaker().
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      flags - uint8_t
+ *          PROFILE_REG16: The device takes 16-bit register addresses
+ *          PROFILE_LSB_FIRST: Multi-byte values are sent LSB first
+ *          PROFILE_PEC: SMBus transactions carry a PEC byte
+ *          PROFILE_NOT_IDEMPOTENT: Retry transactions with the device only
+ *          when no byte reached it, see retryPolicy()
+ *      frequency - uint32_t
+ *          Bus speed in Hz for this device, 0 to use the setSpeed() speed
+ *      timeOutUs - uint32_t
+ *          Timeout for each step in microseconds, 0 to use the global or
+ *          adaptive timeout. Same as I2c.deviceTimeOut(address, timeOutUs)
+ *      retries - uint8_t
+ *          How many times a failed transaction with the device is repeated,
+ *          0 to use the retryPolicy() limit. Which failures are repeated is
+ *          set with retryPolicy(), NACKs by default
+ *  Returns:
+ *      uint8_t
+ *          0: The profile was stored
+ *          1: The device table is full of profiles. Slots the circuit
+ *             breaker or adaptive timeouts took for other devices are
+ *             given up for a profile.
+ */
+uint8_t I2C::profile(uint8_t address, uint8_t flags, uint32_t frequency, uint32_t timeOutUs, uint8_t retries)
+{
+  I2CDevice *device = findDevice(address, SLOT_KEEP);
+  if (!device)
+  {
+    return (1);
+  }
+  device->flags = flags | PROFILE_KEPT;
+  device->twbr = frequency ? bitRate(frequency) : 0;
+  device->timeOutUs = timeOutUs;
+  device->retries = retries;
+  return (0);
+}
+
+/*
+ *  Description:
+ *      Finds the highest reliable bus speed for a device. The speed is stepped
+ *      up from CALIBRATE_START in CALIBRATE_STEP increments (CALIBRATE_STEPS
+ *      steps, 100kHz - 1MHz). At each speed the register is read back trials
+ *      times; the first speed with any error ends the search. Steps that
+ *      give the same bit rate register value as the one before are skipped,
+ *      which includes every step above about F_CPU / 18, the fastest the
+ *      register can do. The speed one step below the fastest one that passed
+ *      is stored in the device profile, as a safety margin, and used from
+ *      then on.
+ *
+ *      The circuit breaker is off while calibrating, so failures at speeds
+ *      the wiring can't take do not take the device offline.
+ *
+ *      By default the register contents read at 100kHz are the reference, so
+ *      use a register that does not change (e.g. an ID register). With
+ *      writePattern a test pattern is written to the register before each
+ *      read back instead, for RAM-like scratch registers only (not EEPROM,
+ *      its write cycle is not waited for).
+ *
+ *      Store the result with I2c.saveProfiles() so production units can run
+ *      at the speed their wiring allows right from boot.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      registerAddress - uint16_t
+ *          Register to read back, width as per the device profile
+ *      numberBytes - uint8_t
+ *          The number of bytes to read back, at most MAX_BUFFER_SIZE
+ *      trials - uint8_t
+ *          Read backs per speed
+ *      writePattern - Boolean
+ *          True: Write a test pattern before each read back
+ *          False: Compare against the contents read at 100kHz (default)
+ *      errorCounts - uint8_t*
+ *          Optional array that receives the number of failed read backs at
+ *          each step, 0 for steps not tested
+ *      errorCountsSize - uint8_t
+ *          Number of entries in errorCounts, CALIBRATE_STEPS for all steps
+ *  Returns:
+ *      uint32_t
+ *          The speed now used for the device in Hz, F_CPU / (16 + 2 * TWBR)
+ *          for the bit rate actually set, 0 if the device failed already at
+ *          100kHz (the profile is left unchanged)
+ */
+uint32_t I2C::calibrateSpeed(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t trials, uint8_t writePattern, uint8_t *errorCounts, uint8_t errorCountsSize)
+{
+  uint8_t reference[MAX_BUFFER_SIZE];
+  uint8_t sample[MAX_BUFFER_SIZE];
+  I2CDevice *device = findDevice(address, SLOT_KEEP);
+  if (!device)
+  {
+    return (0);
+  }
+  numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
+  if (numberBytes == 0)
+  {
+    numberBytes++;
+  }
+  uint8_t savedTWBR = device->twbr;
+  uint8_t savedRetries = device->retries;
+  uint8_t savedRetryMax = retryMax;
+  uint8_t savedThreshold = breakerThreshold;
+  //retries would hide the errors we are looking for
+  device->retries = 0;
+  retryMax = 0;
+  breakerThreshold = 0;
+  if (errorCounts)
+  {
+    memset(errorCounts, 0, errorCountsSize);
+  }
+  uint16_t tempTime = timeOutDelay;
+  if (!timeOutDelay)
+  {
+    //a speed the wiring can't take may well hang the bus
+    timeOut(80);
+  }
+  device->twbr = bitRate(CALIBRATE_START);
+  if (!writePattern && readRegister(address, registerAddress, numberBytes, reference))
+  {
+    trials = 0;
+  }
+  uint8_t passed = 0;  //number of steps that passed
+  uint8_t fastest = 0; //TWBR of the fastest step that passed
+  uint8_t margin = 0;  //TWBR of the step before it
+  for (uint8_t step = 0; step < CALIBRATE_STEPS && trials; step++)
+  {
+    uint8_t twbr = bitRate(CALIBRATE_START + (uint32_t)step * CALIBRATE_STEP);
+    if (passed && twbr == fastest)
+    {
+      //same bit rate as the step before, or the fastest TWBR can do
+      continue;
+    }
+    device->twbr = twbr;
+    uint8_t errors = 0;
+    for (uint8_t t = 0; t < trials; t++)
+    {
+      if (writePattern)
+      {
+        for (uint8_t i = 0; i < numberBytes; i++)
+        {
+          reference[i] = ((t & 1) ? 0xAA : 0x55) ^ (uint8_t)(i + step);
+        }
+        if (writeRegister(address, registerAddress, reference, numberBytes))
+        {
+          errors++;
+          continue;
+        }
+      }
+      if (readRegister(address, registerAddress, numberBytes, sample) || memcmp(sample, reference, numberBytes))
+      {
+        errors++;
+      }
+    }
+    if (errorCounts && step < errorCountsSize)
+    {
+      errorCounts[step] = errors;
+    }
+    if (errors)
+    {
+      break;
+    }
+    margin = passed ? fastest : twbr;
+    fastest = twbr;
+    passed++;
+  }
+  timeOutDelay = tempTime;
+  device->retries = savedRetries;
+  retryMax = savedRetryMax;
+  breakerThreshold = savedThreshold;
+  if (!passed)
+  {
+    device->twbr = savedTWBR;
+    return (0);
+  }
+  //the device answered, whatever the breaker saw before
+  resetHealth(address);
+  device->twbr = margin;
+  return (F_CPU / (16 + 2 * (uint32_t)margin));
+}
+
+/*
+ *  Description:
+ *      Stores all device profiles (including calibrated speeds and learned
+ *      timeouts) in the EEPROM. Takes PROFILES_EEPROM_SIZE bytes from
+ *      eepromAddress on: PROFILE_MAGIC, the device table, then its checksum.
+ *      Keep other EEPROM data out of that range.
+ *  Parameters:
+ *      eepromAddress - uint16_t
+ *          EEPROM location to store the profiles at
+ *  Returns:
+ *      none
+ */
+void I2C::saveProfiles(uint16_t eepromAddress)
+{
+  uint8_t *target = (uint8_t *)(uintptr_t)eepromAddress;
+  eeprom_update_byte(target, PROFILE_MAGIC);
+  eeprom_update_block(devices, target + 1, sizeof(devices));
+  eeprom_update_byte(target + 1 + sizeof(devices), profileChecksum());
+}
+
+/*
+ *  Description:
+ *      Restores the device profiles stored with I2c.saveProfiles(). The
+ *      current profiles are kept if the EEPROM does not hold valid profiles.
+ *  Parameters:
+ *      eepromAddress - uint16_t
+ *          EEPROM location the profiles were stored at
+ *  Returns:
+ *      uint8_t
+ *          0: The profiles were restored
+ *          1: No valid profiles found
+ */
+uint8_t I2C::loadProfiles(uint16_t eepromAddress)
+{
+  const uint8_t *source = (const uint8_t *)(uintptr_t)eepromAddress;
+  if (eeprom_read_byte(source) != PROFILE_MAGIC)
+  {
+    return (1);
+  }
+  I2CDevice saved[MAX_DEVICES];
+  memcpy(saved, devices, sizeof(devices));
+  eeprom_read_block(devices, source + 1, sizeof(devices));
+  if (eeprom_read_byte(source + 1 + sizeof(devices)) != profileChecksum())
+  {
+    memcpy(devices, saved, sizeof(devices));
+    return (1);
+  }
+  //the slots may now hold other devices
+  for (uint8_t i = 0; i < MAX_DEVICES; i++)
+  {
+    health[i].state = HEALTH_OK;
+    health[i].failures = 0;
+    health[i].answered = 0;
   }
+  currentDevice = 0;
+  return (0);
 }
 
 /*
@@ -169,41 +589,15 @@ void I2C::pullup(uint8_t activate)
 {
   if (activate)
   {
-#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
-    // activate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    sbi(PORTC, 4);
-    sbi(PORTC, 5);
-#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
-    // activate internal pull-ups for twi
-    // as per note from atmega644p manual pg108
-    sbi(PORTC, 0);
-    sbi(PORTC, 1);
-#else
-    // activate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    sbi(PORTD, 0);
-    sbi(PORTD, 1);
-#endif
+    // activate internal pull-ups for twi, see I2CDefs.h
+    sbi(TWI_PORT, TWI_SDA);
+    sbi(TWI_PORT, TWI_SCL);
   }
   else
   {
-#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
-    // deactivate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    cbi(PORTC, 4);
-    cbi(PORTC, 5);
-#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
-    // deactivate internal pull-ups for twi
-    // as per note from atmega644p manual pg108
-    cbi(PORTC, 0);
-    cbi(PORTC, 1);
-#else
     // deactivate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    cbi(PORTD, 0);
-    cbi(PORTD, 1);
-#endif
+    cbi(TWI_PORT, TWI_SDA);
+    cbi(TWI_PORT, TWI_SCL);
   }
 }
 
@@ -221,8 +615,12 @@ void I2C::pullup(uint8_t activate)
 void I2C::scan()
 {
   uint16_t tempTime = timeOutDelay;
+  uint8_t tempAdaptive = adaptive;
   timeOut(80);
+  //probing absent addresses tells nothing about device timing
+  adaptive = 0;
   uint8_t totalDevicesFound = 0;
+  TWBR = busTWBR;
   Serial.println(F("Scanning for devices...please wait"));
   Serial.println();
   for (uint8_t s = 0; s <= 0x7F; s++)
@@ -239,6 +637,7 @@ void I2C::scan()
       {
         Serial.println(F("There is a problem with the bus, could not complete scan"));
         timeOutDelay = tempTime;
+        adaptive = tempAdaptive;
         return;
       }
     }
@@ -256,6 +655,7 @@ void I2C::scan()
     Serial.println(F("No devices found"));
   }
   timeOutDelay = tempTime;
+  adaptive = tempAdaptive;
 }
 
 /*
@@ -335,40 +735,7 @@ uint8_t I2C::receive()
  */
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE, registerAddress, 0, 0));
 }
 
 uint8_t I2C::write(int address, int registerAddress)
@@ -397,49 +764,7 @@ uint8_t I2C::write(int address, int registerAddress)
  */
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint8_t data)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(data);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE, registerAddress, &data, 1));
 }
 
 uint8_t I2C::write(int address, int registerAddress, int data)
@@ -489,6 +814,7 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint16_t data)
   writeBytes[0] = (data >> 8) & 0xFF; //MSB
   writeBytes[1] = data & 0xFF;        //LSB
 
+  orderBytes(address, writeBytes, 2);
   returnStatus = write(address, registerAddress, writeBytes, 2);
   return (returnStatus);
 }
@@ -508,6 +834,7 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint32_t data)
   writeBytes[2] = (data >> 8) & 0xFF;
   writeBytes[3] = data & 0xFF; //LSB
 
+  orderBytes(address, writeBytes, 4);
   returnStatus = write(address, registerAddress, writeBytes, 4);
   return (returnStatus);
 }
@@ -531,6 +858,7 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint64_t data)
   writeBytes[6] = (data >> 8) & 0xFF;
   writeBytes[7] = data & 0xFF; //LSB
 
+  orderBytes(address, writeBytes, 8);
   returnStatus = write(address, registerAddress, writeBytes, 8);
   return (returnStatus);
 }
@@ -560,52 +888,7 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, uint64_t data)
  */
 uint8_t I2C::write(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint8_t numberBytes)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    returnStatus = _sendByte(data[i]);
-    if (returnStatus)
-    {
-      if (returnStatus == 1)
-      {
-        return (3);
-      }
-      return (returnStatus);
-    }
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE, registerAddress, (uint8_t *)data, numberBytes));
 }
 
 /*
@@ -628,70 +911,8 @@ uint8_t I2C::write(uint8_t address, uint8_t registerAddress, const uint8_t *data
  */
 uint8_t I2C::read(uint8_t address, uint8_t numberBytes)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
   numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, data, numberBytes));
 }
 
 uint8_t I2C::read(int address, int numberBytes)
@@ -725,96 +946,8 @@ uint8_t I2C::read(int address, int numberBytes)
  */
 uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
   numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ, registerAddress, data, numberBytes));
 }
 
 uint8_t I2C::read(int address, int registerAddress, int numberBytes)
@@ -848,68 +981,7 @@ uint8_t I2C::read(int address, int registerAddress, int numberBytes)
  */
 uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, dataBuffer, numberBytes));
 }
 
 /*
@@ -918,68 +990,7 @@ uint8_t I2C::read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
  */
 uint8_t I2C::readex(uint8_t address, uint16_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  uint16_t nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint16_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, dataBuffer, numberBytes));
 }
 
 /*
@@ -1015,95 +1026,7 @@ uint8_t I2C::readex(uint8_t address, uint16_t numberBytes, uint8_t *dataBuffer)
  */
 uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ, registerAddress, dataBuffer, numberBytes));
 }
 
 /*
@@ -1112,95 +1035,127 @@ uint8_t I2C::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes,
  */
 uint8_t I2C::readex(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  uint16_t nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(registerAddress);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  return (transfer(address, TRANSACTION_READ, registerAddress, dataBuffer, numberBytes));
+}
+
+////////// Profiled Methods ///////////
+
+/*
+ *  Description:
+ *      Reads from a register using the register address width of the device
+ *      profile, i.e. I2c.read16() for PROFILE_REG16 devices and I2c.read()
+ *      otherwise.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      registerAddress - uint16_t
+ *          Starting register address to read data from
+ *      numberBytes - uint8_t
+ *          The number of bytes to be read
+ *      dataBuffer - uint8_t*
+ *          An array to store the read data
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::readRegister(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  I2CDevice *device = findDevice(address, 0);
+  uint8_t flags = TRANSACTION_READ;
+  if (device && (device->flags & PROFILE_REG16))
   {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
+    flags |= TRANSACTION_REG16;
   }
-  for (uint16_t i = 0; i < numberBytes; i++)
+  return (transfer(address, flags, registerAddress, dataBuffer, numberBytes));
+}
+
+/*
+ *  Description:
+ *      Writes to a register using the register address width of the device
+ *      profile, i.e. I2c.write16() for PROFILE_REG16 devices and I2c.write()
+ *      otherwise.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      registerAddress - uint16_t
+ *          Address of the register you wish to access (as per the datasheet)
+ *      data - const uint8_t*
+ *          Array of bytes
+ *      numberBytes - uint8_t
+ *          The number of bytes in the array to be sent
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::writeRegister(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+{
+  I2CDevice *device = findDevice(address, 0);
+  uint8_t flags = TRANSACTION_WRITE;
+  if (device && (device->flags & PROFILE_REG16))
   {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
+    flags |= TRANSACTION_REG16;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  return (transfer(address, flags, registerAddress, (uint8_t *)data, numberBytes));
+}
+
+/*
+ *  Description:
+ *      Reads from a device that follows every 2 byte word with a CRC-8
+ *      (polynomial 0x31, initial value 0xFF), like the Sensirion SHT3x and
+ *      SCD4x. The CRC of each word is computed while the next byte is on the
+ *      bus and checked as soon as its CRC byte arrives; only the payload is
+ *      stored, so dataBuffer needs 2 bytes per word. At the first word that
+ *      does not match the read is ended right away. The register address
+ *      width comes from the device profile like for I2c.readRegister(), e.g.
+ *      PROFILE_REG16 for 16-bit commands.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      registerAddress - uint16_t
+ *          Register or command to read from
+ *      numberWords - uint8_t
+ *          The number of words to be read
+ *      dataBuffer - uint8_t*
+ *          An array of 2 * numberWords bytes to store the words, MSB first
+ *          as they were sent
+ *  Returns:
+ *      uint8_t
+ *          WORD_CRC_ERROR: A word did not match its CRC. The words before it
+ *                          are in dataBuffer.
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for the other values
+ */
+uint8_t I2C::readWords(uint8_t address, uint16_t registerAddress, uint8_t numberWords, uint8_t *dataBuffer)
+{
+  I2CDevice *device = findDevice(address, 0);
+  uint8_t flags = TRANSACTION_READ | TRANSFER_WORD_CRC;
+  if (device && (device->flags & PROFILE_REG16))
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    flags |= TRANSACTION_REG16;
   }
-  return (returnStatus);
+  return (transfer(address, flags, registerAddress, dataBuffer, numberWords ? numberWords * 2 : 2));
+}
+
+/*
+ *  Description:
+ *      Same as I2c.readWords(address, registerAddress, numberWords,
+ *      *dataBuffer) without sending a register address first, for devices
+ *      that are told what to send by a separate command write, e.g. the SCD4x
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      numberWords - uint8_t
+ *          The number of words to be read
+ *      dataBuffer - uint8_t*
+ *          An array of 2 * numberWords bytes to store the words
+ *  Returns:
+ *      uint8_t
+ *          WORD_CRC_ERROR: A word did not match its CRC
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for the other values
+ */
+uint8_t I2C::readWords(uint8_t address, uint8_t numberWords, uint8_t *dataBuffer)
+{
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER | TRANSFER_WORD_CRC, 0, dataBuffer,
+                   numberWords ? numberWords * 2 : 2));
 }
 
 ////////// 16-Bit Methods ///////////
@@ -1214,51 +1169,7 @@ uint8_t I2C::readex(uint8_t address, uint8_t registerAddress, uint16_t numberByt
  */
 uint8_t I2C::write16(uint8_t address, uint16_t registerAddress)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, 0, 0));
 }
 
 /*
@@ -1267,60 +1178,7 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress)
  */
 uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint8_t data)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendByte(data);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, &data, 1));
 }
 
 /*
@@ -1341,63 +1199,7 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const char *data
  */
 uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint8_t numberBytes)
 {
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    returnStatus = _sendByte(data[i]);
-    if (returnStatus)
-    {
-      if (returnStatus == 1)
-      {
-        return (3);
-      }
-      return (returnStatus);
-    }
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, (uint8_t *)data, numberBytes));
 }
 
 /*
@@ -1413,6 +1215,7 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint16_t data)
   writeBytes[0] = (data >> 8) & 0xFF; //MSB
   writeBytes[1] = data & 0xFF;        //LSB
 
+  orderBytes(address, writeBytes, 2);
   returnStatus = write16(address, registerAddress, writeBytes, 2);
   return (returnStatus);
 }
@@ -1432,6 +1235,7 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint32_t data)
   writeBytes[2] = (data >> 8) & 0xFF;
   writeBytes[3] = data & 0xFF; //LSB
 
+  orderBytes(address, writeBytes, 4);
   returnStatus = write16(address, registerAddress, writeBytes, 4);
   return (returnStatus);
 }
@@ -1455,6 +1259,7 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint64_t data)
   writeBytes[6] = (data >> 8) & 0xFF;
   writeBytes[7] = data & 0xFF; //LSB
 
+  orderBytes(address, writeBytes, 8);
   returnStatus = write16(address, registerAddress, writeBytes, 8);
   return (returnStatus);
 }
@@ -1467,107 +1272,8 @@ uint8_t I2C::write16(uint8_t address, uint16_t registerAddress, uint64_t data)
  */
 uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
   numberBytes = min(numberBytes, MAX_BUFFER_SIZE);
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (2);
-    }
-    return (returnStatus);
-  }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (4);
-    }
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
-  }
-  for (uint8_t i = 0; i < numberBytes; i++)
-  {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
-    {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
-    }
-    data[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
-  }
-  returnStatus = _stop();
-  if (returnStatus)
-  {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
-  }
-  return (returnStatus);
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_REG16, registerAddress, data, numberBytes));
 }
 
 /*
@@ -1576,384 +1282,2025 @@ uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberByt
  */
 uint8_t I2C::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
 {
-  bytesAvailable = 0;
-  bufferIndex = 0;
-  if (numberBytes == 0)
-  {
-    numberBytes++;
-  }
-  nack = numberBytes - 1;
-  returnStatus = 0;
-  returnStatus = _start();
-  if (returnStatus)
-  {
-    return (returnStatus);
-  }
-  returnStatus = _sendAddress(SLA_W(address));
-  if (returnStatus)
+  return (transfer(address, TRANSACTION_READ | TRANSACTION_REG16, registerAddress, dataBuffer, numberBytes));
+}
+
+////////// Transaction Queue ///////////
+
+/*
+ *  Description:
+ *      Runs a transaction described like for I2c.queue() right away, all
+ *      chunks of it and on its multiplexer channel if one is set; priority
+ *      is not used. The flags can carry TRANSACTION_NOT_IDEMPOTENT, which
+ *      the read and write methods have no way to pass. The transaction must
+ *      not be in the queue.
+ *  Parameters:
+ *      transaction - I2CTransaction*
+ *          The transaction, status and bytesDone are filled in
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::transaction(I2CTransaction *transaction)
+{
+  uint8_t stat;
+  transaction->bytesDone = 0;
+  do
+  {
+    stat = runStep(transaction);
+  } while (!stat && transaction->bytesDone < transaction->numberBytes);
+  transaction->status = stat;
+  return (stat);
+}
+
+/*
+ *  Description:
+ *      Adds a transaction to the queue. Queued transactions are executed one
+ *      step at a time by I2c.service(), which always picks the queued
+ *      transaction with the highest priority (on a tie the one queued first).
+ *      The caller fills in address, flags, priority, registerAddress,
+ *      dataBuffer, numberBytes and chunkSize, the rest is managed here.
+ *
+ *      With a non-zero chunkSize the transaction is split into steps of at
+ *      most chunkSize bytes, each one a complete transaction continuing from
+ *      registerAddress + bytesDone. This only works for memory-like devices
+ *      (EEPROM, FRAM) that auto-increment their register pointer, but it caps
+ *      the time an urgent read has to wait behind a bulk transfer to the time
+ *      of a single chunk. Keep EEPROM write chunks within one page.
+ *  Parameters:
+ *      transaction - I2CTransaction*
+ *          Must stay valid until its status is no longer TRANSACTION_PENDING
+ *  Returns:
+ *      uint8_t
+ *          0: The transaction was queued
+ *          1: The transaction is already in the queue
+ *          2: Invalid transaction (read of 0 bytes or write without register)
+ */
+uint8_t I2C::queue(I2CTransaction *transaction)
+{
+  if (transaction->flags & TRANSACTION_READ)
   {
-    if (returnStatus == 1)
+    if (!transaction->numberBytes)
     {
       return (2);
     }
-    return (returnStatus);
   }
-  //Send MSB of register address
-  returnStatus = _sendByte(registerAddress >> 8);
-  if (returnStatus)
+  else if (transaction->flags & TRANSACTION_NO_REGISTER)
   {
-    if (returnStatus == 1)
-    {
-      return (3);
-    }
-    return (returnStatus);
+    return (2);
   }
-  //Send LSB of register address
-  returnStatus = _sendByte(registerAddress & 0xFF);
-  if (returnStatus)
+  I2CTransaction **tail = &queueHead;
+  while (*tail)
   {
-    if (returnStatus == 1)
+    if (*tail == transaction)
     {
-      return (3);
+      return (1);
     }
-    return (returnStatus);
+    tail = &(*tail)->next;
   }
-  returnStatus = _start();
-  if (returnStatus)
+  transaction->next = 0;
+  transaction->bytesDone = 0;
+  transaction->status = TRANSACTION_PENDING;
+  *tail = transaction;
+  return (0);
+}
+
+/*
+ *  Description:
+ *      Removes a transaction from the queue without running the rest of it.
+ *      A partially transferred chunked transaction keeps its bytesDone.
+ *  Parameters:
+ *      transaction - I2CTransaction*
+ *  Returns:
+ *      uint8_t
+ *          0: The transaction was removed, its status is left as
+ *             TRANSACTION_PENDING
+ *          1: The transaction was not in the queue
+ */
+uint8_t I2C::cancel(I2CTransaction *transaction)
+{
+  for (I2CTransaction **link = &queueHead; *link; link = &(*link)->next)
   {
-    if (returnStatus == 1)
+    if (*link == transaction)
     {
-      return (4);
+      *link = transaction->next;
+      transaction->next = 0;
+      return (0);
     }
-    return (returnStatus);
   }
-  returnStatus = _sendAddress(SLA_R(address));
-  if (returnStatus)
+  return (1);
+}
+
+/*
+ *  Description:
+ *      Runs one step of the highest priority queued transaction: the whole
+ *      transaction, or one chunk of it if chunkSize is set. Call this from
+ *      loop() as often as possible. Priorities are only compared between
+ *      steps, a step that has started always runs to completion.
+ *
+ *      On a tie transactions that need no multiplexer switch (channel 0 or
+ *      the channel that is selected) go first, so queued accesses are
+ *      grouped by channel, then the one queued first.
+ *
+ *      When a transaction completes or fails it is removed from the queue and
+ *      its status is set to the return value of the underlying read/write.
+ *      A step that is retried waits out the retry delays before it returns,
+ *      see retryPolicy().
+ *  Parameters:
+ *      none
+ *  Returns:
+ *      uint8_t
+ *          0: The queue was empty
+ *          1: A step was executed
+ */
+uint8_t I2C::service()
+{
+  I2CTransaction *selected = queueHead;
+  if (!selected)
   {
-    if (returnStatus == 1)
-    {
-      return (5);
-    }
-    return (returnStatus);
+    return (0);
   }
-  for (uint8_t i = 0; i < numberBytes; i++)
+  uint8_t switches = selected->channel && selected->channel != muxSelected;
+  for (I2CTransaction *t = selected->next; t; t = t->next)
   {
-    if (i == nack)
-    {
-      returnStatus = _receiveByte(0);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_NACK)
-      {
-        return (returnStatus);
-      }
-    }
-    else
+    uint8_t tSwitches = t->channel && t->channel != muxSelected;
+    if (t->priority > selected->priority || (t->priority == selected->priority && switches && !tSwitches))
     {
-      returnStatus = _receiveByte(1);
-      if (returnStatus == 1)
-      {
-        return (6);
-      }
-      if (returnStatus != MR_DATA_ACK)
-      {
-        return (returnStatus);
-      }
+      selected = t;
+      switches = tSwitches;
     }
-    dataBuffer[i] = TWDR;
-    bytesAvailable = i + 1;
-    totalBytes = i + 1;
   }
-  returnStatus = _stop();
-  if (returnStatus)
+  uint8_t stat = runStep(selected);
+  if (stat || selected->bytesDone >= selected->numberBytes)
   {
-    if (returnStatus == 1)
-    {
-      return (7);
-    }
-    return (returnStatus);
+    cancel(selected);
+    selected->status = stat;
   }
-  return (returnStatus);
+  return (1);
 }
 
-//////////// LOW-LEVEL METHODS
-//////////// (No need to use them if the device uses normal register protocol)
-
 /*
  *  Description:
- *      Sends out a Start Condition. This puts all slave devices on notice that
- *      a transmission is about to start. This function incorporates the timeOut
- *      function.
+ *      Returns the number of transactions waiting in the queue
  *  Parameters:
  *      none
  *  Returns:
  *      uint8_t
- *          0: The start condition was successfully sent
- *          1: The function timed out
- *          2 - 0xFF: See the datasheet
+ *          The number of queued transactions
  */
-uint8_t I2C::_start()
+uint8_t I2C::pending()
 {
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
-  {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return (1);
-    }
-  }
-  if ((TWI_STATUS == START) || (TWI_STATUS == REPEATED_START))
-  {
-    return (0);
-  }
-  if (TWI_STATUS == LOST_ARBTRTN)
+  uint8_t count = 0;
+  for (I2CTransaction *t = queueHead; t; t = t->next)
   {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return (bufferedStatus);
+    count++;
   }
-  return (TWI_STATUS);
+  return (count);
 }
 
+////////// Multiplexers ///////////
+
 /*
  *  Description:
- *      Sends out the address byte. The address byte's first 7 bits are the
- *      7-bit address of the Slave you wish to communicate with, the last bit
- *      specifies if you wish to write or read to that slave,
- *      where 0 = write & 1 = read.
+ *      Enables one channel of a TCA9548A, PCA9548A, PCA9546A or another
+ *      multiplexer with a channel bit mask register. The library remembers
+ *      the selected channel and only writes to the multiplexer when it
+ *      changes. A channel of another multiplexer the library has selected
+ *      before is disabled first, so two channels are never connected at the
+ *      same time. Channels enabled by other code are not seen, call
+ *      I2c.muxForget() after changing them or resetting a multiplexer.
  *  Parameters:
- *      i2cAddress - uint8_t
- *          The address byte you wish to send
+ *      mux - uint8_t
+ *          Address of the multiplexer, 0x70 - 0x77
+ *      channel - uint8_t
+ *          Channel to enable, 0 - 7
  *  Returns:
  *      uint8_t
- *          0: The address byte was successfully sent
- *          1: The function timed out
- *          2 - 0xFF: See the datasheet
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning.
+ *          After a failure the selection is unknown and written again next
+ *          time.
  */
-uint8_t I2C::_sendAddress(uint8_t i2cAddress)
+uint8_t I2C::muxSelect(uint8_t mux, uint8_t channel)
 {
-  TWDR = i2cAddress;
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
-  {
-    if (!timeOutDelay)
-    {
-      continue;
-    }
-    if ((millis() - startingTime) >= timeOutDelay)
-    {
-      lockUp();
-      return (1);
-    }
-  }
-  if ((TWI_STATUS == MT_SLA_ACK) || (TWI_STATUS == MR_SLA_ACK))
-  {
-    return (0);
-  }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if ((TWI_STATUS == MT_SLA_NACK) || (TWI_STATUS == MR_SLA_NACK))
-  {
-    _stop();
-    return (bufferedStatus);
-  }
-  else
-  {
-    lockUp();
-    return (bufferedStatus);
-  }
+  return (selectChannel(MUX_CHANNEL(mux, channel)));
 }
 
 /*
  *  Description:
- *      Sends out a byte of data to the slave.
+ *      Disables the channels of every multiplexer the library has selected,
+ *      e.g. before talking to a device whose address is also used behind a
+ *      multiplexer
  *  Parameters:
- *      i2cData - uint8_t
- *          The data byte you wish to send
+ *      none
  *  Returns:
  *      uint8_t
- *          0: The data byte was successfully sent
- *          1: The function timed out
- *          2 - 0xFF: See the datasheet
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
  */
-uint8_t I2C::_sendByte(uint8_t i2cData)
+uint8_t I2C::muxRelease()
 {
+  for (uint8_t i = 0; i < 8 && muxSelected; i++)
+  {
+    if ((muxUsed & (1 << i)) && (muxSelected == MUX_UNKNOWN || MUX_ADDRESS(muxSelected) == (0x70 | i)))
+    {
+      uint8_t stat = transfer(0x70 | i, TRANSACTION_WRITE, 0, 0, 0);
+      if (stat)
+      {
+        muxSelected = MUX_UNKNOWN;
+        return (stat);
+      }
+    }
+  }
+  muxSelected = 0;
+  return (0);
+}
+
+/*
+ *  Description:
+ *      Forgets which channel is selected, so the next selection is written
+ *      and every multiplexer the library has used is disabled before
+ *  Parameters:
+ *      none
+ *  Returns:
+ *      none
+ */
+void I2C::muxForget()
+{
+  muxSelected = MUX_UNKNOWN;
+}
+
+/*
+ *  Description:
+ *      Creates a virtual bus for the devices behind one multiplexer channel.
+ *      Its methods work like the I2c methods of the same name, but select
+ *      the channel first (see I2c.muxSelect()) and return its status if that
+ *      fails.
+ *  Parameters:
+ *      mux - uint8_t
+ *          Address of the multiplexer, 0x70 - 0x77
+ *      channel - uint8_t
+ *          Channel the devices are on, 0 - 7
+ */
+I2CMuxChannel::I2CMuxChannel(uint8_t mux, uint8_t channel)
+{
+  this->mux = mux;
+  this->channel = channel;
+}
+
+uint8_t I2CMuxChannel::select()
+{
+  return (I2c.muxSelect(mux, channel));
+}
+
+uint8_t I2CMuxChannel::write(uint8_t address, uint8_t registerAddress, uint8_t data)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.write(address, registerAddress, data));
+}
+
+uint8_t I2CMuxChannel::write(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.write(address, registerAddress, data, numberBytes));
+}
+
+uint8_t I2CMuxChannel::write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint8_t numberBytes)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.write16(address, registerAddress, data, numberBytes));
+}
+
+uint8_t I2CMuxChannel::read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.read(address, registerAddress, numberBytes, dataBuffer));
+}
+
+uint8_t I2CMuxChannel::read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.read16(address, registerAddress, numberBytes, dataBuffer));
+}
+
+uint8_t I2CMuxChannel::readRegister(uint8_t address, uint16_t registerAddress, uint8_t numberBytes,
+                                    uint8_t *dataBuffer)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.readRegister(address, registerAddress, numberBytes, dataBuffer));
+}
+
+uint8_t I2CMuxChannel::writeRegister(uint8_t address, uint16_t registerAddress, const uint8_t *data,
+                                     uint8_t numberBytes)
+{
+  uint8_t stat = select();
+  return (stat ? stat : I2c.writeRegister(address, registerAddress, data, numberBytes));
+}
+
+////////// SMBus ///////////
+
+/*
+ *  Description:
+ *      SMBus Read Word: reads a 16-bit value, sent LSB first, from a
+ *      command code. For devices profiled with PROFILE_PEC the PEC byte the
+ *      device sends is checked; it is computed byte by byte while the
+ *      transaction runs.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      command - uint8_t
+ *          SMBus command code
+ *      value - uint16_t*
+ *          The word read
+ *  Returns:
+ *      uint8_t
+ *          SMBUS_PEC_ERROR: The PEC did not match, value is not changed
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for the other values
+ */
+uint8_t I2C::smbusReadWord(uint8_t address, uint8_t command, uint16_t *value)
+{
+  uint8_t word[2];
+  uint8_t numberBytes = 2;
+  uint8_t stat = smbus(address, command, 0, 0, 0, word, &numberBytes);
+  if (!stat)
+  {
+    *value = word[0] | (word[1] << 8);
+  }
+  return (stat);
+}
+
+/*
+ *  Description:
+ *      SMBus Write Word: writes a 16-bit value LSB first to a command code,
+ *      followed by the PEC for devices profiled with PROFILE_PEC
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      command - uint8_t
+ *          SMBus command code
+ *      value - uint16_t
+ *          The word to write
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::smbusWriteWord(uint8_t address, uint8_t command, uint16_t value)
+{
+  uint8_t word[2] = {(uint8_t)(value & 0xFF), (uint8_t)(value >> 8)};
+  return (smbus(address, command, 0, word, 2, 0, 0));
+}
+
+/*
+ *  Description:
+ *      SMBus Process Call: writes a word to a command code and reads the
+ *      word the device answers with after a repeated START. With PROFILE_PEC
+ *      only the answer carries a PEC, covering the whole transaction.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      command - uint8_t
+ *          SMBus command code
+ *      value - uint16_t
+ *          The word to write
+ *      result - uint16_t*
+ *          The word read
+ *  Returns:
+ *      uint8_t
+ *          SMBUS_PEC_ERROR: The PEC did not match, result is not changed
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for the other values
+ */
+uint8_t I2C::smbusProcessCall(uint8_t address, uint8_t command, uint16_t value, uint16_t *result)
+{
+  uint8_t word[2] = {(uint8_t)(value & 0xFF), (uint8_t)(value >> 8)};
+  uint8_t answer[2];
+  uint8_t numberBytes = 2;
+  uint8_t stat = smbus(address, command, 0, word, 2, answer, &numberBytes);
+  if (!stat)
+  {
+    *result = answer[0] | (answer[1] << 8);
+  }
+  return (stat);
+}
+
+/*
+ *  Description:
+ *      SMBus Block Read: the device sends a byte count and then that many
+ *      bytes. The count is taken as it arrives, so the transaction ends
+ *      right after the last byte (or its PEC) without reading a fixed
+ *      length.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      command - uint8_t
+ *          SMBus command code
+ *      dataBuffer - uint8_t*
+ *          An array to store the block
+ *      maxBytes - uint8_t
+ *          Size of dataBuffer; 32 holds any SMBus 2.0 block
+ *      numberBytes - uint8_t*
+ *          The number of bytes in the block
+ *  Returns:
+ *      uint8_t
+ *          SMBUS_BLOCK_ERROR: The count was 0 or larger than maxBytes, the
+ *                             transaction was ended after it
+ *          SMBUS_PEC_ERROR: The PEC did not match
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for the other values
+ */
+uint8_t I2C::smbusBlockRead(uint8_t address, uint8_t command, uint8_t *dataBuffer, uint8_t maxBytes,
+                            uint8_t *numberBytes)
+{
+  *numberBytes = maxBytes;
+  uint8_t stat = smbus(address, command, SMBUS_RECEIVE_COUNT, 0, 0, dataBuffer, numberBytes);
+  if (stat)
+  {
+    *numberBytes = 0;
+  }
+  return (stat);
+}
+
+/*
+ *  Description:
+ *      SMBus Block Write: sends a byte count and then the bytes, followed by
+ *      the PEC for devices profiled with PROFILE_PEC
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      command - uint8_t
+ *          SMBus command code
+ *      data - const uint8_t*
+ *          The block to write
+ *      numberBytes - uint8_t
+ *          The number of bytes in the block, 1 - 32 for SMBus 2.0 devices
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::smbusBlockWrite(uint8_t address, uint8_t command, const uint8_t *data, uint8_t numberBytes)
+{
+  return (smbus(address, command, SMBUS_SEND_COUNT, data, numberBytes, 0, 0));
+}
+
+////////// Retries ///////////
+
+/*
+ *  Description:
+ *      Sets which failures repeat a transaction and how often. Every read,
+ *      write and SMBus method is covered, for queued transactions each
+ *      chunk is repeated on its own. A device profile with a retry count
+ *      uses that count instead of limit.
+ *
+ *      Transactions with TRANSACTION_NOT_IDEMPOTENT in their flags (run with
+ *      transaction() or queue()) and every transaction with a device
+ *      profiled with PROFILE_NOT_IDEMPOTENT are only repeated when no byte
+ *      reached the device: a timeout of the START or the address, or an
+ *      address NACK. A FIFO read or a write-to-clear register that failed
+ *      later is left to the caller.
+ *
+ *      With the circuit breaker on every attempt counts towards its
+ *      threshold, and a device it takes offline is not retried any more.
+ *
+ *      The delay blocks the call that is retried, service() included. With
+ *      idleSleep() on the CPU sleeps through it, otherwise it is a busy wait
+ *      and never longer than RETRY_POLL_MAX_DELAY.
+ *  Parameters:
+ *      limit - uint8_t
+ *          Retries per transaction, 0 disables retrying (default)
+ *      retryOn - uint8_t
+ *          RETRY_ADDRESS_NACK: The device did not acknowledge its address
+ *          RETRY_DATA_NACK: The device did not acknowledge a byte written
+ *          RETRY_TIMEOUT: A step timed out (return values 1 - 7)
+ *          RETRY_ARBITRATION: Arbitration was lost to another master
+ *          RETRY_CHECKSUM: SMBUS_PEC_ERROR or WORD_CRC_ERROR
+ *          RETRY_NACK: Both NACKs (default)
+ *      delay - uint16_t
+ *          Microseconds to wait before the first retry
+ *      maxDelay - uint16_t
+ *          The delay doubles with each retry up to maxDelay microseconds, 0
+ *          (default) keeps it fixed
+ *  Returns:
+ *      none
+ */
+void I2C::retryPolicy(uint8_t limit, uint8_t _retryOn, uint16_t delay, uint16_t maxDelay)
+{
+  retryMax = limit;
+  retryOn = _retryOn;
+  retryDelay = delay;
+  retryMaxDelay = maxDelay ? max(maxDelay, delay) : 0;
+}
+
+/*
+ *  Description:
+ *      Copies the retry statistics, counted since the start or the last
+ *      clearRetryCounts()
+ *  Parameters:
+ *      counts - I2CRetryCounts*
+ *          Receives the counts:
+ *          retries: Repeated attempts, a transaction repeated twice
+ *          counts 2
+ *          recovered: Transactions that succeeded after being repeated
+ *          exhausted: Transactions that still failed after the last retry
+ *          refused: Failures not repeated since the transaction was not
+ *          idempotent
+ *  Returns:
+ *      none
+ */
+void I2C::retryCounts(I2CRetryCounts *counts)
+{
+  *counts = retryTotals;
+}
+
+/*
+ *  Description:
+ *      Sets the retry statistics back to 0
+ *  Parameters:
+ *      none
+ *  Returns:
+ *      none
+ */
+void I2C::clearRetryCounts()
+{
+  memset(&retryTotals, 0, sizeof(retryTotals));
+}
+
+////////// Device Health ///////////
+
+/*
+ *  Description:
+ *      Enables the circuit breaker: a device that fails threshold
+ *      transactions in a row is taken offline, and every transaction with
+ *      it returns
+ *      DEVICE_OFFLINE right away without touching the bus. Once backoff
+ *      milliseconds have passed the next transaction goes out as a probe. If
+ *      the device answers it is back online, otherwise it stays offline and
+ *      the backoff doubles, up to maxBackoff.
+ *
+ *      Timeouts and address NACKs are failures; a slave holding the bus is
+ *      the usual cause of a timeout. Success, a data NACK, and a bad PEC,
+ *      block count or CRC show the device answered and clear the count.
+ *      Bus-level errors such as lost arbitration or an unexpected TWI status
+ *      neither count nor clear: they say nothing about the device.
+ *
+ *      Devices are tracked in the device table shared with profile() and
+ *      adaptiveTimeOut(). A device that fails gets a free slot, or the slot
+ *      of another device that never answered or has few adaptive samples;
+ *      a profile() takes any slot that is not a profile. Failures to absent
+ *      addresses therefore recycle each other's slots. A device without a
+ *      slot is never taken offline.
+ *  Parameters:
+ *      threshold - uint8_t
+ *          Failures in a row that take a device offline, 0 disables the
+ *          breaker (default)
+ *      backoff - uint16_t
+ *          Milliseconds until the first probe of a device taken offline
+ *      maxBackoff - uint16_t
+ *          Longest time between probes in milliseconds, 0 (default) keeps
+ *          the backoff fixed
+ *  Returns:
+ *      none
+ */
+void I2C::circuitBreaker(uint8_t threshold, uint16_t backoff, uint16_t maxBackoff)
+{
+  breakerThreshold = threshold;
+  breakerBackoff = backoff;
+  breakerMaxBackoff = max(maxBackoff, backoff);
+}
+
+/*
+ *  Description:
+ *      Returns the health of a device as tracked by the circuit breaker
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *  Returns:
+ *      uint8_t
+ *          HEALTH_OK: The device answered its last transaction, or is not
+ *          tracked
+ *          HEALTH_FAILING: Its last transactions failed, fewer than the
+ *          threshold
+ *          HEALTH_OPEN: The device is offline until its next probe
+ */
+uint8_t I2C::deviceHealth(uint8_t address)
+{
+  I2CDevice *device = findDevice(address, 0);
+  return (device ? health[device - devices].state : HEALTH_OK);
+}
+
+/*
+ *  Description:
+ *      Returns how many transactions with a device have failed in a row,
+ *      saturating at 255. Counted while the circuit breaker is enabled.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *  Returns:
+ *      uint8_t
+ *          Number of failures since the device last answered
+ */
+uint8_t I2C::deviceFailures(uint8_t address)
+{
+  I2CDevice *device = findDevice(address, 0);
+  return (device ? health[device - devices].failures : 0);
+}
+
+/*
+ *  Description:
+ *      Brings a device back online at once, e.g. after power cycling it
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *  Returns:
+ *      none
+ */
+void I2C::resetHealth(uint8_t address)
+{
+  I2CDevice *device = findDevice(address, 0);
+  if (device)
+  {
+    health[device - devices].failures = 0;
+    healthChange(device - devices, HEALTH_OK);
+  }
+}
+
+/*
+ *  Description:
+ *      Installs a function that is called whenever the health of a device
+ *      changes, with the previous and the new HEALTH_* state. A device
+ *      taken offline reports HEALTH_OPEN, each probe HEALTH_PROBING followed
+ *      by HEALTH_OK or HEALTH_OPEN. The function runs right after the
+ *      transaction that caused the change.
+ *  Parameters:
+ *      sink - I2CHealthSink
+ *          Function receiving the changes, 0 to stop
+ *  Returns:
+ *      none
+ */
+void I2C::healthMonitor(I2CHealthSink sink)
+{
+  healthSink = sink;
+}
+
+////////// Bus Capture ///////////
+
+/*
+ *  Description:
+ *      Installs a function that is called after every low-level bus step
+ *      (start, address, data byte, stop) with a record of what went over the
+ *      bus, what the step returned and how long it took. Use packCapture() to
+ *      turn the records into the binary capture format, e.g. to stream them
+ *      over Serial and replay them on a host.
+ *  Parameters:
+ *      sink - I2CCaptureSink
+ *          Function receiving the records, 0 stops capturing
+ *  Returns:
+ *      none
+ */
+void I2C::capture(I2CCaptureSink sink)
+{
+  captureSink = sink;
+}
+
+/*
+ *  Description:
+ *      Packs a capture record into CAPTURE_RECORD_SIZE bytes, multi-byte fields
+ *      LSB first.
+ *  Parameters:
+ *      *record - I2CCaptureRecord
+ *          The record to pack
+ *      *packed - uint8_t
+ *          Buffer of at least CAPTURE_RECORD_SIZE bytes
+ *  Returns:
+ *      none
+ */
+void I2C::packCapture(const I2CCaptureRecord *record, uint8_t *packed)
+{
+  packed[0] = record->type;
+  packed[1] = record->data;
+  packed[2] = record->status;
+  packed[3] = record->duration & 0xFF;
+  packed[4] = record->duration >> 8;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    packed[5 + i] = record->timestamp >> (8 * i);
+  }
+}
+
+//////////// LOW-LEVEL METHODS
+//////////// (No need to use them if the device uses normal register protocol)
+
+/*
+ *  Description:
+ *      Sends out a Start Condition. This puts all slave devices on notice that
+ *      a transmission is about to start. This function incorporates the timeOut
+ *      function.
+ *  Parameters:
+ *      none
+ *  Returns:
+ *      uint8_t
+ *          0: The start condition was successfully sent
+ *          1: The function timed out
+ *          2 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_start()
+{
+  if (captureSink)
+  {
+    captureTime = micros();
+  }
+  TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | twiInterrupt;
+  if (twiWait())
+  {
+    record(CAPTURE_START, TWBR, 1);
+    return (1);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if ((bufferedStatus == START) || (bufferedStatus == REPEATED_START))
+  {
+    record(CAPTURE_START, TWBR, 0);
+    return (0);
+  }
+  record(CAPTURE_START, TWBR, bufferedStatus);
+  if (bufferedStatus == LOST_ARBTRTN)
+  {
+    lockUp();
+  }
+  return (bufferedStatus);
+}
+
+/*
+ *  Description:
+ *      Sends out the address byte. The address byte's first 7 bits are the
+ *      7-bit address of the Slave you wish to communicate with, the last bit
+ *      specifies if you wish to write or read to that slave,
+ *      where 0 = write & 1 = read.
+ *  Parameters:
+ *      i2cAddress - uint8_t
+ *          The address byte you wish to send
+ *  Returns:
+ *      uint8_t
+ *          0: The address byte was successfully sent
+ *          1: The function timed out
+ *          2 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_sendAddress(uint8_t i2cAddress)
+{
+  if (captureSink)
+  {
+    captureTime = micros();
+  }
+  currentDevice = findDevice(i2cAddress >> 1, 0);
+  TWDR = i2cAddress;
+  TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+  if (twiWait())
+  {
+    record(CAPTURE_ADDRESS, i2cAddress, 1);
+    return (1);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if ((bufferedStatus == MT_SLA_ACK) || (bufferedStatus == MR_SLA_ACK))
+  {
+    if (!currentDevice && adaptive)
+    {
+      currentDevice = findDevice(i2cAddress >> 1, SLOT_TRACK);
+    }
+    if (currentDevice)
+    {
+      health[currentDevice - devices].answered = 1;
+    }
+    record(CAPTURE_ADDRESS, i2cAddress, 0);
+    return (0);
+  }
+  record(CAPTURE_ADDRESS, i2cAddress, bufferedStatus);
+  if ((bufferedStatus == MT_SLA_NACK) || (bufferedStatus == MR_SLA_NACK))
+  {
+    _stop();
+    return (bufferedStatus);
+  }
+  else
+  {
+    lockUp();
+    return (bufferedStatus);
+  }
+}
+
+/*
+ *  Description:
+ *      Sends out a byte of data to the slave.
+ *  Parameters:
+ *      i2cData - uint8_t
+ *          The data byte you wish to send
+ *  Returns:
+ *      uint8_t
+ *          0: The data byte was successfully sent
+ *          1: The function timed out
+ *          2 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_sendByte(uint8_t i2cData)
+{
+  if (captureSink)
+  {
+    captureTime = micros();
+  }
   TWDR = i2cData;
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN);
+  TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+  if (twiWait())
+  {
+    record(CAPTURE_SEND, i2cData, 1);
+    return (1);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if (bufferedStatus == MT_DATA_ACK)
+  {
+    record(CAPTURE_SEND, i2cData, 0);
+    return (0);
+  }
+  record(CAPTURE_SEND, i2cData, bufferedStatus);
+  if (bufferedStatus == MT_DATA_NACK)
+  {
+    _stop();
+    return (bufferedStatus);
+  }
+  else
+  {
+    lockUp();
+    return (bufferedStatus);
+  }
+}
+
+/*
+ *  Description:
+ *      Receives a byte from the slave. The ack parameter specifies whether or
+ *      not to send an acknowledge signal after receiving it. If it is the last
+ *      byte you want to receive it must be 0, so that the slave will stop
+ *      transmitting and allow the master to send a stop.
+ *  Parameters:
+ *      ack - uint8_t
+ *          Whether or not you want the master to acknowledge the receipt of the
+ *          data byte. If this is the last byte being received, do not
+ *          acknowledge.
+ *          0: Do not send an ACK signal on receipt
+ *          1 - 0xFF: Send an ACK signal on receipt
+ *  Returns:
+ *      uint8_t
+ *          0: The data byte was successfully received
+ *          1: The function timed out
+ *          2 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_receiveByte(uint8_t ack)
+{
+  uint8_t type = ack ? CAPTURE_RECEIVE_ACK : CAPTURE_RECEIVE_NACK;
+  if (captureSink)
+  {
+    captureTime = micros();
+  }
+  if (ack)
+  {
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWEA) | twiInterrupt;
+  }
+  else
+  {
+    TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+  }
+  if (twiWait())
+  {
+    record(type, 0, 1);
+    return (1);
+  }
+  uint8_t bufferedStatus = TWI_STATUS;
+  if (bufferedStatus == LOST_ARBTRTN)
+  {
+    record(type, 0, bufferedStatus);
+    lockUp();
+    return (bufferedStatus);
+  }
+  record(type, TWDR, bufferedStatus);
+  return (bufferedStatus);
+}
+
+/*
+ *  Description:
+ *      Receives a byte from the slave. The ack parameter specifies whether or
+ *      not to send an acknowledge signal after receiving it. If it is the last
+ *      byte you want to receive it must be 0, so that the slave will stop
+ *      transmitting and allow the master to send a stop.
+ *  Parameters:
+ *      ack - uint8_t
+ *          Whether or not you want the master to acknowledge the receipt of the
+ *          data byte. If this is the last byte being received, do not
+ *          acknowledge.
+ *          0: Do not send an ACK signal on receipt
+ *          1 - 0xFF: Send an ACK signal on receipt
+ *      *target - uint8_t
+ *          A byte to store the received data.
+ *  Returns:
+ *      uint8_t
+ *          0: The data byte was successfully received
+ *          6: The function timed out
+ *          1 - 5 and 7 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_receiveByte(uint8_t ack, uint8_t *target)
+{
+  uint8_t stat = I2C::_receiveByte(ack);
+  if (stat == 1)
+  {
+    return (6);
+  }
+  if (ack)
+  {
+    if (stat != MR_DATA_ACK)
+    {
+      *target = 0x0;
+      return (stat);
+    }
+  }
+  else
+  {
+    if (stat != MR_DATA_NACK)
+    {
+      *target = 0x0;
+      return (stat);
+    }
+  }
+  *target = TWDR;
+  // I suppose that if we get this far we're ok
+  return 0;
+}
+
+/*
+ *  Description:
+ *      Send out a stop condition
+ *  Parameters:
+ *      none
+ *  Returns:
+ *      uint8_t
+ *          0: The stop condition was successfully sent
+ *          1: The function timed out
+ *          2 - 0xFF: See the datasheet
+ */
+uint8_t I2C::_stop()
+{
+  uint32_t limit = stepTimeOut();
+  unsigned long startingTime = micros();
+  captureTime = startingTime;
+  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+  while ((TWCR & (1 << TWSTO)))
+  {
+    if (!limit)
+    {
+      continue;
+    }
+    if ((micros() - startingTime) >= limit)
+    {
+      record(CAPTURE_STOP, 0, 1);
+      lockUp();
+      return (1);
+    }
+  }
+  record(CAPTURE_STOP, 0, 0);
+  currentDevice = 0;
+  return (0);
+}
+
+/*
+ *  Description:
+ *      Runs one transaction on the bus for TwiBackend of I2CMaster.h, with
+ *      the same bus sequence, bulk fast paths, idle sleep, capture and
+ *      device profiles (speed, timeout, adaptive timeout) as the read and
+ *      write methods, but without retries, the circuit breaker or
+ *      multiplexer channels, which are left to the front end.
+ *  Parameters:
+ *      address - uint8_t
+ *          The 7 bit I2C slave address
+ *      flags - uint8_t
+ *          TRANSACTION_* flags, TRANSACTION_NO_REGISTER also applies to
+ *          writes
+ *      registerAddress - uint16_t
+ *          Starting register address
+ *      dataBuffer - uint8_t*
+ *          Data to write or array to store the read data
+ *      numberBytes - uint16_t
+ *          The number of bytes to transfer
+ *      timeOutUs - uint32_t
+ *          Timeout of each step in microseconds, 0 to disable it. Takes the
+ *          place of timeOut() for this transaction, rounded up to whole
+ *          milliseconds; per-device timeouts still apply.
+ *  Returns:
+ *      uint8_t
+ *          See "TRANSMISSION TIMEOUT RETURN VALUES" for return value meaning
+ */
+uint8_t I2C::backendTransfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                             uint16_t numberBytes, uint32_t timeOutUs)
+{
+  uint16_t tempTime = timeOutDelay;
+  timeOutDelay = min((timeOutUs + 999) / 1000, (uint32_t)0xFFFF);
+  uint8_t stat = busTransfer(address, flags, registerAddress, dataBuffer, numberBytes);
+  timeOutDelay = tempTime;
+  return (stat);
+}
+
+/////////////// Private Methods ////////////////////////////////////////
+
+void I2C::lockUp()
+{
+  TWCR = 0;                     //releases SDA and SCL lines to high impedance
+  TWCR = _BV(TWEN) | _BV(TWEA); //reinitialize TWI
+  currentDevice = 0;
+}
+
+//Runs a transfer unless the circuit breaker of the device is open,
+//repeating it as the retry policy allows
+uint8_t I2C::transfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer, uint16_t numberBytes)
+{
+  uint8_t stat = healthCheck(address);
+  if (stat)
+  {
+    return (stat);
+  }
+  uint8_t limit = retriesFor(address, &flags);
+  uint8_t attempt = 0;
+  do
+  {
+    stat = busTransfer(address, flags, registerAddress, dataBuffer, numberBytes);
+    healthUpdate(address, stat);
+  } while (retryAfter(address, stat, flags, attempt++, limit));
+  return (stat);
+}
+
+//The transfer all read and write methods share: START, SLA+W, the register
+//address (TRANSACTION_REG16: 2 bytes, TRANSACTION_NO_REGISTER: none) and the
+//data for a write; for a read a repeated START, SLA+R and the data, or right
+//away SLA+R without a register. Ends with a STOP. TWSR is read once per step
+//and the bytes read are counted for available() once at the end. The data
+//bytes go through sendBulk()/receiveBulk() unless a capture sink wants every
+//step. Returns the "TRANSMISSION TIMEOUT RETURN VALUES".
+uint8_t I2C::busTransfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer, uint16_t numberBytes)
+{
+  uint8_t stat;
+  uint8_t reading = flags & TRANSACTION_READ;
+  if (reading)
+  {
+    bytesAvailable = 0;
+    bufferIndex = 0;
+    if (numberBytes == 0)
+    {
+      numberBytes++;
+    }
+  }
+  useDevice(address);
+  stat = _start();
+  if (stat)
+  {
+    return (stat);
+  }
+  if (!reading || !(flags & TRANSACTION_NO_REGISTER))
+  {
+    stat = _sendAddress(SLA_W(address));
+    if (stat)
+    {
+      return (stat == 1 ? 2 : stat);
+    }
+    if (flags & TRANSACTION_REG16)
+    {
+      //Send MSB of register address
+      stat = _sendByte(registerAddress >> 8);
+      if (stat)
+      {
+        return (stat == 1 ? 3 : stat);
+      }
+    }
+    if (!(flags & TRANSACTION_NO_REGISTER))
+    {
+      stat = _sendByte(registerAddress & 0xFF);
+      if (stat)
+      {
+        return (stat == 1 ? 3 : stat);
+      }
+    }
+    if (!reading)
+    {
+      if (!captureSink && numberBytes)
+      {
+        stat = sendBulk(dataBuffer, numberBytes);
+        if (stat)
+        {
+          return (stat == 1 ? 3 : stat);
+        }
+      }
+      for (uint16_t i = 0; captureSink && i < numberBytes; i++)
+      {
+        stat = _sendByte(dataBuffer[i]);
+        if (stat)
+        {
+          return (stat == 1 ? 3 : stat);
+        }
+      }
+      stat = _stop();
+      return (stat == 1 ? 7 : stat);
+    }
+    stat = _start();
+    if (stat)
+    {
+      return (stat == 1 ? 4 : stat);
+    }
+  }
+  stat = _sendAddress(SLA_R(address));
+  if (stat)
+  {
+    return (stat == 1 ? 5 : stat);
+  }
+  uint16_t last = numberBytes - 1;
+  uint16_t i = 0;
+  if (flags & TRANSFER_WORD_CRC)
+  {
+    stat = receiveWords(dataBuffer, numberBytes, &i);
+  }
+  else if (!captureSink)
+  {
+    stat = receiveBulk(dataBuffer, numberBytes, &i);
+  }
+  for (; captureSink && !(flags & TRANSFER_WORD_CRC) && i < numberBytes; i++)
+  {
+    uint8_t ack = i != last;
+    stat = _receiveByte(ack);
+    if (stat != (ack ? MR_DATA_ACK : MR_DATA_NACK))
+    {
+      break;
+    }
+    dataBuffer[i] = TWDR;
+  }
+  bytesAvailable = i;
+  totalBytes = i;
+  if (i < numberBytes)
+  {
+    return (stat == 1 ? 6 : stat);
+  }
+  stat = _stop();
+  return (stat == 1 ? 7 : stat);
+}
+
+//Fast path for the data bytes of a write. TWDR and TWCR are written as soon
+//as TWINT sets and the status is ACK; fetching the next byte, the timeout and
+//the adaptive measurement happen while a byte is on the bus. Returns like
+//_sendByte().
+uint8_t I2C::sendBulk(const uint8_t *dataBuffer, uint16_t numberBytes)
+{
+  uint32_t limit = stepTimeOut();
+  uint8_t measure = adaptive && currentDevice;
+  const uint8_t *end = dataBuffer + numberBytes;
+  TWDR = *dataBuffer++;
+  TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+  unsigned long startingTime = (limit || measure) ? micros() : 0;
+  while (1)
+  {
+    uint8_t next = dataBuffer != end ? *dataBuffer : 0;
+    if (bulkWait(limit, startingTime))
+    {
+      return (1);
+    }
+    uint8_t bufferedStatus = TWI_STATUS;
+    if (bufferedStatus != MT_DATA_ACK)
+    {
+      if (bufferedStatus == MT_DATA_NACK)
+      {
+        _stop();
+      }
+      else
+      {
+        lockUp();
+      }
+      return (bufferedStatus);
+    }
+    if (dataBuffer == end)
+    {
+      if (measure)
+      {
+        learnWait(micros() - startingTime);
+      }
+      return (0);
+    }
+    TWDR = next;
+    TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+    dataBuffer++;
+    if (limit || measure)
+    {
+      unsigned long now = micros();
+      if (measure)
+      {
+        learnWait(now - startingTime);
+      }
+      startingTime = now;
+    }
+  }
+}
+
+//Fast path for the data bytes of a read, the last one is NACKed. After
+//TWINT sets only TWSR and TWDR are read before TWCR starts the next byte;
+//storing the byte, the timeout and the adaptive measurement happen while the
+//next one is on the bus. Stores the number of bytes received in *received
+//and returns like _receiveByte(), 0 once all were received.
+uint8_t I2C::receiveBulk(uint8_t *dataBuffer, uint16_t numberBytes, uint16_t *received)
+{
+  uint32_t limit = stepTimeOut();
+  uint8_t measure = adaptive && currentDevice;
+  uint8_t *target = dataBuffer;
+  uint8_t *last = dataBuffer + numberBytes - 1;
+  uint8_t control = (1 << TWINT) | (1 << TWEN) | twiInterrupt | (target != last ? (1 << TWEA) : 0);
+  TWCR = control;
+  unsigned long startingTime = (limit || measure) ? micros() : 0;
+  uint8_t bufferedStatus = 0;
+  while (1)
+  {
+    uint8_t expected = (control & (1 << TWEA)) ? MR_DATA_ACK : MR_DATA_NACK;
+    if (target + 1 == last)
+    {
+      control = (1 << TWINT) | (1 << TWEN) | twiInterrupt;
+    }
+    if (bulkWait(limit, startingTime))
+    {
+      bufferedStatus = 1;
+      break;
+    }
+    bufferedStatus = TWI_STATUS;
+    uint8_t value = TWDR;
+    if (bufferedStatus != expected)
+    {
+      if (bufferedStatus == LOST_ARBTRTN)
+      {
+        lockUp();
+      }
+      break;
+    }
+    if (target != last)
+    {
+      TWCR = control;
+    }
+    *target = value;
+    if (limit || measure)
+    {
+      unsigned long now = micros();
+      if (measure)
+      {
+        learnWait(now - startingTime);
+      }
+      startingTime = now;
+    }
+    if (target++ == last)
+    {
+      bufferedStatus = 0;
+      break;
+    }
+  }
+  *received = target - dataBuffer;
+  return (bufferedStatus);
+}
+
+//Receives numberBytes of payload sent as 2 byte words each followed by a
+//CRC-8 and stores only the payload. Without a capture sink it re-arms TWCR
+//right after each data byte like receiveBulk() and updates the CRC while the
+//next byte is on the bus; a CRC byte is compared before the next byte is
+//requested. Returns like receiveBulk() with the payload bytes of the words
+//that matched in *received, or WORD_CRC_ERROR after ending the transfer.
+uint8_t I2C::receiveWords(uint8_t *dataBuffer, uint16_t numberBytes, uint16_t *received)
+{
+  uint32_t limit = stepTimeOut();
+  uint8_t measure = adaptive && !captureSink && currentDevice;
+  uint16_t total = numberBytes + numberBytes / 2;
+  uint16_t stored = 0;
+  uint8_t crc = 0xFF;
+  uint8_t ack = total > 1;
+  unsigned long startingTime = 0;
+  *received = 0;
+  if (!captureSink)
+  {
+    TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt | (ack ? (1 << TWEA) : 0);
+    startingTime = (limit || measure) ? micros() : 0;
+  }
+  for (uint16_t n = 0; n < total; n++)
+  {
+    uint8_t bufferedStatus;
+    if (captureSink)
+    {
+      bufferedStatus = _receiveByte(ack);
+    }
+    else if (bulkWait(limit, startingTime))
+    {
+      return (1);
+    }
+    else
+    {
+      bufferedStatus = TWI_STATUS;
+    }
+    if (bufferedStatus != (ack ? MR_DATA_ACK : MR_DATA_NACK))
+    {
+      if (bufferedStatus == LOST_ARBTRTN && !captureSink)
+      {
+        lockUp();
+      }
+      return (bufferedStatus);
+    }
+    uint8_t value = TWDR;
+    uint8_t crcByte = n % 3 == 2;
+    if (crcByte && value != crc)
+    {
+      if (ack)
+      {
+        //the CRC byte was acknowledged, take one more byte to NACK it
+        _receiveByte(0);
+      }
+      _stop();
+      return (WORD_CRC_ERROR);
+    }
+    ack = n + 2 < total;
+    if (!captureSink && n + 1 < total)
+    {
+      TWCR = (1 << TWINT) | (1 << TWEN) | twiInterrupt | (ack ? (1 << TWEA) : 0);
+    }
+    if (crcByte)
+    {
+      crc = 0xFF;
+      *received = stored;
+    }
+    else
+    {
+      dataBuffer[stored++] = value;
+      crc ^= value;
+      for (uint8_t bit = 0; bit < 8; bit++)
+      {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+      }
+    }
+    if (!captureSink && (limit || measure))
+    {
+      unsigned long now = micros();
+      if (measure)
+      {
+        learnWait(now - startingTime);
+      }
+      startingTime = now;
+    }
+  }
+  return (0);
+}
+
+//Hands a record of the low-level step started at captureTime to the capture
+//sink, if there is one
+void I2C::record(uint8_t type, uint8_t data, uint8_t status)
+{
+  if (!captureSink)
+  {
+    return;
+  }
+  I2CCaptureRecord entry;
+  unsigned long elapsed = micros() - captureTime;
+  entry.type = type;
+  entry.data = data;
+  entry.status = status;
+  entry.duration = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+  entry.timestamp = captureTime;
+  captureSink(&entry);
+}
+
+//Applies the profile of a device before a transaction with it
+void I2C::useDevice(uint8_t address)
+{
+  I2CDevice *device = findDevice(address, 0);
+  uint8_t twbr = busTWBR;
+  if (device && device->twbr)
+  {
+    twbr = device->twbr;
+  }
+  if (TWBR != twbr)
+  {
+    TWBR = twbr;
+  }
+}
+
+//TWBR value for a bus speed in Hz. 0 is reserved for "use the bus speed" so
+//speeds beyond what TWBR can do are clamped to 1
+uint8_t I2C::bitRate(uint32_t frequency)
+{
+  uint32_t divider = F_CPU / frequency;
+  if (divider < 18)
+  {
+    return (1);
+  }
+  return (min((divider - 16) / 2, 0xFF));
+}
+
+//Checksum of the device table for saveProfiles()/loadProfiles()
+uint8_t I2C::profileChecksum()
+{
+  uint8_t sum = sizeof(devices);
+  const uint8_t *bytes = (const uint8_t *)devices;
+  for (uint16_t i = 0; i < sizeof(devices); i++)
+  {
+    sum += bytes[i];
+  }
+  return (sum);
+}
+
+//Reverses a big endian (MSB first) value for PROFILE_LSB_FIRST devices
+void I2C::orderBytes(uint8_t address, uint8_t *bytes, uint8_t numberBytes)
+{
+  I2CDevice *device = findDevice(address, 0);
+  if (!device || !(device->flags & PROFILE_LSB_FIRST))
+  {
+    return;
+  }
+  for (uint8_t i = 0, j = numberBytes - 1; i < j; i++, j--)
+  {
+    uint8_t swap = bytes[i];
+    bytes[i] = bytes[j];
+    bytes[j] = swap;
+  }
+}
+
+//Waits for the TWI hardware to complete the current step (TWINT set).
+//Returns 1 if it timed out, in which case the bus has been released. Also
+//records the wait for the adaptive timeout of the addressed device.
+uint8_t I2C::twiWait()
+{
+  uint32_t limit = stepTimeOut();
+  uint8_t measure = adaptive && currentDevice;
+  uint8_t sleep = twiInterrupt && (!limit || limit >= IDLE_SLEEP_MIN_TIMEOUT);
+  if (!limit && !measure)
+  {
+    while (!(TWCR & (1 << TWINT)))
+    {
+      if (sleep)
+      {
+        idleWait();
+      }
+    }
+    return (0);
+  }
+  unsigned long startingTime = micros();
   while (!(TWCR & (1 << TWINT)))
   {
-    if (!timeOutDelay)
+    if (sleep)
+    {
+      idleWait();
+    }
+    if (!limit)
     {
       continue;
     }
-    if ((millis() - startingTime) >= timeOutDelay)
+    if ((micros() - startingTime) >= limit)
+    {
+      lockUp();
+      return (1);
+    }
+  }
+  if (measure)
+  {
+    learnWait(micros() - startingTime);
+  }
+  return (0);
+}
+
+//Waits for TWINT like twiWait() with a timeout and start time the caller
+//keeps, so the bulk paths need no timer read between TWINT and the next byte
+uint8_t I2C::bulkWait(uint32_t limit, unsigned long startingTime)
+{
+  uint8_t sleep = twiInterrupt && (!limit || limit >= IDLE_SLEEP_MIN_TIMEOUT);
+  while (!(TWCR & (1 << TWINT)))
+  {
+    if (sleep)
+    {
+      idleWait();
+    }
+    if (limit && (micros() - startingTime) >= limit)
     {
       lockUp();
       return (1);
     }
   }
-  if (TWI_STATUS == MT_DATA_ACK)
+  return (0);
+}
+
+//Sleeps in idle mode until the next interrupt: TWI_vect when TWINT sets, or
+//at the latest the Timer0 overflow. TWINT is checked with interrupts off so
+//the wakeup can not be missed; sei() takes effect after the next
+//instruction, which is the sleep.
+void I2C::idleWait()
+{
+  if (!(SREG & (1 << SREG_I)))
   {
-    return (0);
+    return;
   }
-  uint8_t bufferedStatus = TWI_STATUS;
-  if (TWI_STATUS == MT_DATA_NACK)
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (!(TWCR & (1 << TWINT)))
   {
-    _stop();
-    return (bufferedStatus);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
   }
-  else
+  sei();
+}
+
+//Records one step's wait in microseconds for the adaptive timeout of the
+//current device
+void I2C::learnWait(unsigned long elapsed)
+{
+  if (elapsed > 0xFFFF)
   {
-    lockUp();
-    return (bufferedStatus);
+    elapsed = 0xFFFF;
+  }
+  if (elapsed > currentDevice->maxWait)
+  {
+    currentDevice->maxWait = elapsed;
+  }
+  if (currentDevice->samples < 0xFF)
+  {
+    currentDevice->samples++;
   }
 }
 
-/*
- *  Description:
- *      Receives a byte from the slave. The ack parameter specifies whether or
- *      not to send an acknowledge signal after receiving it. If it is the last
- *      byte you want to receive it must be 0, so that the slave will stop
- *      transmitting and allow the master to send a stop.
- *  Parameters:
- *      ack - uint8_t
- *          Whether or not you want the master to acknowledge the receipt of the
- *          data byte. If this is the last byte being received, do not
- *          acknowledge.
- *          0: Do not send an ACK signal on receipt
- *          1 - 0xFF: Send an ACK signal on receipt
- *  Returns:
- *      uint8_t
- *          0: The data byte was successfully received
- *          1: The function timed out
- *          2 - 0xFF: See the datasheet
- */
-uint8_t I2C::_receiveByte(uint8_t ack)
+//Timeout in microseconds for the next step with the current device, 0 if
+//timeouts are disabled
+uint32_t I2C::stepTimeOut()
 {
-  unsigned long startingTime = millis();
-  if (ack)
+  uint32_t limit = (uint32_t)timeOutDelay * 1000;
+  if (currentDevice)
   {
-    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWEA);
+    if (currentDevice->timeOutUs)
+    {
+      return (currentDevice->timeOutUs);
+    }
+    if (adaptive && currentDevice->samples >= ADAPTIVE_MIN_SAMPLES)
+    {
+      uint32_t learned = (uint32_t)currentDevice->maxWait * ADAPTIVE_TIMEOUT_MARGIN + ADAPTIVE_TIMEOUT_SLACK;
+      if (!limit || learned < limit)
+      {
+        return (learned);
+      }
+    }
   }
-  else
+  return (limit);
+}
+
+//Looks up the device table entry of a 7 bit address. With SLOT_KEEP or
+//SLOT_TRACK an address without one gets a free slot, or one reclaimSlot()
+//gives up. Returns 0 if the device is not tracked.
+I2CDevice *I2C::findDevice(uint8_t address, uint8_t allocate)
+{
+  I2CDevice *freeSlot = 0;
+  for (uint8_t i = 0; i < MAX_DEVICES; i++)
   {
-    TWCR = (1 << TWINT) | (1 << TWEN);
+    if (devices[i].address == address)
+    {
+      return (&devices[i]);
+    }
+    if (!freeSlot && devices[i].address == FREE_SLOT)
+    {
+      freeSlot = &devices[i];
+    }
   }
-  while (!(TWCR & (1 << TWINT)))
+  if (!allocate)
+  {
+    return (0);
+  }
+  if (!freeSlot)
+  {
+    freeSlot = reclaimSlot(allocate);
+    if (!freeSlot)
+    {
+      return (0);
+    }
+  }
+  freeSlot->address = address;
+  freeSlot->samples = 0;
+  freeSlot->maxWait = 0;
+  freeSlot->timeOutUs = 0;
+  freeSlot->twbr = 0;
+  freeSlot->flags = 0;
+  freeSlot->retries = 0;
+  health[freeSlot - devices].state = HEALTH_OK;
+  health[freeSlot - devices].failures = 0;
+  health[freeSlot - devices].answered = 0;
+  return (freeSlot);
+}
+
+//Picks a slot to give to another device when none is free. Slots of
+//profiles (PROFILE_KEPT) are never given up. Of the others the one with the
+//least to lose goes: a device that never answered first, then the one with
+//the fewest adaptive samples. For SLOT_TRACK only slots with fewer than
+//ADAPTIVE_MIN_SAMPLES samples qualify, so a learned timeout stays. Returns 0
+//if no slot qualifies.
+I2CDevice *I2C::reclaimSlot(uint8_t allocate)
+{
+  I2CDevice *victim = 0;
+  uint16_t lowest = allocate == SLOT_TRACK ? ADAPTIVE_MIN_SAMPLES + 1 : 0x100 + 1;
+  for (uint8_t i = 0; i < MAX_DEVICES; i++)
   {
-    if (!timeOutDelay)
+    if (devices[i].flags & PROFILE_KEPT)
     {
       continue;
     }
-    if ((millis() - startingTime) >= timeOutDelay)
+    uint16_t value = health[i].answered || devices[i].samples ? devices[i].samples + 1 : 0;
+    if (value < lowest)
     {
-      lockUp();
-      return (1);
+      lowest = value;
+      victim = &devices[i];
     }
   }
-  if (TWI_STATUS == LOST_ARBTRTN)
+  return (victim);
+}
+
+//Retries allowed for a transaction with a device: the profile's count, or
+//the retry policy limit. Adds TRANSACTION_NOT_IDEMPOTENT to flags for a
+//PROFILE_NOT_IDEMPOTENT device.
+uint8_t I2C::retriesFor(uint8_t address, uint8_t *flags)
+{
+  I2CDevice *device = findDevice(address, 0);
+  if (device && (device->flags & PROFILE_NOT_IDEMPOTENT))
   {
-    uint8_t bufferedStatus = TWI_STATUS;
-    lockUp();
-    return (bufferedStatus);
+    *flags |= TRANSACTION_NOT_IDEMPOTENT;
   }
-  return (TWI_STATUS);
+  return (device && device->retries ? device->retries : retryMax);
 }
 
-/*
- *  Description:
- *      Receives a byte from the slave. The ack parameter specifies whether or
- *      not to send an acknowledge signal after receiving it. If it is the last
- *      byte you want to receive it must be 0, so that the slave will stop
- *      transmitting and allow the master to send a stop.
- *  Parameters:
- *      ack - uint8_t
- *          Whether or not you want the master to acknowledge the receipt of the
- *          data byte. If this is the last byte being received, do not
- *          acknowledge.
- *          0: Do not send an ACK signal on receipt
- *          1 - 0xFF: Send an ACK signal on receipt
- *      *target - uint8_t
- *          A byte to store the received data.
- *  Returns:
- *      uint8_t
- *          0: The data byte was successfully received
- *          6: The function timed out
- *          1 - 5 and 7 - 0xFF: See the datasheet
- */
-uint8_t I2C::_receiveByte(uint8_t ack, uint8_t *target)
+//Decides after attempt (0 for the first) whether a transaction is repeated,
+//waiting out the retry delay if so, and counts the outcome. A transaction
+//with TRANSACTION_NOT_IDEMPOTENT in flags is only repeated if the device
+//has not seen a byte of it, and none once the circuit breaker has taken
+//the device offline.
+uint8_t I2C::retryAfter(uint8_t address, uint8_t stat, uint8_t flags, uint8_t attempt, uint8_t limit)
 {
-  uint8_t stat = I2C::_receiveByte(ack);
-  if (stat == 1)
+  if (!stat)
   {
-    return (6);
+    if (attempt)
+    {
+      retryTotals.recovered++;
+    }
+    return (0);
   }
-  if (ack)
+  if (!limit)
   {
-    if (stat != MR_DATA_ACK)
+    return (0);
+  }
+  uint8_t failure = 0;
+  if (stat >= 1 && stat <= 7)
+  {
+    failure = RETRY_TIMEOUT;
+  }
+  else if (stat == MT_SLA_NACK || stat == MR_SLA_NACK)
+  {
+    failure = RETRY_ADDRESS_NACK;
+  }
+  else if (stat == MT_DATA_NACK)
+  {
+    failure = RETRY_DATA_NACK;
+  }
+  else if (stat == LOST_ARBTRTN)
+  {
+    failure = RETRY_ARBITRATION;
+  }
+  else if (stat == SMBUS_PEC_ERROR || stat == WORD_CRC_ERROR)
+  {
+    failure = RETRY_CHECKSUM;
+  }
+  if (!(failure & retryOn) || attempt >= limit || deviceHealth(address) == HEALTH_OPEN)
+  {
+    if (attempt)
     {
-      *target = 0x0;
-      return (stat);
+      retryTotals.exhausted++;
+    }
+    return (0);
+  }
+  //steps 1 and 2 are the START and SLA+W, MR_SLA_NACK comes before any data
+  if ((flags & TRANSACTION_NOT_IDEMPOTENT) && stat > 2 && failure != RETRY_ADDRESS_NACK)
+  {
+    retryTotals.refused++;
+    if (attempt)
+    {
+      retryTotals.exhausted++;
+    }
+    return (0);
+  }
+  retryTotals.retries++;
+  uint32_t wait = retryDelay;
+  for (uint8_t i = 0; i < attempt && wait < retryMaxDelay; i++)
+  {
+    wait <<= 1;
+  }
+  if (retryMaxDelay && wait > retryMaxDelay)
+  {
+    wait = retryMaxDelay;
+  }
+  retryWait(wait);
+  return (1);
+}
+
+//Waits out a retry delay of wait microseconds. With idle sleep the CPU
+//sleeps until less than a Timer0 period is left, which is then polled;
+//without it the whole delay is polled, at most RETRY_POLL_MAX_DELAY.
+void I2C::retryWait(uint32_t wait)
+{
+  uint8_t sleep = twiInterrupt && (SREG & (1 << SREG_I));
+  if (!sleep && wait > RETRY_POLL_MAX_DELAY)
+  {
+    wait = RETRY_POLL_MAX_DELAY;
+  }
+  unsigned long startingTime = micros();
+  unsigned long elapsed;
+  while ((elapsed = micros() - startingTime) < wait)
+  {
+    if (sleep && wait - elapsed >= IDLE_SLEEP_MIN_TIMEOUT)
+    {
+      idleWait();
+    }
+  }
+}
+
+//Returns DEVICE_OFFLINE while the circuit breaker of a device is open and
+//its next probe is not due yet, otherwise 0
+uint8_t I2C::healthCheck(uint8_t address)
+{
+  if (!breakerThreshold)
+  {
+    return (0);
+  }
+  I2CDevice *device = findDevice(address, 0);
+  if (!device || health[device - devices].state != HEALTH_OPEN)
+  {
+    return (0);
+  }
+  if ((long)(millis() - health[device - devices].probeAt) < 0)
+  {
+    return (DEVICE_OFFLINE);
+  }
+  healthChange(device - devices, HEALTH_PROBING);
+  return (0);
+}
+
+//Counts a failed transaction (timeout or address NACK) against a device, or
+//clears its failures if the status proves it answered: success, a data NACK
+//after its address was acknowledged, or a bad PEC, block count or CRC in
+//data it sent. Anything else, e.g. lost arbitration, says nothing about the
+//device and leaves the count alone; an open device whose probe ended that
+//way is probed again after the same backoff. Opens the breaker at the
+//threshold or when a probe fails, doubling the backoff for each failed probe.
+void I2C::healthUpdate(uint8_t address, uint8_t stat)
+{
+  if (!breakerThreshold)
+  {
+    return;
+  }
+  uint8_t failed = (stat >= 1 && stat <= 7) || stat == MT_SLA_NACK || stat == MR_SLA_NACK;
+  uint8_t answered = !stat || stat == MT_DATA_NACK || stat == SMBUS_PEC_ERROR || stat == SMBUS_BLOCK_ERROR ||
+                     stat == WORD_CRC_ERROR;
+  I2CDevice *device = findDevice(address, failed ? SLOT_TRACK : SLOT_NONE);
+  if (!device)
+  {
+    return;
+  }
+  I2CHealth *entry = &health[device - devices];
+  if (answered)
+  {
+    entry->failures = 0;
+    healthChange(device - devices, HEALTH_OK);
+    return;
+  }
+  if (!failed)
+  {
+    if (entry->state == HEALTH_PROBING)
+    {
+      entry->probeAt = millis() + entry->backoff;
+      healthChange(device - devices, HEALTH_OPEN);
     }
+    return;
+  }
+  if (entry->failures < 0xFF)
+  {
+    entry->failures++;
+  }
+  if (entry->state == HEALTH_PROBING)
+  {
+    entry->backoff = min((uint32_t)entry->backoff * 2, (uint32_t)breakerMaxBackoff);
+  }
+  else if (entry->failures >= breakerThreshold)
+  {
+    entry->backoff = breakerBackoff;
   }
   else
   {
-    if (stat != MR_DATA_NACK)
+    healthChange(device - devices, HEALTH_FAILING);
+    return;
+  }
+  entry->probeAt = millis() + entry->backoff;
+  healthChange(device - devices, HEALTH_OPEN);
+}
+
+//Moves a slot to a new health state and tells the health sink
+void I2C::healthChange(uint8_t slot, uint8_t state)
+{
+  uint8_t from = health[slot].state;
+  if (from == state)
+  {
+    return;
+  }
+  health[slot].state = state;
+  if (healthSink)
+  {
+    healthSink(devices[slot].address, from, state);
+  }
+}
+
+//Executes the next step (chunk) of a queued transaction and advances bytesDone
+uint8_t I2C::runStep(I2CTransaction *transaction)
+{
+  uint16_t step = transaction->numberBytes - transaction->bytesDone;
+  if (transaction->chunkSize && step > transaction->chunkSize)
+  {
+    step = transaction->chunkSize;
+  }
+  if (transaction->channel)
+  {
+    uint8_t stat = selectChannel(transaction->channel);
+    if (stat)
     {
-      *target = 0x0;
       return (stat);
     }
   }
-  *target = TWDR;
-  // I suppose that if we get this far we're ok
-  return 0;
+  uint8_t stat = transfer(transaction->address, transaction->flags,
+                          transaction->registerAddress + transaction->bytesDone,
+                          transaction->dataBuffer + transaction->bytesDone, step);
+  if (!stat)
+  {
+    transaction->bytesDone += step;
+  }
+  return (stat);
 }
 
-/*
- *  Description:
- *      Send out a stop condition
- *  Parameters:
- *      none
- *  Returns:
- *      uint8_t
- *          0: The stop condition was successfully sent
- *          1: The function timed out
- *          2 - 0xFF: See the datasheet
- */
-uint8_t I2C::_stop()
+//Runs an SMBus transaction unless the circuit breaker of the device is
+//open, repeating it as the retry policy allows
+uint8_t I2C::smbus(uint8_t address, uint8_t command, uint8_t flags, const uint8_t *sendBuffer, uint8_t sendBytes,
+                   uint8_t *receiveBuffer, uint8_t *receiveBytes)
 {
-  unsigned long startingTime = millis();
-  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
-  while ((TWCR & (1 << TWSTO)))
+  uint8_t stat = healthCheck(address);
+  if (stat)
+  {
+    return (stat);
+  }
+  uint8_t idempotence = 0;
+  uint8_t limit = retriesFor(address, &idempotence);
+  uint8_t attempt = 0;
+  do
+  {
+    stat = smbusTransfer(address, command, flags, sendBuffer, sendBytes, receiveBuffer, receiveBytes);
+    healthUpdate(address, stat);
+  } while (retryAfter(address, stat, idempotence, attempt++, limit));
+  return (stat);
+}
+
+//The SMBus protocols: START, SLA+W, the command and the bytes to send, then
+//either the PEC and a STOP, or a repeated START, SLA+R, the bytes to receive
+//and the PEC. The PEC is updated as each byte goes over the bus; the one
+//received makes the CRC 0 if the transaction arrived intact. receiveBytes
+//is the number of bytes to receive, with SMBUS_RECEIVE_COUNT the most that
+//fit, and is set to the count the slave sent.
+uint8_t I2C::smbusTransfer(uint8_t address, uint8_t command, uint8_t flags, const uint8_t *sendBuffer,
+                           uint8_t sendBytes, uint8_t *receiveBuffer, uint8_t *receiveBytes)
+{
+  I2CDevice *device = findDevice(address, 0);
+  uint8_t pec = device && (device->flags & PROFILE_PEC);
+  uint8_t crc = 0;
+  useDevice(address);
+  uint8_t stat = _start();
+  if (stat)
+  {
+    return (stat);
+  }
+  stat = _sendAddress(SLA_W(address));
+  if (stat)
+  {
+    return (stat == 1 ? 2 : stat);
+  }
+  crc = pgm_read_byte(&pecTable[SLA_W(address)]);
+  stat = smbusSend(command, &crc);
+  if (!stat && (flags & SMBUS_SEND_COUNT))
+  {
+    stat = smbusSend(sendBytes, &crc);
+  }
+  for (uint8_t i = 0; !stat && i < sendBytes; i++)
+  {
+    stat = smbusSend(sendBuffer[i], &crc);
+  }
+  if (!stat && pec && !receiveBuffer)
+  {
+    stat = smbusSend(crc, &crc);
+  }
+  if (stat)
+  {
+    return (stat);
+  }
+  if (!receiveBuffer)
+  {
+    stat = _stop();
+    return (stat == 1 ? 7 : stat);
+  }
+  stat = _start();
+  if (stat)
+  {
+    return (stat == 1 ? 4 : stat);
+  }
+  stat = _sendAddress(SLA_R(address));
+  if (stat)
   {
-    if (!timeOutDelay)
+    return (stat == 1 ? 5 : stat);
+  }
+  crc = pgm_read_byte(&pecTable[crc ^ SLA_R(address)]);
+  uint8_t expected = *receiveBytes;
+  uint8_t counted = !(flags & SMBUS_RECEIVE_COUNT);
+  uint8_t received = 0;
+  uint8_t ack = 1;
+  while (ack)
+  {
+    //the count byte is always followed by data
+    ack = !counted || expected - received + pec > 1;
+    stat = _receiveByte(ack);
+    if (stat != (ack ? MR_DATA_ACK : MR_DATA_NACK))
     {
-      continue;
+      return (stat == 1 ? 6 : stat);
     }
-    if ((millis() - startingTime) >= timeOutDelay)
+    uint8_t value = TWDR;
+    crc = pgm_read_byte(&pecTable[crc ^ value]);
+    if (!counted)
     {
-      lockUp();
-      return (1);
+      if (!value || value > expected)
+      {
+        _receiveByte(0);
+        _stop();
+        return (SMBUS_BLOCK_ERROR);
+      }
+      expected = value;
+      *receiveBytes = value;
+      counted = 1;
+    }
+    else if (received < expected)
+    {
+      receiveBuffer[received++] = value;
     }
   }
+  stat = _stop();
+  if (stat)
+  {
+    return (stat == 1 ? 7 : stat);
+  }
+  return (pec && crc ? SMBUS_PEC_ERROR : 0);
+}
+
+//Sends a byte of an SMBus transaction and adds it to the PEC, returns like
+//the data bytes in transfer()
+uint8_t I2C::smbusSend(uint8_t value, uint8_t *crc)
+{
+  uint8_t stat = _sendByte(value);
+  if (stat)
+  {
+    return (stat == 1 ? 3 : stat);
+  }
+  *crc = pgm_read_byte(&pecTable[*crc ^ value]);
   return (0);
 }
 
-/////////////// Private Methods ////////////////////////////////////////
+//Selects a MUX_CHANNEL() unless it already is, see I2c.muxSelect()
+uint8_t I2C::selectChannel(uint8_t muxChannel)
+{
+  if (muxChannel == muxSelected)
+  {
+    return (0);
+  }
+  uint8_t mux = MUX_ADDRESS(muxChannel);
+  uint8_t stat;
+  //an enabled channel of another multiplexer would put its devices on the bus too
+  for (uint8_t i = 0; i < 8 && muxSelected; i++)
+  {
+    uint8_t other = 0x70 | i;
+    if (other != mux && (muxUsed & (1 << i)) &&
+        (muxSelected == MUX_UNKNOWN || MUX_ADDRESS(muxSelected) == other))
+    {
+      stat = transfer(other, TRANSACTION_WRITE, 0, 0, 0);
+      if (stat)
+      {
+        muxSelected = MUX_UNKNOWN;
+        return (stat);
+      }
+    }
+  }
+  muxUsed |= 1 << (mux & 0x07);
+  stat = transfer(mux, TRANSACTION_WRITE, 1 << (muxChannel & 0x07), 0, 0);
+  muxSelected = stat ? MUX_UNKNOWN : muxChannel;
+  return (stat);
+}
 
-void I2C::lockUp()
+#ifdef I2C_IDLE_SLEEP
+//Wakes a call sleeping in idleWait(). TWINT stays set until the next step
+//is started, so TWIE is cleared to end the interrupt; TWINT is written as 0,
+//which leaves it set.
+ISR(TWI_vect)
 {
-  TWCR = 0;                     //releases SDA and SCL lines to high impedance
-  TWCR = _BV(TWEN) | _BV(TWEA); //reinitialize TWI
+  TWCR = TWCR & ~((1 << TWIE) | (1 << TWINT));
 }
+#endif
 
 I2C I2c = I2C();
@@ -60,28 +60,132 @@
 #endif
 
 #include <inttypes.h>
+#include "I2CDefs.h"
 
 #ifndef I2C_h
 #define I2C_h
 
-#define START 0x08
-#define REPEATED_START 0x10
-#define MT_SLA_ACK 0x18
-#define MT_SLA_NACK 0x20
-#define MT_DATA_ACK 0x28
-#define MT_DATA_NACK 0x30
-#define MR_SLA_ACK 0x40
-#define MR_SLA_NACK 0x48
-#define MR_DATA_ACK 0x50
-#define MR_DATA_NACK 0x58
-#define LOST_ARBTRTN 0x38
 #define TWI_STATUS (TWSR & 0xF8)
-#define SLA_W(address) (address << 1)
-#define SLA_R(address) ((address << 1) + 0x01)
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 
-#define MAX_BUFFER_SIZE 32
+//Idle sleep, see I2c.idleSleep(). Uncomment or build with -DI2C_IDLE_SLEEP
+//to use it; the library then defines ISR(TWI_vect) and can not be linked
+//together with Wire or another TWI library.
+//#define I2C_IDLE_SLEEP
+//Steps with a shorter timeout poll instead of sleeping: the Timer0 overflow
+//only wakes the CPU every 1024 us at 16 MHz
+#define IDLE_SLEEP_MIN_TIMEOUT 1024
+
+//Adaptive per-device timeouts, see I2c.adaptiveTimeOut()
+#define MAX_DEVICES 8
+#define FREE_SLOT 0xFF
+#define ADAPTIVE_MIN_SAMPLES 16   //steps measured before the learned timeout is used
+#define ADAPTIVE_TIMEOUT_MARGIN 2 //learned timeout = MARGIN * longest wait + SLACK
+#define ADAPTIVE_TIMEOUT_SLACK 200
+//How findDevice() gives a slot to an address that has none
+#define SLOT_NONE 0  //look up only
+#define SLOT_KEEP 1  //profile(), deviceTimeOut(): may reclaim any slot not kept
+#define SLOT_TRACK 2 //circuit breaker, adaptive timeouts: may reclaim a slot with little to lose
+
+//Flags for I2c.profile()
+#define PROFILE_REG16 0x01     //device takes 16-bit register addresses
+#define PROFILE_LSB_FIRST 0x02 //multi-byte values are sent LSB first
+#define PROFILE_PEC 0x04       //SMBus transactions carry a PEC byte
+#define PROFILE_NOT_IDEMPOTENT 0x08 //no transaction with the device is idempotent, see I2c.retryPolicy()
+#define PROFILE_KEPT 0x80      //set by the library: slot of profile() or deviceTimeOut(), never reclaimed
+#define PROFILE_MAGIC 0xA5     //marks profiles stored in EEPROM
+#define PROFILES_EEPROM_SIZE (MAX_DEVICES * sizeof(I2CDevice) + 2) //EEPROM bytes taken by I2c.saveProfiles()
+
+//Returned by the SMBus methods and I2c.readWords(). Never TWI status codes
+//since those always have the lowest 3 bits cleared.
+#define SMBUS_PEC_ERROR 0xF1   //the received PEC does not match the data
+#define SMBUS_BLOCK_ERROR 0xE9 //block count of 0 or larger than the buffer
+#define WORD_CRC_ERROR 0xE1    //a word's CRC does not match, the read was ended
+
+//Failures I2c.retryPolicy() repeats a transaction for
+#define RETRY_ADDRESS_NACK 0x01 //MT_SLA_NACK, MR_SLA_NACK, e.g. an EEPROM in its write cycle
+#define RETRY_DATA_NACK 0x02    //MT_DATA_NACK
+#define RETRY_TIMEOUT 0x04      //return values 1 - 7
+#define RETRY_ARBITRATION 0x08  //LOST_ARBTRTN
+#define RETRY_CHECKSUM 0x10     //SMBUS_PEC_ERROR, WORD_CRC_ERROR
+#define RETRY_NACK (RETRY_ADDRESS_NACK | RETRY_DATA_NACK)
+//Longest retry delay in microseconds without idle sleep, where the delay is
+//a busy wait that blocks the caller
+#define RETRY_POLL_MAX_DELAY 4000
+
+//Device health states, see I2c.circuitBreaker()
+#define HEALTH_OK 0      //the device answered its last transaction
+#define HEALTH_FAILING 1 //failed in a row, fewer times than the threshold
+#define HEALTH_OPEN 2    //transactions fail fast until the next probe is due
+#define HEALTH_PROBING 3 //the transaction in progress probes an open device
+//Returned without touching the bus while the circuit breaker of a device is
+//open. Never a TWI status code.
+#define DEVICE_OFFLINE 0xD9
+
+//Speeds tried by I2c.calibrateSpeed(), in Hz
+#define CALIBRATE_START 100000
+#define CALIBRATE_STEP 50000
+#define CALIBRATE_STEPS 19
+
+//Capture record types, see I2c.capture()
+#define CAPTURE_START 0x01        //data: TWBR at the time of the start
+#define CAPTURE_ADDRESS 0x02      //data: address byte including the R/W bit
+#define CAPTURE_SEND 0x03         //data: byte sent
+#define CAPTURE_RECEIVE_ACK 0x04  //data: byte received and acknowledged
+#define CAPTURE_RECEIVE_NACK 0x05 //data: byte received and not acknowledged
+#define CAPTURE_STOP 0x06         //data: unused
+//Packed record: type, data, status, duration (2 bytes), timestamp (4 bytes),
+//multi-byte fields LSB first. Capture files start with CAPTURE_HEADER.
+#define CAPTURE_RECORD_SIZE 9
+#define CAPTURE_HEADER "I2CC\x01"
+#define CAPTURE_HEADER_SIZE 5
+
+//One low-level bus step as seen by the library
+struct I2CCaptureRecord
+{
+  uint8_t type;       //CAPTURE_* type
+  uint8_t data;
+  uint8_t status;     //value returned by the low-level method
+  uint16_t duration;  //microseconds spent in the step, saturates at 0xFFFF
+  uint32_t timestamp; //micros() when the step started
+};
+
+typedef void (*I2CCaptureSink)(const I2CCaptureRecord *);
+
+//Per-device profile and state, indexed by 7 bit address
+struct I2CDevice
+{
+  uint8_t address;  //FREE_SLOT if unused
+  uint8_t samples;  //number of measured steps, saturates at 0xFF
+  uint16_t maxWait; //longest wait for the TWI hardware in microseconds
+  uint32_t timeOutUs; //user override in microseconds, 0 = none
+  uint8_t twbr;     //bit rate for this device, 0 = bus speed
+  uint8_t flags;    //PROFILE_* flags
+  uint8_t retries;  //times a NACKed register access is repeated
+};
+
+//Health of the device in the same slot of the device table. Kept apart from
+//I2CDevice so it is not stored with the profiles.
+struct I2CHealth
+{
+  uint8_t state;         //HEALTH_* state
+  uint8_t failures;      //failed transactions in a row, saturates at 0xFF
+  uint16_t backoff;      //milliseconds from the last failure to the next probe
+  unsigned long probeAt; //millis() when an open device is probed again
+  uint8_t answered;      //the device acknowledged its address since it got the slot
+};
+
+//Retry statistics, see I2c.retryCounts()
+struct I2CRetryCounts
+{
+  uint32_t retries;   //repeated attempts, a transaction repeated twice counts 2
+  uint32_t recovered; //transactions that succeeded after being repeated
+  uint32_t exhausted; //transactions that still failed after the last retry
+  uint32_t refused;   //failures not repeated since the transaction is not idempotent
+};
+
+typedef void (*I2CHealthSink)(uint8_t address, uint8_t from, uint8_t to);
 
 class I2C
 {
@@ -90,7 +194,17 @@ public:
   void begin();
   void end();
   void timeOut(uint16_t);
+  void adaptiveTimeOut(uint8_t);
+  void idleSleep(uint8_t);
+  void deviceTimeOut(uint8_t, uint32_t);
+  uint32_t deviceTimeOut(uint8_t);
   void setSpeed(uint8_t);
+  uint8_t profile(uint8_t, uint8_t, uint32_t, uint32_t = 0, uint8_t = 0);
+  uint32_t calibrateSpeed(uint8_t, uint16_t, uint8_t, uint8_t, uint8_t = 0, uint8_t * = 0, uint8_t = 0);
+  void saveProfiles(uint16_t);
+  uint8_t loadProfiles(uint16_t);
+  void capture(I2CCaptureSink);
+  static void packCapture(const I2CCaptureRecord *, uint8_t *);
   void pullup(uint8_t);
   void scan();
   uint8_t available();
@@ -125,6 +239,48 @@ public:
   uint8_t read16(uint8_t, uint16_t, uint8_t);
   uint8_t read16(uint8_t, uint16_t, uint8_t, uint8_t *);
 
+  //These functions pick the register address width from the device profile
+  uint8_t readRegister(uint8_t, uint16_t, uint8_t, uint8_t *);
+  uint8_t writeRegister(uint8_t, uint16_t, const uint8_t *, uint8_t);
+
+  //Reads of 2 byte words each followed by a CRC-8, e.g. Sensirion sensors
+  uint8_t readWords(uint8_t, uint16_t, uint8_t, uint8_t *);
+  uint8_t readWords(uint8_t, uint8_t, uint8_t *);
+
+  //Transaction queue
+  uint8_t transaction(I2CTransaction *);
+  uint8_t queue(I2CTransaction *);
+  uint8_t cancel(I2CTransaction *);
+  uint8_t service();
+  uint8_t pending();
+
+  //Bus layer of TwiBackend, see I2CMaster.h
+  uint8_t backendTransfer(uint8_t, uint8_t, uint16_t, uint8_t *, uint16_t, uint32_t);
+
+  //SMBus
+  uint8_t smbusReadWord(uint8_t, uint8_t, uint16_t *);
+  uint8_t smbusWriteWord(uint8_t, uint8_t, uint16_t);
+  uint8_t smbusProcessCall(uint8_t, uint8_t, uint16_t, uint16_t *);
+  uint8_t smbusBlockRead(uint8_t, uint8_t, uint8_t *, uint8_t, uint8_t *);
+  uint8_t smbusBlockWrite(uint8_t, uint8_t, const uint8_t *, uint8_t);
+
+  //Retries
+  void retryPolicy(uint8_t, uint8_t = RETRY_NACK, uint16_t = 0, uint16_t = 0);
+  void retryCounts(I2CRetryCounts *);
+  void clearRetryCounts();
+
+  //Device health
+  void circuitBreaker(uint8_t, uint16_t, uint16_t = 0);
+  uint8_t deviceHealth(uint8_t);
+  uint8_t deviceFailures(uint8_t);
+  void resetHealth(uint8_t);
+  void healthMonitor(I2CHealthSink);
+
+  //Multiplexers
+  uint8_t muxSelect(uint8_t, uint8_t);
+  uint8_t muxRelease();
+  void muxForget();
+
   //Low-level methods
   uint8_t _start();
   uint8_t _sendAddress(uint8_t);
@@ -135,9 +291,56 @@ public:
 
 private:
   void lockUp();
+  uint8_t twiWait();
+  uint8_t bulkWait(uint32_t, unsigned long);
+  void idleWait();
+  void learnWait(unsigned long);
+  uint32_t stepTimeOut();
+  I2CDevice *findDevice(uint8_t, uint8_t);
+  I2CDevice *reclaimSlot(uint8_t);
+  void useDevice(uint8_t);
+  void orderBytes(uint8_t, uint8_t *, uint8_t);
+  uint8_t bitRate(uint32_t);
+  uint8_t profileChecksum();
+  uint8_t runStep(I2CTransaction *);
+  uint8_t selectChannel(uint8_t);
+  uint8_t smbus(uint8_t, uint8_t, uint8_t, const uint8_t *, uint8_t, uint8_t *, uint8_t *);
+  uint8_t smbusTransfer(uint8_t, uint8_t, uint8_t, const uint8_t *, uint8_t, uint8_t *, uint8_t *);
+  uint8_t smbusSend(uint8_t, uint8_t *);
+  uint8_t transfer(uint8_t, uint8_t, uint16_t, uint8_t *, uint16_t);
+  uint8_t busTransfer(uint8_t, uint8_t, uint16_t, uint8_t *, uint16_t);
+  uint8_t retriesFor(uint8_t, uint8_t *);
+  uint8_t retryAfter(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
+  void retryWait(uint32_t);
+  uint8_t healthCheck(uint8_t);
+  void healthUpdate(uint8_t, uint8_t);
+  void healthChange(uint8_t, uint8_t);
+  uint8_t sendBulk(const uint8_t *, uint16_t);
+  uint8_t receiveBulk(uint8_t *, uint16_t, uint16_t *);
+  uint8_t receiveWords(uint8_t *, uint16_t, uint16_t *);
+  void record(uint8_t, uint8_t, uint8_t);
   uint8_t returnStatus;
-  uint8_t nack;
   uint8_t data[MAX_BUFFER_SIZE];
+  I2CTransaction *queueHead;
+  uint8_t muxSelected; //MUX_CHANNEL() of the enabled channel, 0 = none or MUX_UNKNOWN
+  uint8_t muxUsed;     //bit per multiplexer address the library has selected
+  I2CDevice devices[MAX_DEVICES];
+  I2CHealth health[MAX_DEVICES];
+  uint8_t retryMax;         //retries of devices without a profile retry count
+  uint8_t retryOn;          //RETRY_* failures that are repeated
+  uint16_t retryDelay;      //microseconds before the first retry
+  uint16_t retryMaxDelay;   //0 = retryDelay before every retry
+  I2CRetryCounts retryTotals;
+  uint8_t breakerThreshold; //failures in a row that open the breaker, 0 = off
+  uint16_t breakerBackoff;
+  uint16_t breakerMaxBackoff;
+  I2CHealthSink healthSink;
+  I2CDevice *currentDevice;
+  uint8_t adaptive;
+  uint8_t twiInterrupt; //_BV(TWIE) with idle sleep, added to every TWCR write that starts a step
+  uint8_t busTWBR;
+  I2CCaptureSink captureSink;
+  unsigned long captureTime;
   static uint8_t bytesAvailable;
   static uint8_t bufferIndex;
   static uint8_t totalBytes;
@@ -146,4 +349,24 @@ private:
 
 extern I2C I2c;
 
+//One channel of a multiplexer used like a bus of its own: every access
+//selects the channel through I2c.muxSelect() first
+class I2CMuxChannel
+{
+public:
+  I2CMuxChannel(uint8_t, uint8_t);
+  uint8_t select();
+  uint8_t write(uint8_t, uint8_t, uint8_t);
+  uint8_t write(uint8_t, uint8_t, const uint8_t *, uint8_t);
+  uint8_t write16(uint8_t, uint16_t, const uint8_t *, uint8_t);
+  uint8_t read(uint8_t, uint8_t, uint8_t, uint8_t *);
+  uint8_t read16(uint8_t, uint16_t, uint8_t, uint8_t *);
+  uint8_t readRegister(uint8_t, uint16_t, uint8_t, uint8_t *);
+  uint8_t writeRegister(uint8_t, uint16_t, const uint8_t *, uint8_t);
+
+private:
+  uint8_t mux;
+  uint8_t channel;
+};
+
 #endif
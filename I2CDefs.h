@@ -0,0 +1,87 @@
+/*
+  I2CDefs.h - I2C library
+  Bus status codes, transactions and TWI pins shared by the I2C class
+  and the I2CMaster template. Has no dependencies, so backends for other
+  platforms can use it too.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef I2CDefs_h
+#define I2CDefs_h
+
+#include <inttypes.h>
+
+#define START 0x08
+#define REPEATED_START 0x10
+#define MT_SLA_ACK 0x18
+#define MT_SLA_NACK 0x20
+#define MT_DATA_ACK 0x28
+#define MT_DATA_NACK 0x30
+#define MR_SLA_ACK 0x40
+#define MR_SLA_NACK 0x48
+#define MR_DATA_ACK 0x50
+#define MR_DATA_NACK 0x58
+#define LOST_ARBTRTN 0x38
+#define SLA_W(address) (address << 1)
+#define SLA_R(address) ((address << 1) + 0x01)
+
+#define MAX_BUFFER_SIZE 32
+
+//Flags for I2CTransaction
+#define TRANSACTION_WRITE 0x00
+#define TRANSACTION_READ 0x01
+#define TRANSACTION_REG16 0x02       //registerAddress is 16 bits wide
+#define TRANSACTION_NO_REGISTER 0x04 //no register address is sent (reads only)
+#define TRANSACTION_NOT_IDEMPOTENT 0x08 //only retried if no byte reached the device
+//Status of a transaction that has not completed yet. Never a TWI status code
+//since those always have the lowest 3 bits cleared
+#define TRANSACTION_PENDING 0xFF
+
+//Channel of a TCA9548A-style multiplexer at 0x70 - 0x77 a device is behind,
+//for I2CTransaction.channel and I2CMuxChannel
+#define MUX_CHANNEL(mux, channel) (0x80 | (((mux) & 0x07) << 3) | ((channel) & 0x07))
+#define MUX_ADDRESS(muxChannel) (0x70 | (((muxChannel) >> 3) & 0x07))
+#define MUX_UNKNOWN 0x40 //channel selection not known, see I2c.muxForget()
+#define MUX_NOT_SUPPORTED 0xD1 //I2CMaster does not select multiplexer channels
+
+//A bus transaction waiting in the queue, see I2c.queue() and I2c.service().
+//The caller owns the memory and must keep it (and dataBuffer) alive until
+//status is no longer TRANSACTION_PENDING.
+struct I2CTransaction
+{
+  uint8_t address;          //7 bit slave address
+  uint8_t flags;            //TRANSACTION_* flags
+  uint8_t priority;         //higher value is served first
+  uint16_t registerAddress; //starting register
+  uint8_t *dataBuffer;
+  uint16_t numberBytes;
+  uint16_t chunkSize;       //split into steps of at most this many bytes, 0 = don't split
+  uint8_t channel;          //MUX_CHANNEL(mux, channel) or 0 if not behind a multiplexer
+  volatile uint16_t bytesDone;
+  volatile uint8_t status;  //TRANSACTION_PENDING or see "TRANSMISSION TIMEOUT RETURN VALUES"
+  I2CTransaction *next;
+};
+
+//Port and bits of the TWI lines for the internal pull-ups
+#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328PB__)
+//as per note from atmega8 manual pg167
+#define TWI_PORT PORTC
+#define TWI_SDA 4
+#define TWI_SCL 5
+#elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__)
+//as per note from atmega644p manual pg108
+#define TWI_PORT PORTC
+#define TWI_SDA 1
+#define TWI_SCL 0
+#else
+//as per note from atmega128 manual pg204
+#define TWI_PORT PORTD
+#define TWI_SDA 1
+#define TWI_SCL 0
+#endif
+
+#endif
@@ -0,0 +1,305 @@
+/*
+  I2CLinux.h - I2C library
+  I2CMaster backend for Linux i2c-dev adapters (/dev/i2c-N), so device code
+  written against I2CMaster runs unchanged on Linux boards:
+
+      I2CMaster<LinuxBackend> bus;
+      bus.begin("/dev/i2c-1");
+      bus.read(HMC5883L, 0x03, 6, sample);
+
+  Every transaction is a single I2C_RDWR ioctl: a register read is a write
+  message with the register address and a read message joined by a repeated
+  START, a write is one message with the register address and the data.
+  batch() joins consecutive reads into one ioctl, see transferBatch().
+
+  Errors are mapped to the closest TWI status: ENXIO (address not
+  acknowledged) to MT_SLA_NACK or MR_SLA_NACK, EREMOTEIO (data not
+  acknowledged) to MT_DATA_NACK, EAGAIN (arbitration lost) to LOST_ARBTRTN
+  and ETIMEDOUT to 1, since the kernel does not tell the step. Adapters differ
+  in which of ENXIO and EREMOTEIO they use for an address NACK. Any other
+  failure returns LINUX_IO_ERROR with errno set.
+
+  The kernel's i2c-stub driver only implements SMBus transfers, not
+  I2C_RDWR. To run without an adapter begin() also takes a function that
+  stands in for the ioctl, see extras/host/i2clinux.cpp.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef I2CLinux_h
+#define I2CLinux_h
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <vector>
+
+#include "I2CDefs.h"
+
+//Returned for failures that have no TWI status, errno tells more. Never a
+//TWI status code since those always have the lowest 3 bits cleared.
+#define LINUX_IO_ERROR 0xF9
+
+//Runs one I2C_RDWR request, returns like ioctl()
+typedef int (*I2CRdwrFunction)(int, struct i2c_rdwr_ioctl_data *);
+
+class LinuxBackend
+{
+public:
+  LinuxBackend() : fd(-1), kernelTimeOut(0), rdwr(ioctlRdwr) {}
+  ~LinuxBackend() { end(); }
+
+  //Opens an adapter, e.g. "/dev/i2c-1". Returns 0, or errno if it can not be
+  //opened or does not support plain I2C transfers.
+  int begin(const char *device)
+  {
+    end();
+    fd = open(device, O_RDWR);
+    if (fd < 0)
+    {
+      return (errno);
+    }
+    unsigned long functions = 0;
+    if (ioctl(fd, I2C_FUNCS, &functions) < 0 || !(functions & I2C_FUNC_I2C))
+    {
+      int error = errno ? errno : EOPNOTSUPP;
+      end();
+      return (error);
+    }
+    rdwr = ioctlRdwr;
+    kernelTimeOut = 0;
+    return (0);
+  }
+
+  //Sends every transaction to standIn instead of an adapter
+  void begin(I2CRdwrFunction standIn)
+  {
+    end();
+    rdwr = standIn;
+  }
+
+  void end()
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  template <class TimeOut>
+  uint8_t transfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                   uint16_t numberBytes, const TimeOut &timeOut)
+  {
+    applyTimeOut(timeOut.limit());
+    struct i2c_msg messages[2];
+    struct i2c_rdwr_ioctl_data request = {messages, 0};
+    header.resize(headerSize(flags, numberBytes) + 1);
+    request.nmsgs = addMessages(address, flags, registerAddress, dataBuffer, numberBytes, &header[0], messages);
+    if (rdwr(fd, &request) < 0)
+    {
+      return (failure((flags & TRANSACTION_READ) && request.nmsgs == 1));
+    }
+    return (0);
+  }
+
+  //Runs transactions in order in as few I2C_RDWR ioctls as the message limit
+  //allows. Only consecutive reads without TRANSACTION_NOT_IDEMPOTENT are
+  //joined: every other transaction gets an ioctl of its own, so it ends with
+  //a STOP (an EEPROM only starts its write cycle on one). The kernel stops at
+  //the first message that fails without telling which, so the reads of a
+  //failed ioctl are run again one per ioctl for their own status. Returns
+  //the first non-zero status. The channel of a transaction is not looked at,
+  //I2CMaster::batch() refuses those with one.
+  template <class TimeOut>
+  uint8_t transferBatch(I2CTransaction **transactions, uint8_t count, const TimeOut &timeOut)
+  {
+    applyTimeOut(timeOut.limit());
+    uint8_t result = 0;
+    uint8_t first = 0;
+    while (first < count)
+    {
+      uint8_t last = first + 1;
+      if (joinable(transactions[first]->flags))
+      {
+        while (last < count && last - first < I2C_RDWR_IOCTL_MAX_MSGS / 2 && joinable(transactions[last]->flags))
+        {
+          last++;
+        }
+      }
+      uint8_t status = transferJoined(transactions + first, last - first);
+      if (status && last - first > 1)
+      {
+        status = 0;
+        for (uint8_t i = first; i < last; i++)
+        {
+          uint8_t own = transferJoined(transactions + i, 1);
+          if (own && !status)
+          {
+            status = own;
+          }
+        }
+      }
+      if (status && !result)
+      {
+        result = status;
+      }
+      first = last;
+    }
+    return (result);
+  }
+
+private:
+  //Whether a transaction may share an ioctl with others: running it again
+  //after a failed ioctl or without a STOP of its own does no harm
+  static bool joinable(uint8_t flags)
+  {
+    return ((flags & TRANSACTION_READ) && !(flags & TRANSACTION_NOT_IDEMPOTENT));
+  }
+
+  //Runs count transactions in one I2C_RDWR ioctl, sets their status and
+  //bytesDone and returns the status
+  uint8_t transferJoined(I2CTransaction **transactions, uint8_t count)
+  {
+    uint32_t size = 1;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      size += headerSize(transactions[i]->flags, transactions[i]->numberBytes);
+    }
+    header.resize(size);
+    struct i2c_msg messages[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_rdwr_ioctl_data request = {messages, 0};
+    uint8_t *at = &header[0];
+    for (uint8_t i = 0; i < count; i++)
+    {
+      I2CTransaction *t = transactions[i];
+      request.nmsgs += addMessages(t->address, t->flags, t->registerAddress, t->dataBuffer, t->numberBytes, at,
+                                   messages + request.nmsgs);
+      at += headerSize(t->flags, t->numberBytes);
+    }
+    uint8_t status = 0;
+    if (rdwr(fd, &request) < 0)
+    {
+      status = failure(count == 1 && (transactions[0]->flags & TRANSACTION_READ) && request.nmsgs == 1);
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+      transactions[i]->status = status;
+      transactions[i]->bytesDone = status ? 0 : transactions[i]->numberBytes;
+    }
+    return (status);
+  }
+
+  LinuxBackend(const LinuxBackend &);
+  LinuxBackend &operator=(const LinuxBackend &);
+
+  static int ioctlRdwr(int fd, struct i2c_rdwr_ioctl_data *request)
+  {
+    return (ioctl(fd, I2C_RDWR, request));
+  }
+
+  //Bytes of the write message: register address and data of a write
+  static uint16_t headerSize(uint8_t flags, uint16_t numberBytes)
+  {
+    uint16_t size = 0;
+    if (!(flags & TRANSACTION_NO_REGISTER))
+    {
+      size = (flags & TRANSACTION_REG16) ? 2 : 1;
+    }
+    if (!(flags & TRANSACTION_READ))
+    {
+      size += numberBytes;
+    }
+    return (size);
+  }
+
+  //Fills in the messages of one transaction with its write message stored
+  //at header, returns how many there are
+  static uint8_t addMessages(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                             uint16_t numberBytes, uint8_t *header, struct i2c_msg *messages)
+  {
+    uint8_t reading = flags & TRANSACTION_READ;
+    uint8_t count = 0;
+    if (!reading || !(flags & TRANSACTION_NO_REGISTER))
+    {
+      uint8_t *at = header;
+      if (!(flags & TRANSACTION_NO_REGISTER))
+      {
+        if (flags & TRANSACTION_REG16)
+        {
+          *at++ = registerAddress >> 8;
+        }
+        *at++ = registerAddress & 0xFF;
+      }
+      if (!reading)
+      {
+        memcpy(at, dataBuffer, numberBytes);
+        at += numberBytes;
+      }
+      messages[count].addr = address;
+      messages[count].flags = 0;
+      messages[count].len = at - header;
+      messages[count].buf = header;
+      count++;
+    }
+    if (reading)
+    {
+      messages[count].addr = address;
+      messages[count].flags = I2C_M_RD;
+      messages[count].len = numberBytes ? numberBytes : 1;
+      messages[count].buf = dataBuffer;
+      count++;
+    }
+    return (count);
+  }
+
+  //The kernel counts the timeout of a whole transfer in units of 10 ms, it
+  //is only changed when the policy's limit changes
+  void applyTimeOut(uint32_t limit)
+  {
+    unsigned long ticks = (limit + 9999) / 10000;
+    if (fd < 0 || !ticks || ticks == kernelTimeOut)
+    {
+      return;
+    }
+    if (ioctl(fd, I2C_TIMEOUT, ticks) == 0)
+    {
+      kernelTimeOut = ticks;
+    }
+  }
+
+  uint8_t failure(uint8_t readAddressed)
+  {
+    switch (errno)
+    {
+    case ENXIO:
+      return (readAddressed ? MR_SLA_NACK : MT_SLA_NACK);
+    case EREMOTEIO:
+      return (MT_DATA_NACK);
+    case EAGAIN:
+      return (LOST_ARBTRTN);
+    case ETIMEDOUT:
+      return (1);
+    default:
+      return (LINUX_IO_ERROR);
+    }
+  }
+
+  int fd;
+  unsigned long kernelTimeOut;
+  I2CRdwrFunction rdwr;
+  std::vector<uint8_t> header; //write messages, see addMessages()
+};
+
+#endif
+
+#endif
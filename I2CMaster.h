@@ -0,0 +1,368 @@
+/*
+  I2CMaster.h - I2C library
+  I2C master configured at compile time. The bus backend, the size of the
+  receive buffer, the timeout policy and the instrumentation are template
+  parameters, so features a sketch does not use take no RAM, flash or cycles:
+  no buffer with a BufferSize of 0, no timer reads with NoTimeOut, nothing
+  for NoInstrumentation, and members like scan() are only compiled in when
+  they are called.
+
+      I2CMaster<TwiBackend<0>, 0, FixedTimeOut<10> > bus;
+
+  is a master with a 10 ms timeout, no receive buffer and no internal
+  pull-ups. The I2c object of I2C.h stays the fully featured one with the
+  transaction queue, retries and the circuit breaker; I2CMaster<> has the
+  same defaults. TwiBackend shares the bus layer of I2c rather than having
+  one of its own, so what compiles away with TwiBackend is the front end
+  (buffer, timeout and instrumentation), not the I2c object; SoftBackend
+  and LinuxBackend do not use I2c at all.
+
+  A backend provides begin(), end() and
+
+      template <class TimeOut>
+      uint8_t transfer(uint8_t address, uint8_t flags, uint16_t registerAddress,
+                       uint8_t *dataBuffer, uint16_t numberBytes,
+                       const TimeOut &timeOut)
+
+  which runs one transaction with TRANSACTION_* flags like I2c.read() and
+  I2c.write() do (TRANSACTION_NO_REGISTER also applies to writes, an empty
+  write is an address probe), uses timeOut.limit() as the timeout of each
+  step in microseconds (0 disables it) and returns the "TRANSMISSION TIMEOUT
+  RETURN VALUES". Backends that can join transactions also provide
+  transferBatch(), see batch().
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifdef ARDUINO
+#if (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+#endif
+
+#include <inttypes.h>
+#include "I2CDefs.h"
+#ifdef ARDUINO
+#include "I2C.h"
+#endif
+
+#ifndef I2CMaster_h
+#define I2CMaster_h
+
+//Timeout policies. limit() is the timeout of each step in microseconds, a
+//constant 0 lets the compiler drop the timing code.
+struct NoTimeOut
+{
+  static uint32_t limit() { return (0); }
+};
+
+template <uint16_t timeOutMs>
+struct FixedTimeOut
+{
+  static uint32_t limit() { return ((uint32_t)timeOutMs * 1000); }
+};
+
+//Set at run time like I2c.timeOut(), disabled until then
+class RuntimeTimeOut
+{
+public:
+  RuntimeTimeOut() : timeOutDelay(0) {}
+  void timeOut(uint16_t timeOut) { timeOutDelay = timeOut; }
+  uint32_t limit() const { return ((uint32_t)timeOutDelay * 1000); }
+
+private:
+  uint16_t timeOutDelay;
+};
+
+//Instrumentation policies, told about every transaction when it has ended
+struct NoInstrumentation
+{
+  void transferred(uint8_t, uint8_t, uint16_t, uint8_t) {}
+};
+
+//Counts transactions, failed ones and data bytes moved by successful ones
+class CountingInstrumentation
+{
+public:
+  CountingInstrumentation() { clearCounts(); }
+  void transferred(uint8_t, uint8_t, uint16_t numberBytes, uint8_t status)
+  {
+    transactions++;
+    if (status)
+    {
+      failures++;
+    }
+    else
+    {
+      bytes += numberBytes;
+    }
+  }
+  void clearCounts()
+  {
+    transactions = 0;
+    failures = 0;
+    bytes = 0;
+  }
+  uint32_t transactions;
+  uint32_t failures;
+  uint32_t bytes;
+};
+
+//Receive buffer for read(address, numberBytes) and friends, empty for size 0
+template <uint8_t size>
+struct I2CBuffer
+{
+  I2CBuffer() : bytesAvailable(0), bufferIndex(0) {}
+  uint8_t data[size];
+  uint8_t bytesAvailable;
+  uint8_t bufferIndex;
+};
+
+template <>
+struct I2CBuffer<0>
+{
+};
+
+#ifdef ARDUINO
+//Backend for the AVR TWI hardware. It runs every transaction through the
+//bus layer of the I2C class (I2c.backendTransfer()), so it gets its bulk
+//fast paths, idle sleep, capture and device profiles, and with them the RAM
+//of the I2c object. pullups selects whether begin() enables the internal
+//pull-ups.
+template <uint8_t pullups = 1>
+class TwiBackend
+{
+public:
+  void begin()
+  {
+    I2c.begin();
+    if (!pullups)
+    {
+      I2c.pullup(0);
+    }
+  }
+
+  void end()
+  {
+    I2c.end();
+  }
+
+  void setSpeed(uint8_t fast)
+  {
+    I2c.setSpeed(fast);
+  }
+
+  template <class TimeOut>
+  uint8_t transfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                   uint16_t numberBytes, const TimeOut &timeOut)
+  {
+    return (I2c.backendTransfer(address, flags, registerAddress, dataBuffer, numberBytes, timeOut.limit()));
+  }
+};
+
+#define I2C_DEFAULT_BACKEND = TwiBackend<>
+#else
+#define I2C_DEFAULT_BACKEND
+#endif
+
+template <class Backend I2C_DEFAULT_BACKEND, uint8_t BufferSize = MAX_BUFFER_SIZE,
+          class TimeOutPolicy = RuntimeTimeOut, class Instrumentation = NoInstrumentation>
+class I2CMaster : public Backend, public TimeOutPolicy, public Instrumentation, private I2CBuffer<BufferSize>
+{
+public:
+  //Writes, see I2c.write() and I2c.write16()
+  uint8_t write(uint8_t address, uint8_t registerAddress)
+  {
+    return (run(address, TRANSACTION_WRITE, registerAddress, 0, 0));
+  }
+
+  uint8_t write(uint8_t address, uint8_t registerAddress, uint8_t data)
+  {
+    return (run(address, TRANSACTION_WRITE, registerAddress, &data, 1));
+  }
+
+  uint8_t write(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+  {
+    return (run(address, TRANSACTION_WRITE, registerAddress, (uint8_t *)data, numberBytes));
+  }
+
+  uint8_t write16(uint8_t address, uint16_t registerAddress)
+  {
+    return (run(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, 0, 0));
+  }
+
+  uint8_t write16(uint8_t address, uint16_t registerAddress, uint8_t data)
+  {
+    return (run(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, &data, 1));
+  }
+
+  uint8_t write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+  {
+    return (run(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, (uint8_t *)data, numberBytes));
+  }
+
+  //Reads into the internal buffer, see I2c.read(), I2c.read16(),
+  //available() and receive(). Need a BufferSize above 0.
+  uint8_t read(uint8_t address, uint8_t numberBytes)
+  {
+    return (readBuffer(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, numberBytes));
+  }
+
+  uint8_t read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes)
+  {
+    return (readBuffer(address, TRANSACTION_READ, registerAddress, numberBytes));
+  }
+
+  uint8_t read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes)
+  {
+    return (readBuffer(address, TRANSACTION_READ | TRANSACTION_REG16, registerAddress, numberBytes));
+  }
+
+  uint8_t available()
+  {
+    static_assert(BufferSize > 0, "available() needs a BufferSize above 0");
+    return (this->bytesAvailable);
+  }
+
+  uint8_t receive()
+  {
+    static_assert(BufferSize > 0, "receive() needs a BufferSize above 0");
+    if (!this->bytesAvailable)
+    {
+      return (0);
+    }
+    this->bytesAvailable--;
+    return (this->data[this->bufferIndex++]);
+  }
+
+  //Reads into the caller's buffer, see I2c.read(), I2c.readex() and
+  //I2c.read16()
+  uint8_t read(uint8_t address, uint8_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (run(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, dataBuffer, numberBytes));
+  }
+
+  uint8_t read(uint8_t address, uint8_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (run(address, TRANSACTION_READ, registerAddress, dataBuffer, numberBytes));
+  }
+
+  uint8_t readex(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (run(address, TRANSACTION_READ, registerAddress, dataBuffer, numberBytes));
+  }
+
+  uint8_t read16(uint8_t address, uint16_t registerAddress, uint8_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (run(address, TRANSACTION_READ | TRANSACTION_REG16, registerAddress, dataBuffer, numberBytes));
+  }
+
+  //Runs a transaction described like for I2c.queue(), priority and
+  //chunkSize are not used. A channel other than 0 is refused with
+  //MUX_NOT_SUPPORTED as only the I2C class selects multiplexer channels.
+  //Sets its status and bytesDone and returns status.
+  uint8_t transaction(I2CTransaction *transaction)
+  {
+    if (transaction->channel)
+    {
+      transaction->status = MUX_NOT_SUPPORTED;
+      transaction->bytesDone = 0;
+      return (MUX_NOT_SUPPORTED);
+    }
+    transaction->status = run(transaction->address, transaction->flags, transaction->registerAddress,
+                              transaction->dataBuffer, transaction->numberBytes);
+    transaction->bytesDone = transaction->status ? 0 : transaction->numberBytes;
+    return (transaction->status);
+  }
+
+  //Runs several transactions in one call of a backend with transferBatch(),
+  //like LinuxBackend, which joins consecutive reads by repeated STARTs
+  //instead of STOPs and runs the rest on their own. Sets their status and
+  //bytesDone and returns the first non-zero status. If one of them has a
+  //channel other than 0 none is run, all get MUX_NOT_SUPPORTED.
+  uint8_t batch(I2CTransaction **transactions, uint8_t count)
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if (transactions[i]->channel)
+      {
+        for (uint8_t j = 0; j < count; j++)
+        {
+          transactions[j]->status = MUX_NOT_SUPPORTED;
+          transactions[j]->bytesDone = 0;
+        }
+        return (MUX_NOT_SUPPORTED);
+      }
+    }
+    uint8_t status = Backend::transferBatch(transactions, count, static_cast<const TimeOutPolicy &>(*this));
+    for (uint8_t i = 0; i < count; i++)
+    {
+      Instrumentation::transferred(transactions[i]->address, transactions[i]->flags,
+                                   transactions[i]->numberBytes, transactions[i]->status);
+    }
+    return (status);
+  }
+
+#ifdef ARDUINO
+  //Prints the address of every device that acknowledges an empty write to
+  //out, e.g. Serial, like I2c.scan() does. Returns the number found.
+  template <class Output>
+  uint8_t scan(Output &out)
+  {
+    uint8_t found = 0;
+    for (uint8_t s = 0; s <= 0x7F; s++)
+    {
+      uint8_t status = run(s, TRANSACTION_WRITE | TRANSACTION_NO_REGISTER, 0, 0, 0);
+      if (!status)
+      {
+        out.print(F("Found device at address - 0x"));
+        out.println(s, HEX);
+        found++;
+      }
+      else if (status <= 7)
+      {
+        out.println(F("There is a problem with the bus, could not complete scan"));
+        break;
+      }
+    }
+    return (found);
+  }
+#endif
+
+private:
+  uint8_t run(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer, uint16_t numberBytes)
+  {
+    if ((flags & TRANSACTION_READ) && !numberBytes)
+    {
+      numberBytes++;
+    }
+    uint8_t status = Backend::transfer(address, flags, registerAddress, dataBuffer, numberBytes,
+                                       static_cast<const TimeOutPolicy &>(*this));
+    Instrumentation::transferred(address, flags, numberBytes, status);
+    return (status);
+  }
+
+  uint8_t readBuffer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t numberBytes)
+  {
+    static_assert(BufferSize > 0, "buffered reads need a BufferSize above 0");
+    if (numberBytes > BufferSize)
+    {
+      numberBytes = BufferSize;
+    }
+    if (!numberBytes)
+    {
+      numberBytes++;
+    }
+    this->bufferIndex = 0;
+    uint8_t status = run(address, flags, registerAddress, this->data, numberBytes);
+    this->bytesAvailable = status ? 0 : numberBytes;
+    return (status);
+  }
+};
+
+#endif
@@ -0,0 +1,369 @@
+/*
+  I2CSoft.h - I2C library
+  Bit-banged I2CMaster backend on any two pins, for extra buses and as a
+  fallback when the TWI peripheral is wedged. The pins are chosen at compile
+  time and driven through their PORT, DDR and PIN registers directly, so
+  every line change is a single sbi/cbi instruction:
+
+      I2C_SOFT_PIN(SensorSda, D, 2);
+      I2C_SOFT_PIN(SensorScl, D, 3);
+      I2CMaster<SoftBackend<SensorSda, SensorScl> > sensors;
+      sensors.begin();
+      sensors.read(HMC5883L, 0x03, 6, sample);
+
+  The lines are open drain: a line is pulled low by making the pin an output
+  (its PORT bit stays 0) and released by making it an input again, so
+  external pull-ups are needed. With pullups set the internal ones are
+  switched on while a line is released, which costs an extra instruction per
+  change and is too weak for 400 kHz anyway.
+
+  Each transaction runs the same sequence as the I2C class, a START, the
+  address, register and data bytes and a STOP, and returns the same values:
+  MT_SLA_NACK, MR_SLA_NACK and MT_DATA_NACK for missing ACKs, LOST_ARBTRTN
+  when SDA is low while it is released, and the step (2 - 7) if a slave
+  stretches the clock past the timeout, after which both lines are
+  released. begin() clocks out a slave that holds SDA low.
+
+  frequency sets the SCL clock. The half periods are waited in CPU cycles
+  less an allowance for the instructions between line changes, so the clock
+  is at most frequency but slower if the compiler spends more cycles than
+  allowed; it has not been measured on hardware. Clock stretching slows it
+  further.
+
+  A pin is any class with the static functions low(pullup), release(pullup),
+  high() and reset() that I2C_SOFT_PIN declares, and Delay any class with a
+  static wait(cycles), so the host checks in extras/host/i2csoft.cpp run the
+  backend against a simulated open-drain bus.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef I2CSoft_h
+#define I2CSoft_h
+
+#include "I2CMaster.h"
+
+//Declares a pin for SoftBackend, e.g. I2C_SOFT_PIN(Sda, C, 4) for PC4. A
+//line is pulled low by making the pin an output with its PORT bit 0 and
+//released by making it an input, with the internal pull-up if pullup is set.
+//reset() releases it without the pull-up.
+#define I2C_SOFT_PIN(name, port, bit)                    \
+  struct name                                            \
+  {                                                      \
+    static void low(uint8_t pullup)                      \
+    {                                                    \
+      if (pullup)                                        \
+      {                                                  \
+        PORT##port &= ~(1 << (bit));                     \
+      }                                                  \
+      DDR##port |= 1 << (bit);                           \
+    }                                                    \
+    static void release(uint8_t pullup)                  \
+    {                                                    \
+      DDR##port &= ~(1 << (bit));                        \
+      if (pullup)                                        \
+      {                                                  \
+        PORT##port |= 1 << (bit);                        \
+      }                                                  \
+    }                                                    \
+    static uint8_t high()                                \
+    {                                                    \
+      return (PIN##port & (1 << (bit)));                 \
+    }                                                    \
+    static void reset()                                  \
+    {                                                    \
+      DDR##port &= ~(1 << (bit));                        \
+      PORT##port &= ~(1 << (bit));                       \
+    }                                                    \
+  }
+
+#ifdef __AVR__
+//The default Delay of SoftBackend, busy waits a number of CPU cycles known
+//at compile time
+struct I2CCycleDelay
+{
+  __attribute__((always_inline)) static inline void wait(uint32_t cycles)
+  {
+    __builtin_avr_delay_cycles(cycles);
+  }
+};
+#else
+struct I2CCycleDelay;
+#endif
+
+template <class Sda, class Scl, uint32_t frequency = 400000, uint8_t pullups = 0, class Delay = I2CCycleDelay>
+class SoftBackend
+{
+public:
+  void begin()
+  {
+    Sda::reset();
+    Scl::reset();
+    release<Sda>();
+    release<Scl>();
+    //a slave that was interrupted in the middle of a read lets go of SDA
+    //after at most 9 clocks
+    for (uint8_t i = 0; i < 9 && !high<Sda>(); i++)
+    {
+      low<Scl>();
+      waitLow();
+      clockHigh(0);
+      waitHigh();
+    }
+    stop(1000);
+  }
+
+  void end()
+  {
+    Sda::reset();
+    Scl::reset();
+  }
+
+  template <class TimeOut>
+  uint8_t transfer(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                   uint16_t numberBytes, const TimeOut &timeOut)
+  {
+    uint32_t limit = timeOut.limit();
+    uint8_t reading = flags & TRANSACTION_READ;
+    uint8_t stat = start(limit);
+    if (stat)
+    {
+      return (stat);
+    }
+    if (!reading || !(flags & TRANSACTION_NO_REGISTER))
+    {
+      stat = send(SLA_W(address), MT_SLA_NACK, limit);
+      if (stat)
+      {
+        return (stat == 1 ? 2 : stat);
+      }
+      if (flags & TRANSACTION_REG16)
+      {
+        stat = send(registerAddress >> 8, MT_DATA_NACK, limit);
+        if (stat)
+        {
+          return (stat == 1 ? 3 : stat);
+        }
+      }
+      if (!(flags & TRANSACTION_NO_REGISTER))
+      {
+        stat = send(registerAddress & 0xFF, MT_DATA_NACK, limit);
+        if (stat)
+        {
+          return (stat == 1 ? 3 : stat);
+        }
+      }
+      if (!reading)
+      {
+        for (uint16_t i = 0; i < numberBytes; i++)
+        {
+          stat = send(dataBuffer[i], MT_DATA_NACK, limit);
+          if (stat)
+          {
+            return (stat == 1 ? 3 : stat);
+          }
+        }
+        return (stop(limit) ? 7 : 0);
+      }
+      stat = start(limit);
+      if (stat)
+      {
+        return (stat == 1 ? 4 : stat);
+      }
+    }
+    stat = send(SLA_R(address), MR_SLA_NACK, limit);
+    if (stat)
+    {
+      return (stat == 1 ? 5 : stat);
+    }
+    for (uint16_t i = 0; i < numberBytes; i++)
+    {
+      if (receive(dataBuffer + i, i != numberBytes - 1, limit))
+      {
+        return (6);
+      }
+    }
+    return (stop(limit) ? 7 : 0);
+  }
+
+private:
+  //CPU cycles of an SCL period and the part of each half spent waiting, the
+  //rest goes to the instructions between the line changes. SCL stays low a
+  //little longer than high, fast mode needs at least 1.3 us low and 0.6 us
+  //high.
+  static const uint32_t period = F_CPU / frequency;
+  static const uint32_t lowCycles = period * 11 / 20;
+  static const uint32_t lowWait = lowCycles > 8 ? lowCycles - 8 : 0;
+  static const uint32_t highWait = period - lowCycles > 6 ? period - lowCycles - 6 : 0;
+
+  template <class Line>
+  static void low()
+  {
+    Line::low(pullups);
+  }
+
+  template <class Line>
+  static void release()
+  {
+    Line::release(pullups);
+  }
+
+  template <class Line>
+  static uint8_t high()
+  {
+    return (Line::high());
+  }
+
+  static void waitLow()
+  {
+    Delay::wait(lowWait);
+  }
+
+  static void waitHigh()
+  {
+    Delay::wait(highWait);
+  }
+
+  //Releases SCL and waits while a slave stretches the clock. Returns 1 if it
+  //is still low after limit microseconds (0 waits for ever), in which case
+  //both lines have been released.
+  static uint8_t clockHigh(uint32_t limit)
+  {
+    release<Scl>();
+    //a few tries cover the rise time without reading the timer
+    for (uint8_t i = 0; i < 4; i++)
+    {
+      if (high<Scl>())
+      {
+        return (0);
+      }
+    }
+    unsigned long startingTime = limit ? micros() : 0;
+    while (!high<Scl>())
+    {
+      if (limit && (micros() - startingTime) >= limit)
+      {
+        release<Sda>();
+        return (1);
+      }
+    }
+    return (0);
+  }
+
+  //START or repeated START, returns 0, 1 if it timed out or LOST_ARBTRTN
+  //if SDA is held low
+  static uint8_t start(uint32_t limit)
+  {
+    release<Sda>();
+    waitLow();
+    if (clockHigh(limit))
+    {
+      return (1);
+    }
+    if (!high<Sda>())
+    {
+      return (LOST_ARBTRTN);
+    }
+    waitHigh();
+    low<Sda>();
+    waitHigh();
+    low<Scl>();
+    return (0);
+  }
+
+  //Address or data byte, returns 0 if it was acknowledged, 1 if it timed
+  //out, nack after sending a STOP if it was not acknowledged, or
+  //LOST_ARBTRTN after releasing the bus
+  static uint8_t send(uint8_t value, uint8_t nack, uint32_t limit)
+  {
+    for (uint8_t bit = 0x80; bit; bit >>= 1)
+    {
+      if (value & bit)
+      {
+        release<Sda>();
+      }
+      else
+      {
+        low<Sda>();
+      }
+      waitLow();
+      if (clockHigh(limit))
+      {
+        return (1);
+      }
+      if ((value & bit) && !high<Sda>())
+      {
+        return (LOST_ARBTRTN);
+      }
+      waitHigh();
+      low<Scl>();
+    }
+    release<Sda>();
+    waitLow();
+    if (clockHigh(limit))
+    {
+      return (1);
+    }
+    uint8_t acknowledged = !high<Sda>();
+    waitHigh();
+    low<Scl>();
+    if (acknowledged)
+    {
+      return (0);
+    }
+    stop(limit);
+    return (nack);
+  }
+
+  //Reads a byte and sends ack or a NACK, returns 1 if it timed out
+  static uint8_t receive(uint8_t *value, uint8_t ack, uint32_t limit)
+  {
+    uint8_t data = 0;
+    release<Sda>();
+    for (uint8_t i = 0; i < 8; i++)
+    {
+      waitLow();
+      if (clockHigh(limit))
+      {
+        return (1);
+      }
+      data = (data << 1) | (high<Sda>() ? 1 : 0);
+      waitHigh();
+      low<Scl>();
+    }
+    if (ack)
+    {
+      low<Sda>();
+    }
+    waitLow();
+    if (clockHigh(limit))
+    {
+      return (1);
+    }
+    waitHigh();
+    low<Scl>();
+    *value = data;
+    return (0);
+  }
+
+  //Returns 1 if the STOP timed out, in which case the bus has been released
+  static uint8_t stop(uint32_t limit)
+  {
+    low<Sda>();
+    waitLow();
+    if (clockHigh(limit))
+    {
+      return (1);
+    }
+    waitHigh();
+    release<Sda>();
+    //bus free time before the next START
+    waitLow();
+    return (0);
+  }
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+  I2CWorker.h - I2C library
+  Shares one bus between threads on hosts with C++11 threads, e.g. with
+  I2CMaster<LinuxBackend>. An I2CBusWorker owns the bus and runs its
+  transactions on a thread of its own; any thread submits transactions and
+  gets a std::future with the status. Submitting never takes a lock: the
+  transactions go through a lock-free multi-producer queue, and a mutex is
+  only touched to wake the worker when it sleeps on an empty queue.
+
+      I2CMaster<LinuxBackend> bus;
+      bus.begin("/dev/i2c-1");
+      I2CBusWorker<I2CMaster<LinuxBackend> > worker(bus, 8);
+      std::future<uint8_t> done = worker.read(HMC5883L, 0x03, 6, sample);
+      ...
+      if (done.get() == 0) ... //sample is filled in
+
+  The data buffer of a transaction must stay valid until its future is
+  ready. Each transaction runs as a whole, transactions from different
+  threads never interleave on the bus. With a maxBatch above 1 the worker
+  passes up to that many queued transactions to the bus in one batch() call,
+  i.e. one kernel call with LinuxBackend for queued reads; writes still get
+  a kernel call and a STOP each.
+
+  An I2CExecutor owns several buses with a worker each, so transactions on
+  different buses run in parallel, and takes the transactions for all of
+  them through one interface.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef I2CWorker_h
+#define I2CWorker_h
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "I2CDefs.h"
+
+template <class Master>
+class I2CBusWorker
+{
+public:
+  //Starts the worker thread, which owns bus from now on
+  I2CBusWorker(Master &bus, uint8_t maxBatch = 1)
+      : bus(bus), maxBatch(maxBatch ? maxBatch : 1), head(&stub), tail(&stub), queued(0), sleeping(false),
+        stopping(false)
+  {
+    stub.next.store(0);
+    worker = std::thread(&I2CBusWorker::run, this);
+  }
+
+  //Runs what is still queued, then stops the worker thread
+  ~I2CBusWorker()
+  {
+    stopping.store(true);
+    {
+      std::lock_guard<std::mutex> lock(sleepLock);
+      wake.notify_one();
+    }
+    worker.join();
+  }
+
+  std::future<uint8_t> read(uint8_t address, uint8_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (submit(address, TRANSACTION_READ, registerAddress, dataBuffer, numberBytes));
+  }
+
+  std::future<uint8_t> read(uint8_t address, uint16_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (submit(address, TRANSACTION_READ | TRANSACTION_NO_REGISTER, 0, dataBuffer, numberBytes));
+  }
+
+  std::future<uint8_t> read16(uint8_t address, uint16_t registerAddress, uint16_t numberBytes, uint8_t *dataBuffer)
+  {
+    return (submit(address, TRANSACTION_READ | TRANSACTION_REG16, registerAddress, dataBuffer, numberBytes));
+  }
+
+  std::future<uint8_t> write(uint8_t address, uint8_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+  {
+    return (submit(address, TRANSACTION_WRITE, registerAddress, (uint8_t *)data, numberBytes));
+  }
+
+  std::future<uint8_t> write16(uint8_t address, uint16_t registerAddress, const uint8_t *data, uint16_t numberBytes)
+  {
+    return (submit(address, TRANSACTION_WRITE | TRANSACTION_REG16, registerAddress, (uint8_t *)data, numberBytes));
+  }
+
+  //Any transaction, flags are TRANSACTION_* flags
+  std::future<uint8_t> submit(uint8_t address, uint8_t flags, uint16_t registerAddress, uint8_t *dataBuffer,
+                              uint16_t numberBytes)
+  {
+    Job *job = new Job;
+    I2CTransaction &t = job->transaction;
+    t.address = address;
+    t.flags = flags;
+    t.priority = 0;
+    t.registerAddress = registerAddress;
+    t.dataBuffer = dataBuffer;
+    t.numberBytes = numberBytes;
+    t.chunkSize = 0;
+    t.channel = 0;
+    t.bytesDone = 0;
+    t.status = TRANSACTION_PENDING;
+    t.next = 0;
+    std::future<uint8_t> done = job->done.get_future();
+    queued.fetch_add(1);
+    push(job);
+    if (sleeping.load())
+    {
+      std::lock_guard<std::mutex> lock(sleepLock);
+      wake.notify_one();
+    }
+    return (done);
+  }
+
+private:
+  struct Job
+  {
+    std::atomic<Job *> next;
+    I2CTransaction transaction;
+    std::promise<uint8_t> done;
+  };
+
+  I2CBusWorker(const I2CBusWorker &);
+  I2CBusWorker &operator=(const I2CBusWorker &);
+
+  //Intrusive multi-producer single-consumer queue after Dmitry Vyukov:
+  //producers swap themselves in at head, the worker takes from tail
+  void push(Job *job)
+  {
+    job->next.store(0, std::memory_order_relaxed);
+    Job *previous = head.exchange(job, std::memory_order_acq_rel);
+    previous->next.store(job, std::memory_order_release);
+  }
+
+  //Returns 0 if the queue is empty or a push is half done
+  Job *pop()
+  {
+    Job *first = tail;
+    Job *next = first->next.load(std::memory_order_acquire);
+    if (first == &stub)
+    {
+      if (!next)
+      {
+        return (0);
+      }
+      tail = next;
+      first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next)
+    {
+      tail = next;
+      return (first);
+    }
+    if (first != head.load(std::memory_order_acquire))
+    {
+      return (0);
+    }
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next)
+    {
+      tail = next;
+      return (first);
+    }
+    return (0);
+  }
+
+  void run()
+  {
+    std::vector<Job *> jobs;
+    std::vector<I2CTransaction *> transactions;
+    while (1)
+    {
+      jobs.clear();
+      Job *job;
+      while (jobs.size() < maxBatch && (job = pop()))
+      {
+        jobs.push_back(job);
+      }
+      if (jobs.empty())
+      {
+        if (queued.load())
+        {
+          //a producer has counted its job but not linked it in yet
+          std::this_thread::yield();
+          continue;
+        }
+        if (stopping.load())
+        {
+          return;
+        }
+        std::unique_lock<std::mutex> lock(sleepLock);
+        sleeping.store(true);
+        while (!queued.load() && !stopping.load())
+        {
+          wake.wait(lock);
+        }
+        sleeping.store(false);
+        continue;
+      }
+      queued.fetch_sub(jobs.size());
+      if (jobs.size() == 1)
+      {
+        bus.transaction(&jobs[0]->transaction);
+      }
+      else
+      {
+        transactions.clear();
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+          transactions.push_back(&jobs[i]->transaction);
+        }
+        bus.batch(&transactions[0], transactions.size());
+      }
+      for (size_t i = 0; i < jobs.size(); i++)
+      {
+        jobs[i]->done.set_value((uint8_t)jobs[i]->transaction.status);
+        delete jobs[i];
+      }
+    }
+  }
+
+  Master &bus;
+  size_t maxBatch;
+  std::atomic<Job *> head;
+  Job *tail;
+  Job stub;
+  std::atomic<uint32_t> queued; //submitted and not yet taken by the worker
+  std::atomic<bool> sleeping;
+  std::atomic<bool> stopping;
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  std::thread worker;
+};
+
+//Owns one Master and one I2CBusWorker per bus
+template <class Master>
+class I2CExecutor
+{
+public:
+  I2CExecutor(uint8_t maxBatch = 1) : maxBatch(maxBatch) {}
+
+  //Adds a bus with the next index and returns it for begin() and the other
+  //settings, which must be made before the first transaction on it
+  Master &addBus()
+  {
+    buses.push_back(std::unique_ptr<Master>(new Master));
+    workers.push_back(std::unique_ptr<I2CBusWorker<Master> >(new I2CBusWorker<Master>(*buses.back(), maxBatch)));
+    return (*buses.back());
+  }
+
+  uint8_t busCount() const { return (buses.size()); }
+
+  //The worker of a bus, to submit with read(), write() and so on
+  I2CBusWorker<Master> &on(uint8_t bus) { return (*workers[bus]); }
+
+  std::future<uint8_t> submit(uint8_t bus, uint8_t address, uint8_t flags, uint16_t registerAddress,
+                              uint8_t *dataBuffer, uint16_t numberBytes)
+  {
+    return (workers[bus]->submit(address, flags, registerAddress, dataBuffer, numberBytes));
+  }
+
+  //Waits for all results, returns how many transactions failed
+  static uint32_t collect(std::vector<std::future<uint8_t> > &results)
+  {
+    uint32_t failed = 0;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      if (results[i].get())
+      {
+        failed++;
+      }
+    }
+    results.clear();
+    return (failed);
+  }
+
+private:
+  I2CExecutor(const I2CExecutor &);
+  I2CExecutor &operator=(const I2CExecutor &);
+
+  uint8_t maxBatch;
+  //The workers are destroyed first, after running what is queued
+  std::vector<std::unique_ptr<Master> > buses;
+  std::vector<std::unique_ptr<I2CBusWorker<Master> > > workers;
+};
+
+#endif
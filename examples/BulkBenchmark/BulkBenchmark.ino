@@ -0,0 +1,116 @@
+/*******************************************
+ Measures the idle time between the bytes of a bulk
+ transfer, using a FRAM with 16 bit addresses (e.g.
+ MB85RC256V) at 0x50. Every transfer is timed twice,
+ once through the library's bulk path (read16/write16)
+ and once byte by byte through the low-level methods,
+ which stop on every byte to map its status before the
+ next one is started.
+
+ Two lengths are timed and subtracted, so START, address
+ and STOP cancel out. What is left per byte minus its 9
+ SCL periods is the gap SCL sits idle between bytes.
+ *******************************************/
+
+#include <I2C.h>
+
+#define FRAM 0x50
+#define SHORT_RUN 32
+#define LONG_RUN 224
+#define REPEATS 20
+
+uint8_t buffer[LONG_RUN];
+
+uint8_t readSteps(uint16_t reg, uint8_t n)
+{
+  I2c._start();
+  I2c._sendAddress(SLA_W(FRAM));
+  I2c._sendByte(reg >> 8);
+  I2c._sendByte(reg & 0xFF);
+  I2c._start();
+  I2c._sendAddress(SLA_R(FRAM));
+  for (uint8_t i = 0; i < n; i++)
+  {
+    if (I2c._receiveByte(i != n - 1, &buffer[i]))
+    {
+      return (1);
+    }
+  }
+  return (I2c._stop());
+}
+
+uint8_t writeSteps(uint16_t reg, uint8_t n)
+{
+  I2c._start();
+  I2c._sendAddress(SLA_W(FRAM));
+  I2c._sendByte(reg >> 8);
+  I2c._sendByte(reg & 0xFF);
+  for (uint8_t i = 0; i < n; i++)
+  {
+    if (I2c._sendByte(buffer[i]))
+    {
+      return (1);
+    }
+  }
+  return (I2c._stop());
+}
+
+//Average time of one transfer in microseconds
+float timeRun(uint8_t bulk, uint8_t write, uint8_t n)
+{
+  unsigned long started = micros();
+  for (uint8_t r = 0; r < REPEATS; r++)
+  {
+    uint8_t status;
+    if (bulk)
+    {
+      status = write ? I2c.write16(FRAM, 0, buffer, n) : I2c.read16(FRAM, 0, n, buffer);
+    }
+    else
+    {
+      status = write ? writeSteps(0, n) : readSteps(0, n);
+    }
+    if (status)
+    {
+      Serial.print(F("transfer failed: "));
+      Serial.println(status, HEX);
+    }
+  }
+  return ((micros() - started) / (float)REPEATS);
+}
+
+void report(const __FlashStringHelper *name, uint8_t bulk, uint8_t write)
+{
+  float perByte = (timeRun(bulk, write, LONG_RUN) - timeRun(bulk, write, SHORT_RUN)) / (LONG_RUN - SHORT_RUN);
+  float period = (16 + 2 * TWBR) * 1e6 / F_CPU;
+  float gap = perByte - 9 * period;
+  Serial.print(name);
+  Serial.print(perByte, 2);
+  Serial.print(F(" us per byte, gap "));
+  Serial.print(gap, 2);
+  Serial.print(F(" us ("));
+  Serial.print(gap / period, 2);
+  Serial.println(F(" SCL periods)"));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  I2c.begin();
+  I2c.setSpeed(1);
+  I2c.timeOut(10);
+  for (uint8_t i = 0; i < LONG_RUN; i++)
+  {
+    buffer[i] = i;
+  }
+}
+
+void loop()
+{
+  report(F("read,  bulk:         "), 1, 0);
+  report(F("read,  byte by byte: "), 0, 0);
+  report(F("write, bulk:         "), 1, 1);
+  report(F("write, byte by byte: "), 0, 1);
+  Serial.println();
+  delay(2000);
+}
@@ -0,0 +1,67 @@
+/*******************************************
+ Reads two HMC5883L magnetometers, one on the TWI
+ pins and one on a bit-banged bus on pins 2 (SDA)
+ and 3 (SCL) of an Uno, both at 400 kHz. When the
+ TWI read times out the TWI peripheral is switched
+ off and the same pins are driven in software until
+ the next reset, so a wedged TWI does not stop the
+ sketch.
+ *******************************************/
+
+#include <I2C.h>
+#include <I2CSoft.h>
+
+#define HMC5883L 0x1E
+
+I2C_SOFT_PIN(TwiSda, C, 4);
+I2C_SOFT_PIN(TwiScl, C, 5);
+I2C_SOFT_PIN(SecondSda, D, 2);
+I2C_SOFT_PIN(SecondScl, D, 3);
+
+I2CMaster<SoftBackend<TwiSda, TwiScl>, 0, FixedTimeOut<10> > fallback;
+I2CMaster<SoftBackend<SecondSda, SecondScl>, 0, FixedTimeOut<10> > second;
+uint8_t useFallback = 0;
+uint8_t first[6];
+uint8_t other[6];
+
+void setup()
+{
+  Serial.begin(115200);
+  I2c.begin();
+  I2c.setSpeed(1);
+  I2c.timeOut(10);
+  second.begin();
+  I2c.write(HMC5883L, 0x02, 0x00); //continuous mode
+  second.write(HMC5883L, 0x02, 0x00);
+}
+
+void loop()
+{
+  uint8_t status;
+  if (useFallback)
+  {
+    status = fallback.read(HMC5883L, 0x03, 6, first);
+  }
+  else
+  {
+    status = I2c.read(HMC5883L, 0x03, 6, first);
+    if (status >= 1 && status <= 7)
+    {
+      I2c.end();
+      fallback.begin();
+      useFallback = 1;
+      Serial.println(F("TWI timed out, using the software bus"));
+    }
+  }
+  if (!status)
+  {
+    Serial.print((int16_t)(first[0] << 8 | first[1]));
+    Serial.print(' ');
+  }
+  if (!second.read(HMC5883L, 0x03, 6, other))
+  {
+    Serial.print((int16_t)(other[0] << 8 | other[1]));
+  }
+  Serial.println();
+  delay(100);
+}
@@ -1,10 +1,101 @@
 // Get this from https://github.com/rambo/I2C
 #define I2C_DEVICE_DEBUG
 #include <I2C.h>
+#include <avr/eeprom.h>
 #define MAX_COMMAND_LENGTH 100                 // null-terminated
 char incoming_command[MAX_COMMAND_LENGTH + 2]; //Reserve space for CRLF too.
 byte incoming_position;
 
+// Binary framing, see below
+#define FRAME_SYNC 0xA5 // never valid in text mode
+#define FRAME_NAK 0x15
+// Sized for the 2 KB of an ATmega328P: longer batches are split by the host, longer replies into several frames
+#define FRAME_MAX_PAYLOAD 64
+#define FRAME_MAX_REPLY 64         // payload bytes per reply frame, also the page size of bulk reads
+#define FRAME_CONTINUED 0x8000     // length flag of a reply frame that more of the same reply follows
+#define FRAME_MAX_READ (FRAME_MAX_REPLY - 1) // bytes per read operation, so its stat and data go out together
+#define FRAME_TIMEOUT 100 // ms between bytes before a partial frame is dropped
+#define OP_START 0x01
+#define OP_STOP 0x02
+#define OP_WRITE 0x03
+#define OP_READ 0x04
+#define OP_SCAN 0x05
+enum frame_states
+{
+    frame_idle,
+    frame_length_lo,
+    frame_length_hi,
+    frame_payload,
+    frame_check,
+    frame_discard, // rest of a frame that is too long, answered with a NAK once it is over
+};
+
+byte frame_buffer[FRAME_MAX_PAYLOAD];
+byte reply_buffer[FRAME_MAX_REPLY];
+byte reply_length;
+uint16_t frame_length;
+uint16_t frame_position;
+byte frame_crc;
+byte frame_state;
+unsigned long frame_last_byte;
+
+// Collects output and hands it to Serial in blocks instead of byte by byte
+class BufferedOutput : public Print
+{
+public:
+    virtual size_t write(uint8_t c)
+    {
+        buffer[length++] = c;
+        if (length == sizeof(buffer))
+        {
+            flush();
+        }
+        return 1;
+    }
+    using Print::write;
+    void flush()
+    {
+        Serial.write(buffer, length);
+        length = 0;
+    }
+
+private:
+    byte buffer[64];
+    byte length;
+};
+BufferedOutput out;
+
+// Macros are recorded as bytecode and replayed directly against the low-level methods
+#define MACRO_SLOTS 4
+#define MACRO_NAME_LENGTH 7
+#define MACRO_LENGTH 48
+#define MACRO_EEPROM_MAGIC 0x4d
+#ifndef MACRO_EEPROM_ADDRESS
+#define MACRO_EEPROM_ADDRESS PROFILES_EEPROM_SIZE // after I2c.saveProfiles(0), uses 1 + sizeof(macros) bytes
+#endif
+#define MOP_END 0x00
+#define MOP_START 0x01
+#define MOP_STOP 0x02
+#define MOP_ADDRESS 0x03 // followed by the address byte
+#define MOP_BYTE 0x04    // followed by the data byte
+#define MOP_READ_ACK 0x05
+#define MOP_READ_NACK 0x06
+struct macro
+{
+    char name[MACRO_NAME_LENGTH + 1]; // empty if the slot is free
+    byte code[MACRO_LENGTH];          // always terminated with MOP_END
+};
+macro macros[MACRO_SLOTS];
+int8_t recording = -1; // slot being recorded
+byte record_length;
+
+// Timing mode
+boolean timing_mode = false;
+boolean in_transaction = false;
+unsigned long op_elapsed; // duration of the last bus operation in us
+unsigned long transaction_started;
+unsigned long transaction_bus_time;
+
 /**
  * Basic idea is to have "REPL" for low-level I2C operations
  *
@@ -14,15 +105,60 @@ byte incoming_position;
  * r -> read one byte
  * = -> address calculator (for example "=4")
  * S -> scan I2C address space
+ * < aa rr nn -> bulk read nn bytes (hex, max 0x100) from device aa (7-bit) starting at register rr, as a hex dump
+ * < aa - nn -> same but from the current register pointer (no register is sent)
+ * > aa rr 0102a0ff -> bulk write the hex blob to device aa (7-bit) starting at register rr
+ *
+ * Registers given with 3 or 4 hex digits are sent as 16-bit register addresses (EEPROMs etc).
+ *
+ * {name -> start recording a macro, the bus operations ([, ], bytes, r) of the following lines are executed and recorded
+ * } -> stop recording
+ * !name n pp -> replay a macro n times (hex, default 1), optionally every pp ms (hex), any input aborts
+ * ? -> list macros
+ * M -> store macros in EEPROM (they are loaded at boot)
+ * L -> reload macros from EEPROM
+ * T -> toggle timing mode: every [, address, byte, r and ] also reports how long it took in microseconds (mostly
+ *      waiting for the slave, e.g. clock stretching) and every ] reports the total of the transaction
  *
  * On newline the line is parsed and corresponding actions taken, we need to know if sending a byte right after start since
  * the slave address requires extra attention.
  *
+ * For host-driven bulk transfers there is also a binary mode. A line starting with 0xA5 is a frame instead:
+ *
+ *   0xA5, length (2 bytes, LSB first), payload (length bytes), CRC-8 (poly 0x07, init 0) of length and payload
+ *
+ * The payload is a batch of operations, executed in order:
+ *
+ *   0x01             start
+ *   0x02             stop
+ *   0x03 n b1..bn    write n bytes, the first byte after a start is sent as the (8-bit) address
+ *   0x04 n           read n bytes (at most 63), the last one is NACKed
+ *   0x05             scan, does not need start/stop
+ *
+ * and the reply is one frame with the same framing whose payload starts with the number of operations executed,
+ * followed by the result of each one:
+ *
+ *   start/stop       stat
+ *   write            number of bytes sent, stat
+ *   read             stat, n bytes
+ *   scan             stat, number of devices found, their 7-bit addresses
+ *
+ * Execution stops at a malformed operation. A reply longer than FRAME_MAX_REPLY (64) bytes is split into several
+ * frames, all but the last with bit 15 of the length set (FRAME_CONTINUED); the host joins their payloads. A frame
+ * with a bad CRC or a payload longer than FRAME_MAX_PAYLOAD (64) is answered with a frame whose payload is just
+ * 0x15 (NAK), after the whole frame has been read and dropped.
+ *
+ * Bytes are handled as soon as they arrive and output is buffered until the command is done. Each text command is
+ * followed by a "took N us" line with the time from its line end to the last result.
+ *
  * Working:
  *  - start / stop
  *  - hex parsing (mostly) and sending bytes
  *  - reading
  *  - address scan
+ *  - binary framed mode
+ *  - macros
+ *  - timing mode
  *
  * TODO:
  *  - REPL so this can be used via plain serial port as well
@@ -41,49 +177,308 @@ void setup()
 
     // Scan the bus
     //I2c.scan();
-    Serial.println(F("Remember that you need to send the 8-bit address (with R/W-bit set) when addressing a device"));
+    load_macros();
+    out.println(F("Remember that you need to send the 8-bit address (with R/W-bit set) when addressing a device"));
+    out.flush();
     digitalWrite(13, LOW);
 }
 
 // Handle incoming Serial data, try to find a command in there
 inline void read_command_bytes()
 {
-    for (byte d = Serial.available(); d > 0; d--)
+    while (Serial.available() > 0)
     {
-        incoming_command[incoming_position] = Serial.read();
+        byte incoming = Serial.read();
+        if (frame_state != frame_idle || (incoming_position == 0 && incoming == FRAME_SYNC))
+        {
+            read_frame_byte(incoming);
+            continue;
+        }
+        incoming_command[incoming_position] = incoming;
         // Check for line end and in such case do special things
         if (incoming_command[incoming_position] == 0xA     // LF
             || incoming_command[incoming_position] == 0xD) // CR
         {
             incoming_command[incoming_position] = 0x0;
+            if (incoming_position == 0)
+            {
+                continue; // second half of CRLF or an empty line
+            }
             if (incoming_position > 0 && (incoming_command[incoming_position - 1] == 0xD     // CR
                                           || incoming_command[incoming_position - 1] == 0xA) // LF
             )
             {
                 incoming_command[incoming_position - 1] = 0x0;
             }
+            digitalWrite(13, HIGH);
+            unsigned long started = micros();
             process_command();
+            out.print(F("took "));
+            out.print(micros() - started, DEC);
+            out.println(F(" us"));
+            out.flush();
+            digitalWrite(13, LOW);
             // Clear the buffer and reset position to 0
             memset(incoming_command, 0, MAX_COMMAND_LENGTH + 2);
             incoming_position = 0;
-            return;
+            continue;
         }
         incoming_position++;
 
         // Sanity check buffer sizes
         if (incoming_position > MAX_COMMAND_LENGTH + 2)
         {
-            Serial.println(0x15); // NACK
-            Serial.print(F("PANIC: No end-of-line seen and incoming_position="));
-            Serial.print(incoming_position, DEC);
-            Serial.println(F(" clearing buffers"));
+            out.println(0x15); // NACK
+            out.print(F("PANIC: No end-of-line seen and incoming_position="));
+            out.print(incoming_position, DEC);
+            out.println(F(" clearing buffers"));
 
             memset(incoming_command, 0, MAX_COMMAND_LENGTH + 2);
             incoming_position = 0;
+            out.flush();
         }
     }
 }
 
+byte crc8_update(byte crc, byte data)
+{
+    crc ^= data;
+    for (byte bit = 0; bit < 8; bit++)
+    {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+    return crc;
+}
+
+// Sends a frame, with FRAME_CONTINUED set in the length if more of the same reply follows
+void send_frame(byte *payload, byte length, boolean more)
+{
+    uint16_t field = more ? length | FRAME_CONTINUED : length;
+    byte header[3] = { FRAME_SYNC, (byte)(field & 0xff), (byte)(field >> 8) };
+    byte crc = crc8_update(crc8_update(0, header[1]), header[2]);
+    for (byte i = 0; i < length; i++)
+    {
+        crc = crc8_update(crc, payload[i]);
+    }
+    out.write(header, sizeof(header));
+    out.write(payload, length);
+    out.write(crc);
+}
+
+void send_nak()
+{
+    byte nak = FRAME_NAK;
+    send_frame(&nak, 1, false);
+}
+
+// Sends the reply collected so far as a frame that more of it follows unless room bytes still fit
+void reply_room(byte room)
+{
+    if (reply_length + room > FRAME_MAX_REPLY)
+    {
+        send_frame(reply_buffer, reply_length, true);
+        reply_length = 0;
+    }
+}
+
+void reply_byte(byte value)
+{
+    reply_room(1);
+    reply_buffer[reply_length++] = value;
+}
+
+// Number of operations at the start of the frame that are well-formed, they are the ones executed
+byte count_operations()
+{
+    byte operations = 0;
+    uint16_t i = 0;
+    while (i < frame_length)
+    {
+        byte op = frame_buffer[i++];
+        if (op == OP_WRITE || op == OP_READ)
+        {
+            if (i >= frame_length)
+            {
+                break;
+            }
+            byte count = frame_buffer[i++];
+            if (op == OP_WRITE)
+            {
+                if (i + count > frame_length)
+                {
+                    break;
+                }
+                i += count;
+            }
+            else if (count > FRAME_MAX_READ)
+            {
+                break;
+            }
+        }
+        else if (op != OP_START && op != OP_STOP && op != OP_SCAN)
+        {
+            break;
+        }
+        operations++;
+    }
+    return operations;
+}
+
+// Feeds one byte to the binary frame receiver
+void read_frame_byte(byte incoming)
+{
+    frame_last_byte = millis();
+    switch (frame_state)
+    {
+    case frame_idle: // the sync byte
+        frame_crc = 0;
+        frame_state = frame_length_lo;
+        return;
+    case frame_length_lo:
+        frame_length = incoming;
+        frame_state = frame_length_hi;
+        break;
+    case frame_length_hi:
+        frame_length |= (uint16_t)incoming << 8;
+        frame_position = 0;
+        frame_state = frame_length ? frame_payload : frame_check;
+        if (frame_length > FRAME_MAX_PAYLOAD)
+        {
+            // the payload and CRC must not reach the text parser
+            frame_state = frame_discard;
+        }
+        break;
+    case frame_discard:
+        if (++frame_position > frame_length)
+        {
+            frame_state = frame_idle;
+            send_nak();
+            out.flush();
+        }
+        return;
+    case frame_payload:
+        frame_buffer[frame_position++] = incoming;
+        if (frame_position == frame_length)
+        {
+            frame_state = frame_check;
+        }
+        break;
+    case frame_check:
+        frame_state = frame_idle;
+        if (incoming != frame_crc)
+        {
+            send_nak();
+            out.flush();
+            return;
+        }
+        digitalWrite(13, HIGH);
+        process_frame();
+        out.flush();
+        digitalWrite(13, LOW);
+        return;
+    }
+    frame_crc = crc8_update(frame_crc, incoming);
+}
+
+// Executes the operations of a received frame and sends the reply, in as many frames as it takes
+void process_frame()
+{
+    byte executed = count_operations();
+    boolean after_start = false;
+    uint16_t i = 0;
+    reply_length = 0;
+    reply_byte(executed);
+    for (byte operation = 0; operation < executed; operation++)
+    {
+        byte op = frame_buffer[i++];
+        byte count = 0;
+        if (op == OP_WRITE || op == OP_READ)
+        {
+            count = frame_buffer[i++];
+        }
+        switch (op)
+        {
+        case OP_START:
+            reply_byte(I2c._start());
+            after_start = true;
+            break;
+        case OP_STOP:
+            reply_byte(I2c._stop());
+            after_start = false;
+            break;
+        case OP_WRITE:
+        {
+            byte sent = 0;
+            byte stat = 0;
+            for (; sent < count; sent++)
+            {
+                stat = after_start ? I2c._sendAddress(frame_buffer[i + sent]) : I2c._sendByte(frame_buffer[i + sent]);
+                after_start = false;
+                if (stat)
+                {
+                    break;
+                }
+            }
+            i += count;
+            reply_byte(sent);
+            reply_byte(stat);
+        }
+        break;
+        case OP_READ:
+        {
+            // the stat is only known after the bytes, so they share one frame
+            reply_room(1 + count);
+            byte *stat = &reply_buffer[reply_length++];
+            *stat = 0;
+            for (byte r = 0; r < count; r++)
+            {
+                if (*stat)
+                {
+                    reply_buffer[reply_length++] = 0x0;
+                    continue;
+                }
+                *stat = I2c._receiveByte(r + 1 < count, &reply_buffer[reply_length++]);
+            }
+        }
+        break;
+        case OP_SCAN:
+        {
+            // one bit per address, the stat and count go out before the addresses
+            byte present[16];
+            byte stat = 0;
+            byte found = 0;
+            memset(present, 0, sizeof(present));
+            for (byte address = 0; address <= 0x7f; address++)
+            {
+                stat = I2c._start();
+                if (stat == 1)
+                {
+                    break; // bus problem
+                }
+                if (!stat && !I2c._sendAddress(address << 1))
+                {
+                    present[address >> 3] |= 1 << (address & 0x07);
+                    found++;
+                }
+                I2c._stop();
+                stat = 0;
+            }
+            reply_byte(stat);
+            reply_byte(found);
+            for (byte address = 0; address <= 0x7f; address++)
+            {
+                if (present[address >> 3] & (1 << (address & 0x07)))
+                {
+                    reply_byte(address);
+                }
+            }
+        }
+        break;
+        }
+    }
+    send_frame(reply_buffer, reply_length, false);
+}
+
 enum parser_states
 {
     start_seen,
@@ -157,17 +552,473 @@ inline byte parse_hex(char *parsebuffer)
 
 void invalid_char(byte character, byte pos)
 {
-    Serial.print(F("Invalid character '"));
-    Serial.write(character);
-    Serial.print(F("' (0x"));
-    Serial.print(character, HEX);
-    Serial.print(F(") in position "));
-    Serial.print(pos, DEC);
-    Serial.println(F(" when parsing command"));
+    out.print(F("Invalid character '"));
+    out.write(character);
+    out.print(F("' (0x"));
+    out.print(character, HEX);
+    out.print(F(") in position "));
+    out.print(pos, DEC);
+    out.println(F(" when parsing command"));
+}
+
+// Parses a hex number of any length starting at pos (leading spaces are skipped), returns the number of digits
+byte parse_hex_token(byte *pos, uint16_t *value)
+{
+    byte maxsize = strlen(incoming_command);
+    while (*pos < maxsize && incoming_command[*pos] == 0x20)
+    {
+        (*pos)++;
+    }
+    byte digits = 0;
+    *value = 0;
+    while (*pos < maxsize && is_hex_char(incoming_command[*pos]))
+    {
+        *value = (*value << 4) | ardubus_hex2byte(incoming_command[*pos]);
+        (*pos)++;
+        digits++;
+    }
+    return digits;
+}
+
+inline void print_hex_byte(byte value)
+{
+    if (value < 0x10)
+    {
+        out.write('0');
+    }
+    out.print(value, HEX);
+}
+
+// 16 bytes per line, each line prefixed with the register address of its first byte
+void hex_dump(uint16_t offset, byte *data, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (i % 16 == 0)
+        {
+            if (i)
+            {
+                out.println();
+            }
+            print_hex_byte((offset + i) >> 8);
+            print_hex_byte((offset + i) & 0xff);
+            out.write(':');
+        }
+        out.write(' ');
+        print_hex_byte(data[i]);
+    }
+    out.println();
+}
+
+// Handles the "<" and ">" bulk commands, pos is the position of the command character
+void process_bulk(byte pos)
+{
+    boolean is_read = incoming_command[pos++] == 0x3c; // ASCII "<"
+    byte maxsize = strlen(incoming_command);
+    uint16_t address;
+    uint16_t reg = 0;
+    uint16_t count = 0;
+    byte reg_digits;
+    byte stat = 0;
+    if (!parse_hex_token(&pos, &address) || address > 0x7f)
+    {
+        out.println(F("Bulk command needs a 7-bit device address"));
+        return;
+    }
+    while (pos < maxsize && incoming_command[pos] == 0x20)
+    {
+        pos++;
+    }
+    if (is_read && incoming_command[pos] == 0x2d) // ASCII "-"
+    {
+        reg_digits = 0;
+        pos++;
+    }
+    else
+    {
+        reg_digits = parse_hex_token(&pos, &reg);
+        if (!reg_digits || reg_digits > 4)
+        {
+            out.println(F("Bulk command needs a register address of 1-4 hex digits"));
+            return;
+        }
+    }
+    if (is_read)
+    {
+        if (!parse_hex_token(&pos, &count) || count == 0 || count > 0x100)
+        {
+            out.println(F("Bulk read needs a byte count of 1-100 (hex)"));
+            return;
+        }
+        // one page of reply_buffer at a time, each dumped as soon as it is read
+        uint16_t done = 0;
+        while (done < count)
+        {
+            byte page = min(count - done, FRAME_MAX_REPLY);
+            if (reg_digits == 0)
+            {
+                stat = I2c.readex(address, page, reply_buffer);
+            }
+            else if (reg_digits <= 2)
+            {
+                stat = I2c.readex(address, (byte)(reg + done), page, reply_buffer);
+            }
+            else
+            {
+                stat = I2c.read16(address, reg + done, page, reply_buffer);
+            }
+            if (stat)
+            {
+                break;
+            }
+            hex_dump(reg + done, reply_buffer, page);
+            done += page;
+        }
+        out.print(F("read 0x"));
+        out.print(done, HEX);
+        out.print(F(" bytes, stat=0x"));
+        out.println(stat, HEX);
+        return;
+    }
+    // Hex blob, spaces between bytes are allowed
+    while (pos < maxsize)
+    {
+        if (incoming_command[pos] == 0x20)
+        {
+            pos++;
+            continue;
+        }
+        if (!is_hex_char(incoming_command[pos]) || !is_hex_char(incoming_command[pos + 1]))
+        {
+            out.print(F("blob: "));
+            invalid_char(incoming_command[pos], pos);
+            return;
+        }
+        if (count == sizeof(reply_buffer))
+        {
+            out.println(F("Bulk write takes at most 0x40 bytes"));
+            return;
+        }
+        reply_buffer[count++] = ardubus_hex2byte(incoming_command[pos], incoming_command[pos + 1]);
+        pos += 2;
+    }
+    if (!count)
+    {
+        out.println(F("Bulk write needs some data"));
+        return;
+    }
+    if (reg_digits <= 2)
+    {
+        stat = I2c.write(address, (byte)reg, reply_buffer, count);
+    }
+    else
+    {
+        stat = I2c.write16(address, reg, reply_buffer, count);
+    }
+    out.print(F("wrote 0x"));
+    out.print(count, HEX);
+    out.print(F(" bytes, stat=0x"));
+    out.println(stat, HEX);
+}
+
+// Appends an operation to the macro being recorded, arg is ignored for operations without one
+void record_op(byte op, byte arg)
+{
+    if (recording < 0)
+    {
+        return;
+    }
+    byte needed = (op == MOP_ADDRESS || op == MOP_BYTE) ? 2 : 1;
+    byte *code = macros[(byte)recording].code;
+    if (record_length + needed >= MACRO_LENGTH) // keep room for MOP_END
+    {
+        out.println(F("Macro is full, recording stopped"));
+        recording = -1;
+        return;
+    }
+    code[record_length++] = op;
+    if (needed == 2)
+    {
+        code[record_length++] = arg;
+    }
+    code[record_length] = MOP_END;
+}
+
+// Runs a macro once, read bytes go to reply_buffer (fewer than MACRO_LENGTH, so they fit). Returns the number of
+// operations with non-zero status
+byte run_macro(byte *code, byte *reads)
+{
+    byte failures = 0;
+    *reads = 0;
+    byte pc = 0;
+    while (code[pc] != MOP_END)
+    {
+        byte stat = 0;
+        switch (code[pc++])
+        {
+        case MOP_START:
+            stat = I2c._start();
+            break;
+        case MOP_STOP:
+            stat = I2c._stop();
+            break;
+        case MOP_ADDRESS:
+            stat = I2c._sendAddress(code[pc++]);
+            break;
+        case MOP_BYTE:
+            stat = I2c._sendByte(code[pc++]);
+            break;
+        case MOP_READ_ACK:
+            stat = I2c._receiveByte(1, &reply_buffer[(*reads)++]);
+            break;
+        case MOP_READ_NACK:
+            stat = I2c._receiveByte(0, &reply_buffer[(*reads)++]);
+            break;
+        }
+        if (stat)
+        {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Reads a macro name starting at pos, returns its length
+byte parse_macro_name(byte *pos, char *name)
+{
+    byte length = 0;
+    memset(name, 0, MACRO_NAME_LENGTH + 1);
+    while (incoming_command[*pos] > 0x20 && length < MACRO_NAME_LENGTH)
+    {
+        name[length++] = incoming_command[(*pos)++];
+    }
+    return length;
+}
+
+int8_t find_macro(char *name)
+{
+    for (byte slot = 0; slot < MACRO_SLOTS; slot++)
+    {
+        if (macros[slot].name[0] && !strcmp(macros[slot].name, name))
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void load_macros()
+{
+    if (eeprom_read_byte((const uint8_t *)MACRO_EEPROM_ADDRESS) == MACRO_EEPROM_MAGIC)
+    {
+        eeprom_read_block(macros, (const void *)(MACRO_EEPROM_ADDRESS + 1), sizeof(macros));
+    }
+}
+
+void replay_macro(int8_t slot, uint16_t runs, uint16_t period)
+{
+    unsigned long next_run = micros();
+    unsigned long started = next_run;
+    unsigned long fastest = 0xffffffff;
+    unsigned long slowest = 0;
+    uint16_t failures = 0;
+    uint16_t run = 0;
+    byte reads = 0;
+    while (run < runs && !Serial.available())
+    {
+        if (period)
+        {
+            while ((long)(micros() - next_run) < 0)
+            {
+                if (Serial.available())
+                {
+                    break;
+                }
+            }
+            next_run += (unsigned long)period * 1000;
+        }
+        unsigned long run_started = micros();
+        failures += run_macro(macros[(byte)slot].code, &reads);
+        unsigned long elapsed = micros() - run_started;
+        fastest = min(fastest, elapsed);
+        slowest = max(slowest, elapsed);
+        run++;
+    }
+    unsigned long total = micros() - started;
+    out.print(F("macro "));
+    out.print(macros[(byte)slot].name);
+    out.print(F(": "));
+    out.print(run, DEC);
+    out.print(F(" runs, "));
+    out.print(failures, DEC);
+    out.print(F(" failed ops, total "));
+    out.print(total, DEC);
+    out.print(F(" us"));
+    if (run)
+    {
+        out.print(F(", per run min "));
+        out.print(fastest, DEC);
+        out.print(F(" max "));
+        out.print(slowest, DEC);
+        out.print(F(" avg "));
+        out.print(total / run, DEC);
+        out.print(F(" us"));
+    }
+    out.println();
+    if (reads)
+    {
+        out.print(F("last run read:"));
+        for (byte i = 0; i < reads; i++)
+        {
+            out.write(' ');
+            print_hex_byte(reply_buffer[i]);
+        }
+        out.println();
+    }
+}
+
+// Handles the macro commands, pos is the position of the command character
+void process_macro(byte pos)
+{
+    char name[MACRO_NAME_LENGTH + 1];
+    byte command = incoming_command[pos++];
+    switch (command)
+    {
+    case 0x7b: // ASCII "{", start recording
+    {
+        if (recording >= 0)
+        {
+            out.println(F("Already recording"));
+            return;
+        }
+        if (!parse_macro_name(&pos, name))
+        {
+            out.println(F("Macro needs a name"));
+            return;
+        }
+        int8_t slot = find_macro(name);
+        for (byte free_slot = 0; slot < 0 && free_slot < MACRO_SLOTS; free_slot++)
+        {
+            if (!macros[free_slot].name[0])
+            {
+                slot = free_slot;
+            }
+        }
+        if (slot < 0)
+        {
+            out.println(F("No free macro slots"));
+            return;
+        }
+        strcpy(macros[(byte)slot].name, name);
+        macros[(byte)slot].code[0] = MOP_END;
+        recording = slot;
+        record_length = 0;
+        out.print(F("Recording macro "));
+        out.println(name);
+    }
+    break;
+    case 0x7d: // ASCII "}", stop recording
+        if (recording < 0)
+        {
+            out.println(F("Not recording"));
+            return;
+        }
+        out.print(F("Recorded 0x"));
+        out.print(record_length, HEX);
+        out.println(F(" bytes"));
+        recording = -1;
+        break;
+    case 0x21: // ASCII "!", replay
+    {
+        uint16_t runs = 1;
+        uint16_t period = 0;
+        parse_macro_name(&pos, name);
+        int8_t slot = find_macro(name);
+        if (slot < 0)
+        {
+            out.println(F("No such macro"));
+            return;
+        }
+        if (parse_hex_token(&pos, &runs))
+        {
+            parse_hex_token(&pos, &period);
+        }
+        else
+        {
+            runs = 1;
+        }
+        out.flush();
+        replay_macro(slot, runs, period);
+    }
+    break;
+    case 0x3f: // ASCII "?", list
+        for (byte slot = 0; slot < MACRO_SLOTS; slot++)
+        {
+            if (!macros[slot].name[0])
+            {
+                continue;
+            }
+            out.print(macros[slot].name);
+            out.print(F(":"));
+            for (byte pc = 0; pc < MACRO_LENGTH && macros[slot].code[pc] != MOP_END; pc++)
+            {
+                out.write(' ');
+                print_hex_byte(macros[slot].code[pc]);
+            }
+            out.println();
+        }
+        break;
+    case 0x4d: // ASCII "M", store
+        eeprom_update_byte((uint8_t *)MACRO_EEPROM_ADDRESS, MACRO_EEPROM_MAGIC);
+        eeprom_update_block(macros, (void *)(MACRO_EEPROM_ADDRESS + 1), sizeof(macros));
+        out.println(F("Macros stored"));
+        break;
+    case 0x4c: // ASCII "L", load
+        recording = -1;
+        load_macros();
+        out.println(F("Macros loaded"));
+        break;
+    }
+}
+
+// Call right after a bus operation that was started at started
+inline void op_done(unsigned long started)
+{
+    op_elapsed = micros() - started;
+    transaction_bus_time += op_elapsed;
+}
+
+inline void print_op_time()
+{
+    if (timing_mode)
+    {
+        out.print(F(", "));
+        out.print(op_elapsed, DEC);
+        out.print(F(" us"));
+    }
 }
 
 inline void process_command()
 {
+    byte first = strspn(incoming_command, " ");
+    if (incoming_command[first] == 0x54) // ASCII "T"
+    {
+        timing_mode = !timing_mode;
+        out.print(F("Timing mode "));
+        out.println(timing_mode ? F("on") : F("off"));
+        return;
+    }
+    if (incoming_command[first] == 0x3c     // ASCII "<"
+        || incoming_command[first] == 0x3e) // ASCII ">"
+    {
+        process_bulk(first);
+        return;
+    }
+    if (incoming_command[first] && strchr("{}!?ML", incoming_command[first]))
+    {
+        process_macro(first);
+        return;
+    }
     char hexparsebuffer[5];
     // Clear buffer
     memset(hexparsebuffer, 0, sizeof(hexparsebuffer));
@@ -191,7 +1042,7 @@ inline void process_command()
             }
             else
             {
-                Serial.print(F("calc_seen: "));
+                out.print(F("calc_seen: "));
                 invalid_char(current_char, i);
                 return;
             }
@@ -211,7 +1062,7 @@ inline void process_command()
             }
             else
             {
-                Serial.print(F("start_seen: "));
+                out.print(F("start_seen: "));
                 invalid_char(current_char, i);
                 return;
             }
@@ -227,7 +1078,7 @@ inline void process_command()
             }
             else
             {
-                Serial.print(F("stop_seen: "));
+                out.print(F("stop_seen: "));
                 invalid_char(current_char, i);
                 return;
             }
@@ -242,7 +1093,7 @@ inline void process_command()
                 hexparsebuffer[hexparsebuffer_i++] = current_char;
                 if (hexparsebuffer_i > 2)
                 {
-                    Serial.println(F("Can only have byte wide hex strings"));
+                    out.println(F("Can only have byte wide hex strings"));
                     return;
                 }
             }
@@ -257,32 +1108,39 @@ inline void process_command()
                 // I2C status code
                 byte stat;
                 boolean i2c_sent = true;
+                unsigned long started = micros();
                 switch (prev_parser_state)
                 {
                 case calc_seen:
                     i2c_sent = false;
-                    Serial.print(F("device 0x"));
-                    Serial.print(parsed_byte, HEX);
-                    Serial.print(F(": read 0x"));
-                    Serial.print(((parsed_byte << 1) | 0x1), HEX);
-                    Serial.print(F(" write 0x"));
-                    Serial.println(((parsed_byte << 1) | 0x0), HEX);
+                    out.print(F("device 0x"));
+                    out.print(parsed_byte, HEX);
+                    out.print(F(": read 0x"));
+                    out.print(((parsed_byte << 1) | 0x1), HEX);
+                    out.print(F(" write 0x"));
+                    out.println(((parsed_byte << 1) | 0x0), HEX);
                     break;
                 case start_seen:
                     stat = I2c._sendAddress(parsed_byte);
-                    Serial.print(F("sendAddress"));
+                    op_done(started);
+                    record_op(MOP_ADDRESS, parsed_byte);
+                    out.print(F("sendAddress"));
                     break;
                 default:
                     stat = I2c._sendByte(parsed_byte);
-                    Serial.print(F("sendByte"));
+                    op_done(started);
+                    record_op(MOP_BYTE, parsed_byte);
+                    out.print(F("sendByte"));
                     break;
                 }
                 if (i2c_sent)
                 {
-                    Serial.print(F("(0x"));
-                    Serial.print(parsed_byte, HEX);
-                    Serial.print(F("), stat=0x"));
-                    Serial.println(stat, HEX);
+                    out.print(F("(0x"));
+                    out.print(parsed_byte, HEX);
+                    out.print(F("), stat=0x"));
+                    out.print(stat, HEX);
+                    print_op_time();
+                    out.println();
                 }
                 // Return state to idle
                 prev_parser_state = parser_state;
@@ -290,7 +1148,7 @@ inline void process_command()
             }
             if (!is_valid_char)
             {
-                Serial.print(F("in_hex: "));
+                out.print(F("in_hex: "));
                 invalid_char(current_char, i);
                 return;
             }
@@ -312,12 +1170,13 @@ inline void process_command()
                 is_valid_char = true;
                 if (prev_parser_state != p_idle)
                 {
-                    Serial.println(F("Address scan cannot be done in the middle of I2C transaction"));
+                    out.println(F("Address scan cannot be done in the middle of I2C transaction"));
                     return;
                 }
+                out.flush(); // scan() prints directly to Serial
                 I2c.scan();
-                Serial.println(F(""));
-                Serial.println(F("Scan done."));
+                out.println(F(""));
+                out.println(F("Scan done."));
             }
             break;
             case 0x20: // space
@@ -326,18 +1185,43 @@ inline void process_command()
             case 0x5b: // ASCII "[", our start signifier
             {
                 is_valid_char = true;
+                if (!in_transaction)
+                {
+                    in_transaction = true;
+                    transaction_started = micros();
+                    transaction_bus_time = 0;
+                }
+                unsigned long started = micros();
                 byte stat = I2c._start();
+                op_done(started);
+                record_op(MOP_START, 0);
                 parser_state = start_seen;
-                Serial.print(F("START sent, stat=0x"));
-                Serial.println(stat, HEX);
+                out.print(F("START sent, stat=0x"));
+                out.print(stat, HEX);
+                print_op_time();
+                out.println();
             }
             break;
             case 0x5d: // ASCII "]", our stop signifier
             {
                 is_valid_char = true;
+                unsigned long started = micros();
                 byte stat = I2c._stop();
-                Serial.print(F("STOP sent, stat=0x"));
-                Serial.println(stat, HEX);
+                op_done(started);
+                record_op(MOP_STOP, 0);
+                out.print(F("STOP sent, stat=0x"));
+                out.print(stat, HEX);
+                print_op_time();
+                out.println();
+                if (timing_mode && in_transaction)
+                {
+                    out.print(F("transaction: "));
+                    out.print(transaction_bus_time, DEC);
+                    out.print(F(" us in bus operations, "));
+                    out.print(micros() - transaction_started, DEC);
+                    out.println(F(" us from START"));
+                }
+                in_transaction = false;
                 parser_state = stop_seen;
             }
             break;
@@ -367,7 +1251,7 @@ inline void process_command()
                         break;
                     default:
                         // Any other command is in the wrong(est) place
-                        Serial.print(F("r lookahead: "));
+                        out.print(F("r lookahead: "));
                         invalid_char(incoming_command[peek_i], peek_i);
                         return;
                     }
@@ -378,11 +1262,16 @@ inline void process_command()
                     peek_i++;
                 }
                 uint8_t tmpbuffer;
+                unsigned long started = micros();
                 byte stat = I2c._receiveByte(!is_last, &tmpbuffer);
-                Serial.print(F("read 0x"));
-                Serial.print(tmpbuffer, HEX);
-                Serial.print(F(", stat=0x"));
-                Serial.println(stat, HEX);
+                op_done(started);
+                record_op(is_last ? MOP_READ_NACK : MOP_READ_ACK, 0);
+                out.print(F("read 0x"));
+                out.print(tmpbuffer, HEX);
+                out.print(F(", stat=0x"));
+                out.print(stat, HEX);
+                print_op_time();
+                out.println();
             }
             break;
             }
@@ -394,7 +1283,7 @@ inline void process_command()
             }
             if (!is_valid_char)
             {
-                Serial.print(F("p_idle: "));
+                out.print(F("p_idle: "));
                 invalid_char(current_char, i);
                 return;
             }
@@ -406,7 +1295,9 @@ inline void process_command()
 
 void loop()
 {
+    if (frame_state != frame_idle && millis() - frame_last_byte > FRAME_TIMEOUT)
+    {
+        frame_state = frame_idle; // host went away mid-frame
+    }
     read_command_bytes();
-    digitalWrite(13, !digitalRead(13));
-    delay(20);
 }
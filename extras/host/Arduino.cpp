@@ -0,0 +1,261 @@
+/*
+  Arduino.cpp - host implementation of the Arduino.h, avr/eeprom.h and
+  avr/sleep.h shims
+*/
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "avr/eeprom.h"
+#include "avr/sleep.h"
+
+//Timer0 overflows every 256 * 64 cycles, behind millis() and micros()
+#define TIMER0_OVERFLOW_CYCLES 16384
+
+#ifdef I2C_IDLE_SLEEP
+void TWI_vect(); //ISR(TWI_vect) of the library
+#endif
+
+SimRegister TWCR(SIM_TWCR);
+SimRegister TWSR(SIM_TWSR);
+SimRegister TWDR(SIM_TWDR);
+SimRegister TWBR(SIM_TWBR);
+uint8_t PORTB, PORTC, PORTD;
+uint8_t DDRB, DDRC, DDRD;
+uint8_t PINB, PINC, PIND;
+uint8_t SREG = 1 << SREG_I;
+
+HardwareSerial Serial;
+
+static uint8_t eeprom[E2END + 1];
+static bool eepromErased = false;
+
+/////////////// Time ///////////////
+
+unsigned long millis()
+{
+  twiSim.advance(twiSim.timerCycles);
+  return (twiSim.cycles() / (F_CPU / 1000));
+}
+
+unsigned long micros()
+{
+  twiSim.advance(twiSim.timerCycles);
+  return (twiSim.cycles() / (F_CPU / 1000000));
+}
+
+void delay(unsigned long ms)
+{
+  twiSim.advance((uint64_t)ms * (F_CPU / 1000));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  twiSim.advance((uint64_t)us * (F_CPU / 1000000));
+}
+
+/////////////// Sleep ///////////////
+
+void simSleep()
+{
+  uint64_t wake = (twiSim.cycles() / TIMER0_OVERFLOW_CYCLES + 1) * TIMER0_OVERFLOW_CYCLES;
+  uint64_t interrupt = twiSim.interruptAt();
+  if (interrupt < wake)
+  {
+    wake = interrupt;
+  }
+  if (wake > twiSim.cycles())
+  {
+    twiSim.advance(wake - twiSim.cycles());
+  }
+#ifdef I2C_IDLE_SLEEP
+  if (interrupt <= twiSim.cycles())
+  {
+    twiSim.interrupts++;
+    TWI_vect();
+  }
+#endif
+}
+
+/////////////// Print ///////////////
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+  {
+    n += write(*buffer++);
+  }
+  return (n);
+}
+
+size_t Print::write(const char *str)
+{
+  return (write((const uint8_t *)str, strlen(str)));
+}
+
+size_t Print::print(const __FlashStringHelper *str)
+{
+  return (write(reinterpret_cast<const char *>(str)));
+}
+
+size_t Print::print(const char *str)
+{
+  return (write(str));
+}
+
+size_t Print::print(char c)
+{
+  return (write((uint8_t)c));
+}
+
+size_t Print::print(unsigned char b, int base)
+{
+  return (print((unsigned long)b, base));
+}
+
+size_t Print::print(int n, int base)
+{
+  return (print((long)n, base));
+}
+
+size_t Print::print(unsigned int n, int base)
+{
+  return (print((unsigned long)n, base));
+}
+
+size_t Print::print(long n, int base)
+{
+  if (base == DEC && n < 0)
+  {
+    return (print('-') + printNumber(-n, DEC));
+  }
+  return (printNumber(n, base));
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  return (printNumber(n, base));
+}
+
+size_t Print::println(const __FlashStringHelper *str)
+{
+  return (print(str) + println());
+}
+
+size_t Print::println(const char *str)
+{
+  return (print(str) + println());
+}
+
+size_t Print::println(char c)
+{
+  return (print(c) + println());
+}
+
+size_t Print::println(unsigned char b, int base)
+{
+  return (print(b, base) + println());
+}
+
+size_t Print::println(int n, int base)
+{
+  return (print(n, base) + println());
+}
+
+size_t Print::println(unsigned int n, int base)
+{
+  return (print(n, base) + println());
+}
+
+size_t Print::println(long n, int base)
+{
+  return (print(n, base) + println());
+}
+
+size_t Print::println(unsigned long n, int base)
+{
+  return (print(n, base) + println());
+}
+
+size_t Print::println()
+{
+  return (write("\r\n"));
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if (base < 2)
+  {
+    base = 10;
+  }
+  do
+  {
+    char c = n % base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  return (write(str));
+}
+
+void HardwareSerial::flush()
+{
+  fflush(stdout);
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  putchar(c);
+  return (1);
+}
+
+/////////////// EEPROM ///////////////
+
+static uint8_t *eepromCell(const void *address)
+{
+  if (!eepromErased)
+  {
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eepromErased = true;
+  }
+  return (&eeprom[(uintptr_t)address & E2END]);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address)
+{
+  return (*eepromCell(address));
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value)
+{
+  *eepromCell(address) = value;
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value)
+{
+  *eepromCell(address) = value;
+}
+
+void eeprom_read_block(void *destination, const void *source, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    ((uint8_t *)destination)[i] = *eepromCell((const uint8_t *)source + i);
+  }
+}
+
+void eeprom_write_block(const void *source, void *destination, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    *eepromCell((uint8_t *)destination + i) = ((const uint8_t *)source)[i];
+  }
+}
+
+void eeprom_update_block(const void *source, void *destination, size_t n)
+{
+  eeprom_write_block(source, destination, n);
+}
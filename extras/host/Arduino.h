@@ -0,0 +1,145 @@
+/*
+  Arduino.h - minimal host stand-in for the Arduino core, enough to build the
+  I2C library on a PC. The TWI registers are objects that forward to the
+  simulated peripheral in TwiSim.h, time comes from the simulated clock and
+  Serial prints to stdout.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TwiSim.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+//TWCR bits
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+//TWSR bits
+#define TWPS1 1
+#define TWPS0 0
+
+//Interrupts. The simulation has none, SREG says they are enabled.
+extern uint8_t SREG;
+#define SREG_I 7
+#define cli()
+#define sei()
+#define ISR(vector) void vector()
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+class __FlashStringHelper;
+#define F(string) (reinterpret_cast<const __FlashStringHelper *>(string))
+
+//A TWI register, every access goes to twiSim
+class SimRegister
+{
+public:
+  explicit SimRegister(uint8_t id) : id(id) {}
+  operator uint8_t() const { return (twiSim.read(id)); }
+  SimRegister &operator=(uint8_t value)
+  {
+    twiSim.write(id, value);
+    return (*this);
+  }
+  SimRegister &operator=(const SimRegister &other) { return (*this = (uint8_t)other); }
+  SimRegister &operator|=(uint8_t value) { return (*this = (uint8_t)(twiSim.read(id) | value)); }
+  SimRegister &operator&=(uint8_t value) { return (*this = (uint8_t)(twiSim.read(id) & value)); }
+
+private:
+  uint8_t id;
+};
+
+extern SimRegister TWCR;
+extern SimRegister TWSR;
+extern SimRegister TWDR;
+extern SimRegister TWBR;
+extern uint8_t PORTB, PORTC, PORTD;
+extern uint8_t DDRB, DDRC, DDRD;
+extern uint8_t PINB, PINC, PIND;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+
+template <class A, class B>
+auto min(A a, B b) -> decltype(a + b) { return (a < b ? a : b); }
+template <class A, class B>
+auto max(A a, B b) -> decltype(a + b) { return (a > b ? a : b); }
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *, size_t);
+  size_t write(const char *);
+  size_t print(const __FlashStringHelper *);
+  size_t print(const char *);
+  size_t print(char);
+  size_t print(unsigned char, int = DEC);
+  size_t print(int, int = DEC);
+  size_t print(unsigned int, int = DEC);
+  size_t print(long, int = DEC);
+  size_t print(unsigned long, int = DEC);
+  size_t println(const __FlashStringHelper *);
+  size_t println(const char *);
+  size_t println(char);
+  size_t println(unsigned char, int = DEC);
+  size_t println(int, int = DEC);
+  size_t println(unsigned int, int = DEC);
+  size_t println(long, int = DEC);
+  size_t println(unsigned long, int = DEC);
+  size_t println();
+
+private:
+  size_t printNumber(unsigned long, uint8_t);
+};
+
+//Writes to stdout
+class HardwareSerial : public Print
+{
+public:
+  using Print::write;
+  void begin(unsigned long) {}
+  int available() { return (0); }
+  int read() { return (-1); }
+  void flush();
+  size_t write(uint8_t);
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,467 @@
+/*
+  TwiSim.cpp - simulated ATmega TWI peripheral, see TwiSim.h
+*/
+
+#include "TwiSim.h"
+
+//TWCR bits, repeated here so the simulator does not depend on the shim
+#define SIM_TWINT 0x80
+#define SIM_TWEA 0x40
+#define SIM_TWSTA 0x20
+#define SIM_TWSTO 0x10
+#define SIM_TWEN 0x04
+#define SIM_TWIE 0x01
+
+//TWSR status codes
+#define SIM_START 0x08
+#define SIM_REPEATED_START 0x10
+#define SIM_MT_SLA_ACK 0x18
+#define SIM_MT_SLA_NACK 0x20
+#define SIM_MT_DATA_ACK 0x28
+#define SIM_MT_DATA_NACK 0x30
+#define SIM_MR_SLA_ACK 0x40
+#define SIM_MR_SLA_NACK 0x48
+#define SIM_MR_DATA_ACK 0x50
+#define SIM_MR_DATA_NACK 0x58
+#define SIM_LOST_ARBTRTN 0x38
+#define SIM_NO_INFO 0xF8
+
+TwiSim twiSim;
+
+TwiSim::TwiSim()
+{
+  riseTimeNs = 0;
+  readCycles = 4;
+  writeCycles = 2;
+  timerCycles = 60;
+  stepCycles = 0;
+  traceHook = 0;
+  now = 0;
+  fallback = 0;
+  fault = FAULT_NONE;
+  faultStartedAt = NEVER;
+  interrupts = 0;
+  for (uint8_t i = 0; i < 128; i++)
+  {
+    devices[i] = 0;
+  }
+  reset();
+}
+
+//Puts the peripheral back to its power-on state, keeps the clock and devices
+void TwiSim::reset()
+{
+  operation = OP_NONE;
+  phase = PHASE_IDLE;
+  doneAt = 0;
+  ack = false;
+  twint = false;
+  control = 0;
+  status = SIM_NO_INFO;
+  prescaler = 0;
+  twdr = 0xFF;
+  received = 0xFF;
+  twbr = 0;
+  current = 0;
+  lost = false;
+  lastDone = now;
+  clearStats();
+}
+
+void TwiSim::clearStats()
+{
+  operations = 0;
+  busyCycles = 0;
+  heldCycles = 0;
+  controlWrites = 0;
+}
+
+void TwiSim::attach(uint8_t address, SimDevice *device)
+{
+  devices[address & 0x7F] = device;
+}
+
+void TwiSim::attachAll(SimDevice *device)
+{
+  fallback = device;
+}
+
+void TwiSim::detach(uint8_t address)
+{
+  devices[address & 0x7F] = 0;
+}
+
+void TwiSim::inject(SimFault type, uint32_t atOperation, uint64_t holdCycles)
+{
+  fault = type;
+  faultAt = atOperation;
+  faultHold = holdCycles;
+  faultStartedAt = NEVER;
+}
+
+uint64_t TwiSim::interruptAt() const
+{
+  if (!(control & SIM_TWIE))
+  {
+    return (NEVER);
+  }
+  if (twint)
+  {
+    return (now);
+  }
+  return (operation != OP_NONE ? doneAt : NEVER);
+}
+
+//Whether the given line fault is in effect right now
+bool TwiSim::lineStuck(SimFault line) const
+{
+  return (fault == line && faultStartedAt != NEVER && now < released());
+}
+
+//When the stuck line is let go
+uint64_t TwiSim::released() const
+{
+  if (!faultHold)
+  {
+    return (NEVER);
+  }
+  return (faultStartedAt + faultHold);
+}
+
+void TwiSim::advance(uint64_t elapsed)
+{
+  now += elapsed;
+}
+
+uint64_t TwiSim::nanosToCycles(uint64_t ns) const
+{
+  return (ns * (F_CPU / 1000000) / 1000);
+}
+
+double TwiSim::cyclesToMicros(uint64_t count) const
+{
+  return (count / (double)(F_CPU / 1000000));
+}
+
+uint32_t TwiSim::sclPeriod() const
+{
+  static const uint8_t prescale[] = {1, 4, 16, 64};
+  return (16 + 2 * (uint32_t)twbr * prescale[prescaler] + nanosToCycles(riseTimeNs));
+}
+
+uint8_t TwiSim::read(uint8_t reg)
+{
+  advance(readCycles);
+  update();
+  uint8_t value;
+  switch (reg)
+  {
+  case SIM_TWCR:
+    value = control | (twint ? SIM_TWINT : 0);
+    break;
+  case SIM_TWSR:
+    value = status | prescaler;
+    break;
+  case SIM_TWDR:
+    value = twdr;
+    break;
+  default:
+    value = twbr;
+    break;
+  }
+  if (traceHook)
+  {
+    traceHook(now, reg, value, false);
+  }
+  return (value);
+}
+
+void TwiSim::write(uint8_t reg, uint8_t value)
+{
+  advance(writeCycles);
+  update();
+  if (traceHook)
+  {
+    traceHook(now, reg, value, true);
+  }
+  switch (reg)
+  {
+  case SIM_TWDR:
+    twdr = value;
+    return;
+  case SIM_TWBR:
+    twbr = value;
+    return;
+  case SIM_TWSR:
+    prescaler = value & 0x03;
+    return;
+  }
+  if (!(value & SIM_TWEN))
+  {
+    controlWrites++;
+    //Disabling the peripheral aborts whatever it was doing and releases the bus
+    control = value & ~SIM_TWINT;
+    operation = OP_NONE;
+    phase = PHASE_IDLE;
+    twint = false;
+    status = SIM_NO_INFO;
+    current = 0;
+    return;
+  }
+  controlWrites++;
+  control = value & ~SIM_TWINT;
+  if (!(value & SIM_TWINT))
+  {
+    return;
+  }
+  //Writing a one to TWINT clears the flag and starts the next operation
+  twint = false;
+  if (value & SIM_TWSTO)
+  {
+    begin(OP_STOP, sclPeriod());
+  }
+  else if (value & SIM_TWSTA)
+  {
+    begin(OP_START, sclPeriod());
+  }
+  else if (phase == PHASE_STARTED)
+  {
+    begin(OP_ADDRESS, 9 * sclPeriod());
+  }
+  else if (phase == PHASE_TRANSMIT)
+  {
+    begin(OP_SEND, 9 * sclPeriod());
+  }
+  else if (phase == PHASE_RECEIVE)
+  {
+    begin(OP_RECEIVE, 9 * sclPeriod());
+  }
+}
+
+//Starts a bus operation lasting the given number of cycles plus any clock
+//stretching by the addressed device
+void TwiSim::begin(Operation next, uint64_t duration)
+{
+  now += stepCycles;
+  if (phase != PHASE_IDLE)
+  {
+    heldCycles += now - lastDone;
+  }
+  operation = next;
+  operations++;
+  lost = false;
+  if (fault != FAULT_NONE && faultStartedAt == NEVER && operations >= faultAt)
+  {
+    faultStartedAt = now;
+  }
+  SimDevice *device = current;
+  switch (next)
+  {
+  case OP_ADDRESS:
+    device = lookup(twdr >> 1);
+    ack = device && device->address(twdr & 0x01);
+    current = ack ? device : 0;
+    break;
+  case OP_SEND:
+    ack = current && current->write(twdr);
+    break;
+  case OP_RECEIVE:
+    ack = control & SIM_TWEA;
+    received = current ? current->read(ack) : 0xFF;
+    break;
+  case OP_STOP:
+    if (current)
+    {
+      current->stop();
+    }
+    current = 0;
+    device = 0;
+    break;
+  default:
+    device = 0;
+    break;
+  }
+  if (device)
+  {
+    duration += nanosToCycles(device->stretch());
+  }
+  doneAt = now + duration;
+  busyCycles += duration;
+  if (faultStartedAt != NEVER)
+  {
+    strike(next);
+  }
+}
+
+//Applies a fault that has struck to the operation just started
+void TwiSim::strike(Operation next)
+{
+  bool oneShot = false;
+  switch (fault)
+  {
+  case FAULT_STUCK_SCL:
+    //Nothing moves until SCL is released
+    if (lineStuck(FAULT_STUCK_SCL))
+    {
+      doneAt = released() == NEVER ? NEVER : released() + (doneAt - now);
+    }
+    break;
+  case FAULT_STUCK_SDA:
+    if (!lineStuck(FAULT_STUCK_SDA))
+    {
+      break;
+    }
+    if (next == OP_START || next == OP_STOP)
+    {
+      //Both need SDA to go high first
+      doneAt = released() == NEVER ? NEVER : released() + (doneAt - now);
+    }
+    else if ((next == OP_ADDRESS || next == OP_SEND) && twdr)
+    {
+      //A one bit reads back as zero
+      lost = true;
+    }
+    else if (next == OP_RECEIVE)
+    {
+      received = 0x00;
+    }
+    break;
+  case FAULT_NACK:
+    if (next == OP_ADDRESS || next == OP_SEND)
+    {
+      ack = false;
+      if (next == OP_ADDRESS)
+      {
+        current = 0;
+      }
+      oneShot = true;
+    }
+    break;
+  case FAULT_ARBITRATION:
+    if (next == OP_ADDRESS || next == OP_SEND || next == OP_RECEIVE)
+    {
+      lost = true;
+      oneShot = true;
+    }
+    break;
+  case FAULT_MISSING_STOP:
+    if (next == OP_STOP)
+    {
+      doneAt = NEVER;
+      oneShot = true;
+    }
+    break;
+  default:
+    break;
+  }
+  if (oneShot)
+  {
+    fault = FAULT_NONE;
+    faultStartedAt = NEVER;
+  }
+}
+
+void TwiSim::update()
+{
+  if (operation != OP_NONE && now >= doneAt)
+  {
+    lastDone = doneAt;
+    complete();
+    operation = OP_NONE;
+  }
+}
+
+void TwiSim::complete()
+{
+  bool reading = twdr & 0x01;
+  if (lost)
+  {
+    //The master drops back to not addressed slave mode
+    status = SIM_LOST_ARBTRTN;
+    phase = PHASE_IDLE;
+    current = 0;
+    twint = true;
+    return;
+  }
+  switch (operation)
+  {
+  case OP_START:
+    status = phase == PHASE_IDLE ? SIM_START : SIM_REPEATED_START;
+    phase = PHASE_STARTED;
+    break;
+  case OP_ADDRESS:
+    if (reading)
+    {
+      status = ack ? SIM_MR_SLA_ACK : SIM_MR_SLA_NACK;
+      phase = PHASE_RECEIVE;
+    }
+    else
+    {
+      status = ack ? SIM_MT_SLA_ACK : SIM_MT_SLA_NACK;
+      phase = PHASE_TRANSMIT;
+    }
+    break;
+  case OP_SEND:
+    status = ack ? SIM_MT_DATA_ACK : SIM_MT_DATA_NACK;
+    break;
+  case OP_RECEIVE:
+    twdr = received;
+    status = ack ? SIM_MR_DATA_ACK : SIM_MR_DATA_NACK;
+    break;
+  case OP_STOP:
+    control &= ~SIM_TWSTO;
+    phase = PHASE_IDLE;
+    status = SIM_NO_INFO;
+    return;
+  default:
+    return;
+  }
+  twint = true;
+}
+
+SimDevice *TwiSim::lookup(uint8_t address)
+{
+  if (devices[address & 0x7F])
+  {
+    return (devices[address & 0x7F]);
+  }
+  return (fallback);
+}
+
+SimMemory::SimMemory(bool wide, uint32_t stretchNs) : stretchNs(stretchNs), wide(wide)
+{
+  pointerBytes = 0;
+  pointer = 0;
+  for (uint16_t i = 0; i < sizeof(memory); i++)
+  {
+    memory[i] = i;
+  }
+}
+
+bool SimMemory::address(bool read)
+{
+  if (!read)
+  {
+    pointerBytes = wide ? 2 : 1;
+  }
+  return (true);
+}
+
+bool SimMemory::write(uint8_t data)
+{
+  if (pointerBytes)
+  {
+    pointer = (pointer << 8) | data;
+    pointerBytes--;
+  }
+  else
+  {
+    memory[pointer++ & 0xFF] = data;
+  }
+  return (true);
+}
+
+uint8_t SimMemory::read(bool ack)
+{
+  return (memory[pointer++ & 0xFF]);
+}
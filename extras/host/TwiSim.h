@@ -0,0 +1,181 @@
+/*
+  TwiSim.h - simulated ATmega TWI peripheral for running the I2C library on a
+  host. The register objects of the host Arduino.h shim forward every access
+  here. Time is counted in CPU cycles: register accesses and timer reads cost a
+  few cycles each and bus operations take as long as they would on the wire
+  at the current TWBR, so timeouts and measured durations behave like on the
+  target.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef TwiSim_h
+#define TwiSim_h
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+//Simulated slave. All calls happen when the byte (or condition) starts on the
+//bus, the result shows up in TWSR when the operation completes.
+class SimDevice
+{
+public:
+  virtual ~SimDevice() {}
+  virtual bool address(bool read) { return (true); } //return true to ACK
+  virtual bool write(uint8_t) { return (true); }      //return true to ACK
+  virtual uint8_t read(bool ack) { return (0xFF); }
+  virtual void stop() {}
+  //Clock stretching in nanoseconds added to the next byte
+  virtual uint32_t stretch() { return (0); }
+};
+
+//Register-pointer slave like most sensors and memories: the first byte (or
+//two) written after addressing sets the register, further bytes are written
+//and reads return consecutive registers
+class SimMemory : public SimDevice
+{
+public:
+  SimMemory(bool wide = false, uint32_t stretchNs = 0);
+  bool address(bool read);
+  bool write(uint8_t);
+  uint8_t read(bool ack);
+  uint32_t stretch() { return (stretchNs); }
+  uint8_t memory[256];
+  uint32_t stretchNs;
+
+private:
+  bool wide;
+  uint8_t pointerBytes; //register address bytes still expected
+  uint16_t pointer;
+};
+
+//Register indices used by the shim
+enum SimRegisterId
+{
+  SIM_TWCR,
+  SIM_TWSR,
+  SIM_TWDR,
+  SIM_TWBR
+};
+
+//Bus faults TwiSim::inject() can cause
+enum SimFault
+{
+  FAULT_NONE,
+  FAULT_STUCK_SDA,    //a slave holds SDA low: no START or STOP, sent ones lose arbitration
+  FAULT_STUCK_SCL,    //a slave holds SCL low: no operation completes
+  FAULT_NACK,         //the next address or data byte is not acknowledged
+  FAULT_ARBITRATION,  //another master wins the next start, address or data byte
+  FAULT_MISSING_STOP  //the next STOP never completes, until the TWI is disabled
+};
+
+class TwiSim
+{
+public:
+  TwiSim();
+  void reset();
+  void attach(uint8_t, SimDevice *);
+  void attachAll(SimDevice *); //answers every address without its own device
+  void detach(uint8_t);
+
+  //Faults. The fault strikes when operation number atOperation (counted like
+  //operations) or a later one starts. Stuck lines are released holdCycles
+  //after that, 0 holds them forever; the other faults happen once.
+  void inject(SimFault, uint32_t atOperation, uint64_t holdCycles = 0);
+  bool faultActive() const { return (faultStartedAt != NEVER); }
+  uint64_t faultStart() const { return (faultStartedAt); }
+
+  //Clock
+  uint64_t cycles() const { return (now); }
+  void advance(uint64_t);
+  uint64_t nanosToCycles(uint64_t) const;
+  double cyclesToMicros(uint64_t) const;
+
+  //Bus timing
+  uint32_t sclPeriod() const; //in cycles, including rise time
+  uint32_t riseTimeNs;        //SCL rise time, lengthens every clock period
+
+  //Software cost model, in cycles
+  uint32_t readCycles;  //one register read, i.e. one polling iteration
+  uint32_t writeCycles; //one register write
+  uint32_t timerCycles; //one call to micros() or millis()
+  uint32_t stepCycles;  //software work between two bus operations
+
+  //Bus statistics since reset() or clearStats()
+  void clearStats();
+  uint64_t busyCycles;    //bus operations in progress
+  uint64_t heldCycles;    //bus owned but idle, waiting for the software
+  uint32_t controlWrites; //writes to TWCR
+
+  //Called on every register access, e.g. to print the access sequence
+  void (*traceHook)(uint64_t cycle, uint8_t reg, uint8_t value, bool write);
+
+  //Register access from the shim
+  uint8_t read(uint8_t);
+  void write(uint8_t, uint8_t);
+
+  //Cycle at which the TWI interrupt is due with TWIE set: now if TWINT is
+  //set, else the end of the operation in progress. All ones if none is due.
+  uint64_t interruptAt() const;
+  uint32_t interrupts; //TWI interrupts taken in sleep_cpu() of the shim
+
+  uint32_t operations; //bus operations started since reset()
+
+private:
+  enum Operation
+  {
+    OP_NONE,
+    OP_START,
+    OP_ADDRESS,
+    OP_SEND,
+    OP_RECEIVE,
+    OP_STOP
+  };
+  enum Phase
+  {
+    PHASE_IDLE,
+    PHASE_STARTED,
+    PHASE_TRANSMIT,
+    PHASE_RECEIVE
+  };
+  static const uint64_t NEVER = ~(uint64_t)0;
+  void begin(Operation, uint64_t);
+  void strike(Operation);
+  bool lineStuck(SimFault) const;
+  uint64_t released() const;
+  void update();
+  void complete();
+  SimDevice *lookup(uint8_t);
+
+  uint64_t now;
+  uint64_t doneAt;
+  uint64_t lastDone; //end of the previous operation
+  Operation operation;
+  Phase phase;
+  bool ack;
+  bool twint;
+  uint8_t control; //TWCR without TWINT
+  uint8_t status;
+  uint8_t prescaler;
+  uint8_t twdr;
+  uint8_t received; //byte the device put on the bus in the current read
+  uint8_t twbr;
+  SimDevice *current;
+  SimFault fault;
+  uint32_t faultAt;
+  uint64_t faultHold;
+  uint64_t faultStartedAt; //NEVER until the fault strikes
+  bool lost;               //the current operation loses arbitration
+  SimDevice *fallback;
+  SimDevice *devices[128];
+};
+
+extern TwiSim twiSim;
+
+#endif
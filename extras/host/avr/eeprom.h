@@ -0,0 +1,21 @@
+/*
+  avr/eeprom.h - host stand-in for the avr-libc EEPROM functions, backed by
+  a RAM array that starts out erased.
+*/
+
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define E2END 0x3FF
+
+uint8_t eeprom_read_byte(const uint8_t *);
+void eeprom_write_byte(uint8_t *, uint8_t);
+void eeprom_update_byte(uint8_t *, uint8_t);
+void eeprom_read_block(void *, const void *, size_t);
+void eeprom_write_block(const void *, void *, size_t);
+void eeprom_update_block(const void *, void *, size_t);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+  avr/sleep.h - host stand-in for the avr-libc sleep functions. sleep_cpu()
+  lets the simulated clock run to the next interrupt: the end of the TWI
+  operation in progress if TWIE is set, which then runs ISR(TWI_vect), or
+  at the latest the next Timer0 overflow.
+*/
+
+#ifndef _AVR_SLEEP_H_
+#define _AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() simSleep()
+
+void simSleep();
+
+#endif
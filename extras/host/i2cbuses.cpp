@@ -0,0 +1,155 @@
+/*
+  i2cbuses - throughput of an I2CExecutor with one to several buses. Each bus
+  is an I2CMaster<LinuxBackend> on a stand-in for the I2C_RDWR ioctl that
+  takes as long as the transfer would take on the wire, so the buses behave
+  like separate adapters: the thread waiting for one does not hold up the
+  others. The same register reads are spread over 1, 2, ... buses and the
+  aggregate transactions per second are printed next to the single bus rate.
+
+  Usage: i2cbuses [-b buses] [-n reads] [-s bytes] [-f frequency] [-j batch]
+      -b  largest number of buses, default 4
+      -n  register reads per bus, default 500
+      -s  bytes per read, default 6
+      -f  SCL frequency in Hz, default 400000
+      -j  transactions per ioctl, default 1
+  Returns 0 if every read succeeded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+#include "../../I2CMaster.h"
+#include "../../I2CLinux.h"
+#include "../../I2CWorker.h"
+
+typedef I2CMaster<LinuxBackend> Bus;
+
+static unsigned long frequency = 400000;
+
+//SCL periods of the messages of one request: a START or repeated START and
+//the address byte per message, the data bytes, then a STOP
+static unsigned long periods(const struct i2c_rdwr_ioctl_data *request)
+{
+  unsigned long total = 1;
+  for (unsigned m = 0; m < request->nmsgs; m++)
+  {
+    total += 1 + 9 * (1 + request->msgs[m].len);
+  }
+  return (total);
+}
+
+//Every device answers, reads return the low byte of the register pointer.
+//Sleeps until the transfer would be done on the wire.
+static int standIn(int fd, struct i2c_rdwr_ioctl_data *request)
+{
+  std::chrono::steady_clock::time_point done =
+      std::chrono::steady_clock::now() + std::chrono::microseconds(periods(request) * 1000000UL / frequency);
+  uint8_t pointer = 0;
+  for (unsigned m = 0; m < request->nmsgs; m++)
+  {
+    struct i2c_msg &message = request->msgs[m];
+    for (unsigned i = 0; i < message.len; i++)
+    {
+      if (message.flags & I2C_M_RD)
+      {
+        message.buf[i] = pointer++;
+      }
+      else if (!i)
+      {
+        pointer = message.buf[0];
+      }
+    }
+  }
+  std::this_thread::sleep_until(done);
+  return (request->nmsgs);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned maxBuses = 4;
+  unsigned reads = 500;
+  unsigned numberBytes = 6;
+  unsigned maxBatch = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:n:s:f:j:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      maxBuses = strtoul(optarg, 0, 0);
+      break;
+    case 'n':
+      reads = strtoul(optarg, 0, 0);
+      break;
+    case 's':
+      numberBytes = strtoul(optarg, 0, 0);
+      break;
+    case 'f':
+      frequency = strtoul(optarg, 0, 0);
+      break;
+    case 'j':
+      maxBatch = strtoul(optarg, 0, 0);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b buses] [-n reads] [-s bytes] [-f frequency] [-j batch]\n", argv[0]);
+      return (2);
+    }
+  }
+  if (!maxBuses || maxBuses > 16 || !reads || !numberBytes || numberBytes > 255 || !frequency || !maxBatch ||
+      maxBatch > 255)
+  {
+    fprintf(stderr, "1 - 16 buses, 1 - 255 bytes, 1 - 255 per batch and a frequency are needed\n");
+    return (2);
+  }
+
+  std::vector<uint8_t> buffers(maxBuses * reads * numberBytes);
+  std::vector<std::future<uint8_t> > results;
+  uint32_t failed = 0;
+  double single = 0;
+  printf("buses  transactions  time ms  transactions/s  vs 1 bus\n");
+  for (unsigned buses = 1; buses <= maxBuses; buses++)
+  {
+    I2CExecutor<Bus> executor(maxBatch);
+    for (unsigned b = 0; b < buses; b++)
+    {
+      executor.addBus().begin(standIn);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //interleaved like one loop polling the sensors of every bus in turn
+    for (unsigned i = 0; i < reads; i++)
+    {
+      for (unsigned b = 0; b < buses; b++)
+      {
+        results.push_back(executor.on(b).read(0x40 + b, i % 16, numberBytes,
+                                              &buffers[(b * reads + i) * numberBytes]));
+      }
+    }
+    failed += I2CExecutor<Bus>::collect(results);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = buses * reads / seconds;
+    if (buses == 1)
+    {
+      single = rate;
+    }
+    printf("%5u  %12u  %7.1f  %14.0f  %7.2fx\n", buses, buses * reads, seconds * 1000, rate, rate / single);
+  }
+  for (unsigned j = 0; j < maxBuses * reads; j++)
+  {
+    for (unsigned i = 0; i < numberBytes; i++)
+    {
+      if (buffers[j * numberBytes + i] != (uint8_t)(j % reads % 16 + i))
+      {
+        failed++;
+        break;
+      }
+    }
+  }
+  if (failed)
+  {
+    printf("%u reads failed\n", failed);
+  }
+  return (failed ? 1 : 0);
+}
@@ -0,0 +1,1099 @@
+/*
+  i2cchecks - checks the features of the I2C class that depend on how the
+  devices behave on the bus, against simulated devices: multiplexer channel
+  selection, SMBus PEC and block transfers, reads of CRC-protected words,
+  the device table, adaptive timeouts, the circuit breaker, retries, the transaction queue,
+  device profiles and I2CMaster on the TWI hardware. Every check prints its name and whether the library did what it
+  documents.
+
+  Usage: i2cchecks
+  Returns 0 if every check passed.
+*/
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "avr/eeprom.h"
+#include "avr/sleep.h"
+#include "../../I2C.h"
+#include "../../I2CMaster.h"
+
+#define SENSOR 0x1E
+#define MUX_A 0x70
+#define MUX_B 0x71
+#define GAUGE 0x0B //SMBus device
+#define HUMIDITY 0x44 //words with a CRC-8 each
+#define EEPROM 0x50
+#define BUSY 0x52 //NACKs its address while busy
+#define FIFO 0x53 //NACKs a written byte once
+#define FAST 0x20 //profiled at 400kHz
+#define SLOW 0x21 //no profile, runs at the bus speed
+#define WIDE 0x54 //16-bit registers
+#define STRETCHY 0x22 //stretches every byte by 1ms
+#define PROFILES_AT 0x100 //EEPROM address for saveProfiles()
+#define ABSENT 0x33
+#define EMPTY_AT 0x300 //EEPROM address of an empty device table
+#define FIRST_ABSENT 0x28
+#define QUICK 0x23 //answers at once
+#define LAZY 0x24  //stretches every byte by 2ms
+#define FRAGILE 0x25 //reads back wrong above a chosen bit rate
+#define TRANSITIONS 16
+#define LOG_SIZE 16
+
+static unsigned failures;
+
+static void check(const char *name, bool ok)
+{
+  printf("%-48s %s\n", name, ok ? "ok" : "WRONG RESULT");
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+//Writes to the multiplexers in the order they reached the bus
+static uint8_t muxLog[LOG_SIZE][2];
+static uint8_t muxWrites;
+
+static bool muxLogged(uint8_t index, uint8_t mux, uint8_t value)
+{
+  return (index < muxWrites && muxLog[index][0] == mux && muxLog[index][1] == value);
+}
+
+//TCA9548A-style multiplexer: the byte written is the channel enable mask
+class SimMux : public SimDevice
+{
+public:
+  SimMux(uint8_t address) : mask(0), muxAddress(address) {}
+  bool write(uint8_t value)
+  {
+    mask = value;
+    if (muxWrites < LOG_SIZE)
+    {
+      muxLog[muxWrites][0] = muxAddress;
+      muxLog[muxWrites][1] = value;
+    }
+    muxWrites++;
+    return (true);
+  }
+  uint8_t read(bool) { return (mask); }
+  uint8_t mask;
+
+private:
+  uint8_t muxAddress;
+};
+
+static void muxChecks()
+{
+  SimMux muxA(MUX_A);
+  SimMux muxB(MUX_B);
+  SimMemory sensor;
+  twiSim.attach(MUX_A, &muxA);
+  twiSim.attach(MUX_B, &muxB);
+  twiSim.attach(SENSOR, &sensor);
+  I2CMuxChannel a1(MUX_A, 1);
+  I2CMuxChannel a2(MUX_A, 2);
+  I2CMuxChannel b5(MUX_B, 5);
+  uint8_t buffer[6];
+
+  muxWrites = 0;
+  uint8_t status = 0;
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    status |= a1.read(SENSOR, 0x03, 6, buffer);
+  }
+  check("channel selected once for 5 reads", !status && muxWrites == 1 && muxLogged(0, MUX_A, 0x02));
+
+  muxWrites = 0;
+  status = a2.read(SENSOR, 0x03, 6, buffer);
+  status |= a2.read(SENSOR, 0x03, 6, buffer);
+  status |= a1.read(SENSOR, 0x03, 6, buffer);
+  check("channel written only when it changes", !status && muxWrites == 2 && muxLogged(0, MUX_A, 0x04) &&
+                                                    muxLogged(1, MUX_A, 0x02));
+
+  muxWrites = 0;
+  status = b5.read(SENSOR, 0x03, 6, buffer);
+  check("other multiplexer switched off first", !status && muxWrites == 2 && muxLogged(0, MUX_A, 0x00) &&
+                                                    muxLogged(1, MUX_B, 0x20));
+
+  muxWrites = 0;
+  status = I2c.muxRelease();
+  status |= I2c.muxRelease();
+  check("muxRelease() switches off once", !status && muxWrites == 1 && muxLogged(0, MUX_B, 0x00));
+
+  I2CTransaction transactions[6];
+  for (uint8_t i = 0; i < 6; i++)
+  {
+    I2CTransaction blank = {};
+    transactions[i] = blank;
+    transactions[i].address = SENSOR;
+    transactions[i].flags = TRANSACTION_READ;
+    transactions[i].registerAddress = i;
+    transactions[i].dataBuffer = buffer;
+    transactions[i].numberBytes = 1;
+    transactions[i].channel = MUX_CHANNEL(MUX_A, i & 1 ? 2 : 1);
+    I2c.queue(&transactions[i]);
+  }
+  muxWrites = 0;
+  while (I2c.service())
+    ;
+  status = 0;
+  for (uint8_t i = 0; i < 6; i++)
+  {
+    status |= transactions[i].status;
+  }
+  check("queue groups transactions by channel", !status && muxWrites == 2);
+
+  muxWrites = 0;
+  I2c.muxForget();
+  status = b5.read(SENSOR, 0x03, 6, buffer);
+  check("muxForget() makes the next selection rewrite", !status && muxWrites == 2 && muxLogged(0, MUX_A, 0x00) &&
+                                                            muxLogged(1, MUX_B, 0x20));
+
+  twiSim.detach(MUX_B);
+  I2c.muxForget();
+  status = b5.read(SENSOR, 0x03, 6, buffer);
+  check("absent multiplexer reported", status == MT_SLA_NACK);
+
+  twiSim.attach(MUX_B, &muxB);
+  I2c.muxRelease();
+  twiSim.detach(MUX_A);
+  twiSim.detach(MUX_B);
+  twiSim.detach(SENSOR);
+}
+
+//SMBus CRC-8, polynomial x^8 + x^2 + x + 1
+static uint8_t crc8(uint8_t crc, uint8_t value)
+{
+  crc ^= value;
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return (crc);
+}
+
+//SMBus battery gauge: command 0x09 reads a word, 0x20 a block of blockCount
+//bytes, every read ends with a PEC byte. The PEC of writes is checked at the
+//STOP: the CRC over a message and its correct PEC is 0.
+class SimGauge : public SimDevice
+{
+public:
+  SimGauge() : blockCount(5), corrupt(false), command(0), written(0), crc(0), length(0), index(0) {}
+  bool address(bool read)
+  {
+    if (!read)
+    {
+      crc = 0;
+      written = 0;
+    }
+    crc = crc8(crc, (GAUGE << 1) | read);
+    if (read)
+    {
+      index = 0;
+      length = 0;
+      if (command == 0x09)
+      {
+        out[length++] = 0x34;
+        out[length++] = 0x12;
+      }
+      else if (command == 0x20)
+      {
+        out[length++] = blockCount;
+        for (uint8_t i = 0; i < 5; i++)
+        {
+          out[length++] = 'A' + i;
+        }
+      }
+      for (uint8_t i = 0; i < length; i++)
+      {
+        crc = crc8(crc, out[i]);
+      }
+      out[length++] = crc ^ (corrupt ? 0x01 : 0x00);
+    }
+    return (true);
+  }
+  bool write(uint8_t value)
+  {
+    if (!written++)
+    {
+      command = value;
+    }
+    crc = crc8(crc, value);
+    return (true);
+  }
+  uint8_t read(bool) { return (index < length ? out[index++] : 0xFF); }
+  void stop() { writePec = written > 1 ? crc : 0xFF; }
+  uint8_t blockCount;
+  bool corrupt;
+  uint8_t command;
+  uint8_t written;  //bytes of the last write including the command
+  uint8_t writePec; //0 if the PEC of the last write was right
+
+private:
+  uint8_t crc;
+  uint8_t out[8];
+  uint8_t length;
+  uint8_t index;
+};
+
+static void smbusChecks()
+{
+  SimGauge gauge;
+  twiSim.attach(GAUGE, &gauge);
+  uint16_t word = 0;
+  uint8_t status = I2c.smbusReadWord(GAUGE, 0x09, &word);
+  check("read word without PEC", !status && word == 0x1234);
+
+  I2c.profile(GAUGE, PROFILE_PEC, 0);
+  word = 0;
+  status = I2c.smbusReadWord(GAUGE, 0x09, &word);
+  check("read word with a matching PEC", !status && word == 0x1234);
+
+  gauge.corrupt = true;
+  status = I2c.smbusReadWord(GAUGE, 0x09, &word);
+  check("read word with a wrong PEC", status == SMBUS_PEC_ERROR);
+  gauge.corrupt = false;
+
+  status = I2c.smbusWriteWord(GAUGE, 0x30, 0xBEEF);
+  check("write word sends a matching PEC", !status && gauge.written == 4 && !gauge.writePec);
+
+  const uint8_t block[3] = {1, 2, 3};
+  status = I2c.smbusBlockWrite(GAUGE, 0x31, block, 3);
+  check("block write sends a matching PEC", !status && gauge.written == 6 && !gauge.writePec);
+
+  uint8_t buffer[32];
+  uint8_t count = 0;
+  status = I2c.smbusBlockRead(GAUGE, 0x20, buffer, sizeof(buffer), &count);
+  check("block read", !status && count == 5 && buffer[0] == 'A' && buffer[4] == 'E');
+
+  gauge.corrupt = true;
+  status = I2c.smbusBlockRead(GAUGE, 0x20, buffer, sizeof(buffer), &count);
+  check("block read with a wrong PEC", status == SMBUS_PEC_ERROR);
+  gauge.corrupt = false;
+
+  status = I2c.smbusBlockRead(GAUGE, 0x20, buffer, 4, &count);
+  check("block count larger than the buffer", status == SMBUS_BLOCK_ERROR);
+
+  gauge.blockCount = 0;
+  status = I2c.smbusBlockRead(GAUGE, 0x20, buffer, sizeof(buffer), &count);
+  check("block count of 0", status == SMBUS_BLOCK_ERROR);
+
+  word = 0;
+  status = I2c.smbusReadWord(GAUGE, 0x09, &word);
+  check("bus usable after a block error", !status && word == 0x1234);
+
+  I2c.profile(GAUGE, 0, 0);
+  twiSim.detach(GAUGE);
+}
+
+//Sensirion-style sensor: sends words, each followed by a CRC-8 with
+//polynomial 0x31 and initial value 0xFF. The CRC of word badWord is wrong.
+class SimHumidity : public SimDevice
+{
+public:
+  SimHumidity() : badWord(-1), reads(0), lastAck(true), index(0) {}
+  bool address(bool read)
+  {
+    if (read)
+    {
+      reads = 0;
+      index = 0;
+    }
+    return (true);
+  }
+  uint8_t read(bool ack)
+  {
+    uint8_t word = index / 3;
+    uint8_t value;
+    if (index % 3 < 2)
+    {
+      value = 0x10 * word + index % 3 + 1;
+    }
+    else
+    {
+      value = crc(0x10 * word + 1, 0x10 * word + 2) ^ (word == badWord ? 0x01 : 0x00);
+    }
+    index++;
+    reads++;
+    lastAck = ack;
+    return (value);
+  }
+  int badWord;
+  uint8_t reads; //bytes sent in the last read
+  bool lastAck;  //whether the master acknowledged the last byte
+
+private:
+  static uint8_t crc(uint8_t first, uint8_t second)
+  {
+    uint8_t crc = 0xFF;
+    const uint8_t word[2] = {first, second};
+    for (uint8_t b = 0; b < 2; b++)
+    {
+      crc ^= word[b];
+      for (uint8_t i = 0; i < 8; i++)
+      {
+        crc = crc & 0x80 ? (crc << 1) ^ 0x31 : crc << 1;
+      }
+    }
+    return (crc);
+  }
+  uint8_t index;
+};
+
+static void wordChecks()
+{
+  SimHumidity sensor;
+  twiSim.attach(HUMIDITY, &sensor);
+  uint8_t buffer[12] = {0};
+  uint8_t status = I2c.readWords(HUMIDITY, 3, buffer);
+  check("3 words with matching CRCs", !status && sensor.reads == 9 && buffer[0] == 0x01 && buffer[1] == 0x02 &&
+                                          buffer[4] == 0x21 && buffer[5] == 0x22);
+
+  //the acknowledged CRC byte is followed by one byte that is not, to end the read
+  sensor.badWord = 0;
+  status = I2c.readWords(HUMIDITY, 3, buffer);
+  check("wrong CRC of word 1 ends the read", status == WORD_CRC_ERROR && sensor.reads == 4 && !sensor.lastAck);
+
+  sensor.badWord = 1;
+  status = I2c.readWords(HUMIDITY, 3, buffer);
+  check("wrong CRC of word 2 ends the read", status == WORD_CRC_ERROR && sensor.reads == 7 && !sensor.lastAck);
+
+  sensor.badWord = 2;
+  status = I2c.readWords(HUMIDITY, 3, buffer);
+  check("wrong CRC of the last word", status == WORD_CRC_ERROR && sensor.reads == 9 && !sensor.lastAck);
+
+  sensor.badWord = -1;
+  status = I2c.readWords(HUMIDITY, 0xE000, 2, buffer);
+  check("bus usable after a CRC error", !status && sensor.reads == 6 && buffer[2] == 0x11 && buffer[3] == 0x12);
+  twiSim.detach(HUMIDITY);
+}
+
+static void waitMs(uint32_t ms)
+{
+  twiSim.advance(twiSim.nanosToCycles(ms * 1000000ULL));
+}
+
+//Memory that can be unplugged or NACK its address the next busy times, and
+//that NACKs the first data byte written after nackData is set
+class SimSwitched : public SimMemory
+{
+public:
+  SimSwitched() : present(true), busy(0), nackData(false), addressed(0), written(0) {}
+  bool address(bool read)
+  {
+    addressed++;
+    if (busy)
+    {
+      busy--;
+      return (false);
+    }
+    return (present && SimMemory::address(read));
+  }
+  bool write(uint8_t value)
+  {
+    //the first byte is the register address
+    if (written++ && nackData)
+    {
+      nackData = false;
+      return (false);
+    }
+    return (SimMemory::write(value));
+  }
+  bool present;
+  uint8_t busy;
+  bool nackData;
+  unsigned addressed;
+  unsigned written;
+};
+
+//Health transitions reported to the I2c.healthMonitor() sink, from * 10 + to
+static uint8_t transitions[TRANSITIONS];
+static uint8_t transitionCount;
+
+static void healthSink(uint8_t address, uint8_t from, uint8_t to)
+{
+  if (address == EEPROM && transitionCount < TRANSITIONS)
+  {
+    transitions[transitionCount++] = from * 10 + to;
+  }
+}
+
+static bool transitioned(uint8_t first, uint8_t second = 0xFF)
+{
+  bool ok = transitionCount == (second == 0xFF ? 1 : 2) && transitions[0] == first &&
+            (second == 0xFF || transitions[1] == second);
+  transitionCount = 0;
+  return (ok);
+}
+
+//Reads from absent addresses with the circuit breaker on, each takes a slot
+static void failAbsent()
+{
+  uint8_t buffer[2];
+  for (uint8_t i = 0; i < 3 * MAX_DEVICES; i++)
+  {
+    I2c.read(FIRST_ABSENT + i, 0x00, 2, buffer);
+  }
+}
+
+//Runs first, on the empty device table, which it leaves empty
+static void slotChecks()
+{
+  I2c.saveProfiles(EMPTY_AT);
+  I2c.circuitBreaker(3, 100);
+  failAbsent();
+  uint8_t status = 0;
+  uint8_t added = 0;
+  while (!status && added < MAX_DEVICES + 1)
+  {
+    status = I2c.profile(0x60 + added++, 0, 0);
+  }
+  check("absent addresses do not block profile()", status == 1 && added == MAX_DEVICES + 1);
+  check("profiles are never given up", I2c.profile(0x60, 0, 0) == 0);
+  I2c.loadProfiles(EMPTY_AT);
+
+  SimMemory sensor;
+  twiSim.attach(SENSOR, &sensor);
+  I2c.adaptiveTimeOut(1);
+  uint8_t buffer[2];
+  for (uint8_t i = 0; i < ADAPTIVE_MIN_SAMPLES; i++)
+  {
+    I2c.read(SENSOR, 0x00, 2, buffer);
+  }
+  uint32_t learned = I2c.deviceTimeOut(SENSOR);
+  failAbsent();
+  check("learned timeout kept through absent addresses", learned < 10000 && I2c.deviceTimeOut(SENSOR) == learned);
+
+  SimMemory anyone;
+  twiSim.attachAll(&anyone);
+  for (uint8_t address = FIRST_ABSENT; address < FIRST_ABSENT + 3 * MAX_DEVICES; address++)
+  {
+    I2c.write(address, (uint8_t)0x00);
+  }
+  twiSim.attachAll(0);
+  check("learned timeout kept through a scan", I2c.deviceTimeOut(SENSOR) == learned);
+
+  I2c.adaptiveTimeOut(0);
+  I2c.circuitBreaker(0, 0);
+  I2c.loadProfiles(EMPTY_AT);
+  twiSim.detach(SENSOR);
+}
+
+//Runs on the empty device table, which it leaves empty
+static void adaptiveChecks()
+{
+  SimMemory quick;
+  SimMemory lazy(false, 2000000);
+  twiSim.attach(QUICK, &quick);
+  twiSim.attach(LAZY, &lazy);
+  I2c.adaptiveTimeOut(1);
+  uint8_t buffer[2];
+  for (uint8_t i = 0; i < ADAPTIVE_MIN_SAMPLES; i++)
+  {
+    I2c.read(QUICK, 0x00, 2, buffer);
+    I2c.read(LAZY, 0x00, 2, buffer);
+  }
+  uint32_t quickLimit = I2c.deviceTimeOut(QUICK);
+  uint32_t lazyLimit = I2c.deviceTimeOut(LAZY);
+  check("fast device learns a tight timeout", quickLimit < 1000);
+  check("slow device learns a larger one", lazyLimit > 2 * 2000 && lazyLimit < 10000 &&
+                                               !I2c.read(LAZY, 0x00, 2, buffer));
+
+  twiSim.inject(FAULT_STUCK_SCL, twiSim.operations + 2, twiSim.nanosToCycles(20000000ULL));
+  unsigned long start = micros();
+  uint8_t status = I2c.read(QUICK, 0x00, 2, buffer);
+  unsigned long elapsed = micros() - start;
+  check("dead fast device fails at its learned timeout", status == 2 && elapsed >= quickLimit &&
+                                                             elapsed < quickLimit + 200);
+  waitMs(20);
+
+  I2c.profile(LAZY, 0, 0, 7000);
+  check("profile() timeout overrides the learned one", I2c.deviceTimeOut(LAZY) == 7000);
+  I2c.profile(LAZY, 0, 0);
+  check("learned timeout back without a profile timeout", I2c.deviceTimeOut(LAZY) == lazyLimit);
+
+  I2c.adaptiveTimeOut(0);
+  I2c.loadProfiles(EMPTY_AT);
+  twiSim.detach(QUICK);
+  twiSim.detach(LAZY);
+}
+
+static void breakerChecks()
+{
+  SimSwitched eeprom;
+  twiSim.attach(EEPROM, &eeprom);
+  I2c.circuitBreaker(3, 100, 400);
+  I2c.healthMonitor(healthSink);
+  uint8_t buffer[2];
+
+  eeprom.present = false;
+  uint8_t status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("address NACK: OK to FAILING", status == MT_SLA_NACK && I2c.deviceHealth(EEPROM) == HEALTH_FAILING &&
+                                          I2c.deviceFailures(EEPROM) == 1 && transitioned(HEALTH_OK * 10 + HEALTH_FAILING));
+
+  I2c.read(EEPROM, 0x00, 2, buffer);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("third failure in a row: FAILING to OPEN", status == MT_SLA_NACK && I2c.deviceHealth(EEPROM) == HEALTH_OPEN &&
+                                                      transitioned(HEALTH_FAILING * 10 + HEALTH_OPEN));
+
+  unsigned addressed = eeprom.addressed;
+  uint32_t operations = twiSim.operations;
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("open: DEVICE_OFFLINE without bus traffic", status == DEVICE_OFFLINE && eeprom.addressed == addressed &&
+                                                       twiSim.operations == operations);
+
+  waitMs(100);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("failed probe: OPEN to PROBING to OPEN", status == MT_SLA_NACK && eeprom.addressed == addressed + 1 &&
+                                                    transitioned(HEALTH_OPEN * 10 + HEALTH_PROBING,
+                                                                 HEALTH_PROBING * 10 + HEALTH_OPEN));
+
+  waitMs(150);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("backoff doubled after a failed probe", status == DEVICE_OFFLINE);
+  waitMs(60);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("probe after the doubled backoff", status == MT_SLA_NACK && I2c.deviceHealth(EEPROM) == HEALTH_OPEN);
+
+  eeprom.present = true;
+  waitMs(400);
+  transitionCount = 0;
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("answered probe: PROBING to OK", !status && I2c.deviceHealth(EEPROM) == HEALTH_OK &&
+                                            !I2c.deviceFailures(EEPROM) &&
+                                            transitioned(HEALTH_OPEN * 10 + HEALTH_PROBING,
+                                                         HEALTH_PROBING * 10 + HEALTH_OK));
+
+  eeprom.present = false;
+  I2c.read(EEPROM, 0x00, 2, buffer);
+  I2c.read(EEPROM, 0x00, 2, buffer);
+  eeprom.present = true;
+  twiSim.inject(FAULT_ARBITRATION, twiSim.operations + 2);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("lost arbitration neither counts nor clears", status == LOST_ARBTRTN && I2c.deviceFailures(EEPROM) == 2 &&
+                                                         I2c.deviceHealth(EEPROM) == HEALTH_FAILING);
+
+  twiSim.inject(FAULT_NACK, twiSim.operations + 3);
+  status = I2c.read(EEPROM, 0x00, 2, buffer);
+  check("data NACK clears the failures", status == MT_DATA_NACK && !I2c.deviceFailures(EEPROM) &&
+                                            I2c.deviceHealth(EEPROM) == HEALTH_OK);
+
+  I2c.circuitBreaker(0, 0);
+  I2c.healthMonitor(0);
+  I2c.resetHealth(EEPROM);
+  twiSim.detach(EEPROM);
+}
+
+static bool retried(uint32_t retries, uint32_t recovered, uint32_t exhausted, uint32_t refused)
+{
+  I2CRetryCounts counts;
+  I2c.retryCounts(&counts);
+  I2c.clearRetryCounts();
+  return (counts.retries == retries && counts.recovered == recovered && counts.exhausted == exhausted &&
+          counts.refused == refused);
+}
+
+static void retryChecks()
+{
+  SimSwitched busy;
+  SimSwitched fifo;
+  twiSim.attach(BUSY, &busy);
+  twiSim.attach(FIFO, &fifo);
+  uint8_t buffer[2];
+  uint8_t data[3] = {1, 2, 3};
+  I2c.clearRetryCounts();
+
+  busy.busy = 2;
+  busy.addressed = 0;
+  uint8_t status = I2c.read(BUSY, 0x00, 2, buffer);
+  check("no retries without a policy", status == MT_SLA_NACK && busy.addressed == 1 && retried(0, 0, 0, 0));
+
+  I2c.retryPolicy(3, RETRY_NACK, 500, 2000);
+  busy.busy = 2;
+  busy.addressed = 0;
+  unsigned long start = micros();
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  unsigned long elapsed = micros() - start;
+  //two NACKed attempts, then SLA+W and SLA+R of the one that succeeds
+  check("address NACKs retried until answered", !status && busy.addressed == 4 && retried(2, 1, 0, 0));
+  check("retry delay doubles", elapsed >= 1500 && elapsed < 3500);
+
+  I2c.retryPolicy(1, RETRY_NACK, 20000);
+  busy.busy = 1;
+  start = micros();
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  elapsed = micros() - start;
+  check("busy-waited retry delay capped", !status && retried(1, 1, 0, 0) && elapsed >= RETRY_POLL_MAX_DELAY &&
+                                              elapsed < RETRY_POLL_MAX_DELAY + 1000);
+  I2c.idleSleep(1);
+  busy.busy = 1;
+  start = micros();
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  elapsed = micros() - start;
+  check("retry delay slept through in full", !status && retried(1, 1, 0, 0) && elapsed >= 20000 && elapsed < 21000);
+  I2c.idleSleep(0);
+  I2c.retryPolicy(3, RETRY_NACK, 500, 2000);
+
+  busy.busy = 9;
+  busy.addressed = 0;
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  check("retries exhausted", status == MT_SLA_NACK && busy.addressed == 4 && retried(3, 0, 1, 0));
+
+  fifo.nackData = true;
+  fifo.written = 0;
+  fifo.addressed = 0;
+  status = I2c.write(FIFO, 0x10, data, 3);
+  check("data NACK retried", !status && fifo.addressed == 2 && retried(1, 1, 0, 0));
+
+  I2CTransaction transaction = {};
+  transaction.address = FIFO;
+  transaction.flags = TRANSACTION_WRITE | TRANSACTION_NOT_IDEMPOTENT;
+  transaction.registerAddress = 0x10;
+  transaction.dataBuffer = data;
+  transaction.numberBytes = 3;
+  fifo.nackData = true;
+  fifo.written = 0;
+  fifo.addressed = 0;
+  status = I2c.transaction(&transaction);
+  check("not idempotent: data NACK not retried", status == MT_DATA_NACK && fifo.addressed == 1 &&
+                                                    retried(0, 0, 0, 1));
+
+  transaction.address = BUSY;
+  busy.busy = 1;
+  busy.addressed = 0;
+  status = I2c.transaction(&transaction);
+  check("not idempotent: address NACK retried", !status && busy.addressed == 2 && retried(1, 1, 0, 0));
+
+  I2c.profile(FIFO, PROFILE_NOT_IDEMPOTENT, 0);
+  fifo.nackData = true;
+  fifo.written = 0;
+  fifo.addressed = 0;
+  status = I2c.write(FIFO, 0x10, data, 3);
+  check("PROFILE_NOT_IDEMPOTENT: data NACK not retried", status == MT_DATA_NACK && fifo.addressed == 1 &&
+                                                            retried(0, 0, 0, 1));
+
+  I2c.profile(BUSY, 0, 0, 0, 1);
+  busy.busy = 2;
+  busy.addressed = 0;
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  check("profile retry count replaces the limit", status == MT_SLA_NACK && busy.addressed == 2 &&
+                                                     retried(1, 0, 1, 0));
+
+  I2c.profile(BUSY, 0, 0);
+  I2c.circuitBreaker(2, 100);
+  busy.busy = 9;
+  busy.addressed = 0;
+  status = I2c.read(BUSY, 0x00, 2, buffer);
+  check("retries stop when the breaker opens", status == MT_SLA_NACK && busy.addressed == 2 &&
+                                                  I2c.deviceHealth(BUSY) == HEALTH_OPEN && retried(1, 0, 1, 0));
+
+  I2c.circuitBreaker(0, 0);
+  I2c.resetHealth(BUSY);
+  I2c.retryPolicy(0);
+  I2c.profile(FIFO, 0, 0);
+  twiSim.detach(BUSY);
+  twiSim.detach(FIFO);
+}
+
+static bool matches(const uint8_t *data, uint8_t first, uint8_t numberBytes)
+{
+  for (uint8_t i = 0; i < numberBytes; i++)
+  {
+    if (data[i] != (uint8_t)(first + i))
+    {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+static void queueChecks()
+{
+  SimSwitched sensor;
+  twiSim.attach(SENSOR, &sensor);
+  uint8_t low[2];
+  uint8_t high[2];
+  uint8_t chunked[20];
+  uint8_t data[10];
+  for (uint8_t i = 0; i < sizeof(data); i++)
+  {
+    data[i] = 0xA0 + i;
+  }
+
+  I2CTransaction invalid = {};
+  invalid.address = SENSOR;
+  invalid.flags = TRANSACTION_READ;
+  check("read of 0 bytes refused", I2c.queue(&invalid) == 2);
+  invalid.flags = TRANSACTION_WRITE | TRANSACTION_NO_REGISTER;
+  check("write without register refused", I2c.queue(&invalid) == 2);
+
+  I2CTransaction first = {};
+  first.address = SENSOR;
+  first.flags = TRANSACTION_READ;
+  first.registerAddress = 0x03;
+  first.dataBuffer = low;
+  first.numberBytes = 2;
+  I2CTransaction second = first;
+  second.registerAddress = 0x07;
+  second.dataBuffer = high;
+  second.priority = 1;
+  uint8_t status = I2c.queue(&first);
+  status |= I2c.queue(&second);
+  check("queued", !status && I2c.pending() == 2 && first.status == TRANSACTION_PENDING);
+  check("queued twice refused", I2c.queue(&first) == 1 && I2c.pending() == 2);
+
+  I2c.service();
+  check("higher priority served first", !second.status && matches(high, 0x07, 2) &&
+                                            first.status == TRANSACTION_PENDING && I2c.pending() == 1);
+  I2c.service();
+  check("then the other one", !first.status && matches(low, 0x03, 2) && !I2c.pending() && !I2c.service());
+
+  I2CTransaction read = first;
+  read.registerAddress = 0x10;
+  read.dataBuffer = chunked;
+  read.numberBytes = sizeof(chunked);
+  read.chunkSize = 8;
+  I2c.queue(&read);
+  sensor.addressed = 0;
+  uint8_t steps = 0;
+  bool advanced = true;
+  while (I2c.service())
+  {
+    steps++;
+    advanced &= read.bytesDone == (steps * 8 < sizeof(chunked) ? steps * 8 : sizeof(chunked));
+  }
+  check("read split into chunks", !read.status && steps == 3 && advanced && sensor.addressed == 6 &&
+                                      matches(chunked, 0x10, sizeof(chunked)));
+
+  I2CTransaction write = {};
+  write.address = SENSOR;
+  write.flags = TRANSACTION_WRITE;
+  write.registerAddress = 0x40;
+  write.dataBuffer = data;
+  write.numberBytes = sizeof(data);
+  write.chunkSize = 4;
+  I2c.queue(&write);
+  steps = 0;
+  while (I2c.service())
+  {
+    steps++;
+  }
+  check("write split into chunks", !write.status && write.bytesDone == sizeof(data) && steps == 3 &&
+                                       matches(&sensor.memory[0x40], 0xA0, sizeof(data)));
+
+  I2c.queue(&read);
+  I2c.service();
+  status = I2c.cancel(&read);
+  check("cancelled after one chunk", !status && read.status == TRANSACTION_PENDING && read.bytesDone == 8 &&
+                                         !I2c.pending() && I2c.cancel(&read) == 1);
+
+  sensor.present = false;
+  I2c.queue(&first);
+  I2c.service();
+  check("failed transaction removed with its status", first.status == MT_SLA_NACK && !I2c.pending());
+  twiSim.detach(SENSOR);
+}
+
+//Writes to TWBR, see the traceHook of TwiSim
+static unsigned bitRateWrites;
+static uint8_t bitRate;
+
+static void countBitRate(uint64_t, uint8_t reg, uint8_t value, bool write)
+{
+  if (reg == SIM_TWBR && write)
+  {
+    bitRateWrites++;
+    bitRate = value;
+  }
+}
+
+//Memory that sends different wrong data every time while TWBR is below
+//minimum, i.e. the bus is faster than the wiring takes. Follows TWBR through
+//countBitRate(), reading the register here would run the simulation.
+class SimFragile : public SimMemory
+{
+public:
+  explicit SimFragile(uint8_t minimum) : minimum(minimum), addressed(0), noise(0) {}
+  bool address(bool read)
+  {
+    addressed++;
+    return (SimMemory::address(read));
+  }
+  uint8_t read(bool ack)
+  {
+    uint8_t value = SimMemory::read(ack);
+    return (bitRate < minimum ? value ^ (++noise | 1) : value);
+  }
+  uint8_t minimum;
+  unsigned addressed;
+
+private:
+  uint8_t noise;
+};
+
+//Whether calibrateSpeed() left the retry policy (2 retries), the circuit
+//breaker (threshold 3) and the timeout (0 for none) as they were
+static bool settingsKept(SimSwitched &busy, uint16_t timeOutMs)
+{
+  uint8_t buffer[2];
+  busy.busy = 1;
+  busy.addressed = 0;
+  bool ok = !I2c.read(BUSY, 0x00, 2, buffer) && busy.addressed == 3;
+  I2c.read(ABSENT, 0x00, 2, buffer);
+  ok = ok && I2c.deviceHealth(ABSENT) == HEALTH_OPEN;
+  I2c.resetHealth(ABSENT);
+  //stuck for longer than the 80ms calibrateSpeed() uses without a timeout
+  twiSim.inject(FAULT_STUCK_SCL, twiSim.operations + 2, twiSim.nanosToCycles(100000000ULL));
+  unsigned long start = micros();
+  uint8_t status = I2c.read(BUSY, 0x00, 2, buffer);
+  unsigned long elapsed = micros() - start;
+  waitMs(100);
+  I2c.resetHealth(BUSY);
+  if (!timeOutMs)
+  {
+    return (ok && !status && elapsed >= 100000);
+  }
+  return (ok && status >= 1 && status <= 7 && elapsed >= timeOutMs * 1000UL && elapsed < timeOutMs * 1000UL + 1000);
+}
+
+static bool noErrorsBut(const uint8_t *errorCounts, uint8_t step, uint8_t errors)
+{
+  for (uint8_t i = 0; i < CALIBRATE_STEPS; i++)
+  {
+    if (errorCounts[i] != (i == step ? errors : 0))
+    {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+//Runs on the bus at 100kHz, leaves the device table empty
+static void calibrateChecks()
+{
+  SimFragile fragile(12);
+  SimSwitched busy;
+  twiSim.attach(FRAGILE, &fragile);
+  twiSim.attach(BUSY, &busy);
+  I2c.retryPolicy(2, RETRY_NACK);
+  I2c.circuitBreaker(3, 100);
+  uint8_t errorCounts[CALIBRATE_STEPS];
+  uint8_t buffer[2];
+  bitRate = TWBR;
+  twiSim.traceHook = countBitRate;
+
+  //TWBR 72, 45, 32, 24, 18, 14 and 12 (400kHz) pass, 9 fails
+  uint32_t speed = I2c.calibrateSpeed(FRAGILE, 0x00, 2, 2, 0, errorCounts, CALIBRATE_STEPS);
+  check("calibrated one step below the fastest passed", speed == F_CPU / (16 + 2 * 14) &&
+                                                           noErrorsBut(errorCounts, 7, 2) && fragile.addressed == 2 + 8 * 2 * 2);
+  I2c.read(FRAGILE, 0x00, 2, buffer);
+  check("calibrated speed used", bitRate == 14 && buffer[0] == 0x00 && buffer[1] == 0x01);
+  check("calibration kept retries, breaker and timeout", settingsKept(busy, 10));
+
+  //steps with a TWBR already tested (800kHz, 900kHz and up) are skipped
+  fragile.minimum = 0;
+  fragile.addressed = 0;
+  speed = I2c.calibrateSpeed(FRAGILE, 0x00, 2, 2, 0, errorCounts, CALIBRATE_STEPS);
+  check("repeated bit rates not tested again", speed == F_CPU / (16 + 2 * 2) &&
+                                                  noErrorsBut(errorCounts, 0, 0) && fragile.addressed == 2 + 15 * 2 * 2);
+
+  fragile.minimum = 46;
+  speed = I2c.calibrateSpeed(FRAGILE, 0x00, 2, 2, 0, errorCounts, CALIBRATE_STEPS);
+  check("only 100kHz passed: no step below it", speed == 100000 && noErrorsBut(errorCounts, 1, 2));
+
+  I2c.timeOut(0);
+  speed = I2c.calibrateSpeed(ABSENT, 0x00, 2, 2, 0, errorCounts, CALIBRATE_STEPS);
+  check("absent device not calibrated", !speed && noErrorsBut(errorCounts, 0, 0));
+  check("failed calibration kept all three, no timeout", settingsKept(busy, 0));
+
+  twiSim.traceHook = 0;
+  I2c.timeOut(10);
+  I2c.retryPolicy(0);
+  I2c.circuitBreaker(0, 0);
+  I2c.clearRetryCounts();
+  I2c.loadProfiles(EMPTY_AT);
+  twiSim.detach(FRAGILE);
+  twiSim.detach(BUSY);
+}
+
+static void profileChecks()
+{
+  SimMemory fast;
+  SimMemory slow;
+  SimMemory wide(true);
+  SimMemory stretchy(false, 1000000);
+  twiSim.attach(FAST, &fast);
+  twiSim.attach(SLOW, &slow);
+  twiSim.attach(WIDE, &wide);
+  twiSim.attach(STRETCHY, &stretchy);
+  twiSim.traceHook = countBitRate;
+  uint8_t buffer[2];
+
+  uint8_t status = I2c.profile(FAST, 0, 400000);
+  bitRateWrites = 0;
+  status |= I2c.read(FAST, 0x00, 2, buffer);
+  check("profiled speed used", !status && bitRateWrites == 1 && bitRate == 12);
+  status = I2c.read(FAST, 0x00, 2, buffer);
+  check("bit rate not rewritten for the same speed", !status && bitRateWrites == 1);
+  status = I2c.read(SLOW, 0x00, 2, buffer);
+  check("device without a profile at the bus speed", !status && bitRateWrites == 2 && bitRate == 72);
+
+  status = I2c.profile(WIDE, PROFILE_REG16, 0);
+  status |= I2c.readRegister(WIDE, 0x0123, 2, buffer);
+  check("PROFILE_REG16: 16-bit register address", !status && buffer[0] == 0x23 && buffer[1] == 0x24);
+
+  status = I2c.write((uint8_t)SLOW, (uint8_t)0x30, (uint16_t)0x1234);
+  check("multi-byte values MSB first", !status && slow.memory[0x30] == 0x12 && slow.memory[0x31] == 0x34);
+  status = I2c.profile(SLOW, PROFILE_LSB_FIRST, 0);
+  status |= I2c.write((uint8_t)SLOW, (uint8_t)0x30, (uint16_t)0x1234);
+  check("PROFILE_LSB_FIRST: LSB first", !status && slow.memory[0x30] == 0x34 && slow.memory[0x31] == 0x12);
+
+  status = I2c.read(STRETCHY, 0x00, 2, buffer);
+  check("stretching device within the global timeout", !status);
+  I2c.profile(STRETCHY, 0, 0, 300);
+  status = I2c.read(STRETCHY, 0x00, 2, buffer);
+  check("profiled timeout in microseconds", status >= 1 && status <= 7 && I2c.deviceTimeOut(STRETCHY) == 300);
+
+  I2c.saveProfiles(PROFILES_AT);
+  I2c.profile(FAST, 0, 100000);
+  status = I2c.loadProfiles(PROFILES_AT);
+  bitRateWrites = 0;
+  status |= I2c.read(FAST, 0x00, 2, buffer);
+  check("profiles restored from EEPROM", !status && bitRateWrites == 1 && bitRate == 12 &&
+                                             I2c.deviceTimeOut(STRETCHY) == 300);
+
+  eeprom_write_byte((uint8_t *)PROFILES_AT + 4, eeprom_read_byte((const uint8_t *)PROFILES_AT + 4) ^ 0x01);
+  I2c.profile(FAST, 0, 100000);
+  status = I2c.loadProfiles(PROFILES_AT);
+  bitRateWrites = 0;
+  I2c.read(FAST, 0x00, 2, buffer);
+  check("damaged profiles not loaded", status == 1 && bitRate == 72);
+  check("erased EEPROM not loaded", I2c.loadProfiles(PROFILES_AT + 0x100) == 1);
+
+  twiSim.traceHook = 0;
+  twiSim.detach(FAST);
+  twiSim.detach(SLOW);
+  twiSim.detach(WIDE);
+  twiSim.detach(STRETCHY);
+}
+
+static void masterChecks()
+{
+  SimMemory sensor;
+  SimMemory fast;
+  twiSim.attach(SENSOR, &sensor);
+  twiSim.attach(FAST, &fast);
+  I2CMaster<TwiBackend<0>, 8, FixedTimeOut<5>, CountingInstrumentation> bus;
+  bus.begin();
+  uint8_t buffer[6];
+  const uint8_t data[3] = {0xC0, 0xC1, 0xC2};
+
+  uint8_t status = bus.read(SENSOR, 0x03, 6, buffer);
+  check("I2CMaster<TwiBackend>: read", !status && matches(buffer, 0x03, 6));
+  status = bus.write(SENSOR, 0x40, data, 3);
+  check("I2CMaster<TwiBackend>: write", !status && matches(&sensor.memory[0x40], 0xC0, 3));
+  status = bus.read(SENSOR, 0x10, 4);
+  check("I2CMaster<TwiBackend>: buffered read", !status && bus.available() == 4 && bus.receive() == 0x10);
+  status = bus.read(ABSENT, 0x00, 2, buffer);
+  check("I2CMaster<TwiBackend>: absent device", status == MT_SLA_NACK);
+
+  I2c.profile(FAST, 0, 400000);
+  twiSim.traceHook = countBitRate;
+  bitRateWrites = 0;
+  status = bus.read(FAST, 0x00, 2, buffer);
+  twiSim.traceHook = 0;
+  check("I2CMaster<TwiBackend>: device profile applied", !status && bitRateWrites == 1 && bitRate == 12);
+
+  twiSim.inject(FAULT_STUCK_SCL, twiSim.operations + 2, twiSim.nanosToCycles(20000000ULL));
+  unsigned long start = micros();
+  status = bus.read(SENSOR, 0x03, 6, buffer);
+  unsigned long elapsed = micros() - start;
+  check("I2CMaster<TwiBackend>: policy timeout", status == 2 && elapsed >= 5000 && elapsed < 6000);
+  waitMs(20);
+  status = bus.read(SENSOR, 0x03, 6, buffer);
+  check("I2CMaster<TwiBackend>: bus recovered", !status);
+  check("I2CMaster<TwiBackend>: instrumentation", bus.transactions == 7 && bus.failures == 2);
+
+  twiSim.inject(FAULT_STUCK_SCL, twiSim.operations + 2, twiSim.nanosToCycles(20000000ULL));
+  start = micros();
+  status = I2c.read(SENSOR, 0x03, 6, buffer);
+  elapsed = micros() - start;
+  check("I2c timeout left alone by the policy", status == 2 && elapsed >= 10000 && elapsed < 11000);
+  waitMs(20);
+
+  I2c.pullup(1);
+  twiSim.detach(SENSOR);
+  twiSim.detach(FAST);
+}
+
+//Idle sleep with the sleep_cpu() of the shim, which runs the clock to the
+//TWI interrupt or the next Timer0 overflow
+static void idleChecks()
+{
+  SimMemory sensor;
+  twiSim.attach(SENSOR, &sensor);
+  uint8_t buffer[6];
+
+  unsigned long start = micros();
+  uint8_t status = I2c.read(SENSOR, 0x03, 6, buffer);
+  unsigned long polled = micros() - start;
+  I2c.idleSleep(1);
+  twiSim.interrupts = 0;
+  start = micros();
+  status |= I2c.read(SENSOR, 0x03, 6, buffer);
+  unsigned long slept = micros() - start;
+  //START, SLA+W, register, repeated START, SLA+R and 6 bytes; the STOP is not waited for
+  check("idle sleep: read woken by each TWINT", !status && matches(buffer, 0x03, 6) && twiSim.interrupts == 11 &&
+                                                    slept <= polled + 50);
+
+  //a START by hand, then the sleep the library would do
+  TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+  twiSim.interrupts = 0;
+  start = micros();
+  sleep_cpu();
+  unsigned long elapsed = micros() - start;
+  uint8_t control = TWCR;
+  check("idle sleep: TWIE cleared, TWINT left set", twiSim.interrupts == 1 && (control & (1 << TWINT)) &&
+                                                       !(control & (1 << TWIE)) && (TWSR & 0xF8) == START &&
+                                                       elapsed < 1000);
+  TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
+
+  twiSim.inject(FAULT_STUCK_SCL, twiSim.operations + 2, twiSim.nanosToCycles(20000000ULL));
+  twiSim.interrupts = 0;
+  start = micros();
+  status = I2c.read(SENSOR, 0x03, 6, buffer);
+  elapsed = micros() - start;
+  //the START wakes by TWINT, then Timer0 wakes about every millisecond to
+  //check the 10ms timeout of the address
+  check("idle sleep: stuck SCL still times out", status == 2 && twiSim.interrupts == 1 && elapsed >= 10000 &&
+                                                    elapsed < 10000 + 1100);
+  waitMs(20);
+  status = I2c.read(SENSOR, 0x03, 6, buffer);
+  check("idle sleep: bus recovered", !status && matches(buffer, 0x03, 6));
+
+  I2c.idleSleep(0);
+  twiSim.detach(SENSOR);
+}
+
+int main()
+{
+  I2c.begin();
+  I2c.timeOut(10);
+
+  slotChecks();
+  adaptiveChecks();
+  muxChecks();
+  smbusChecks();
+  wordChecks();
+  breakerChecks();
+  retryChecks();
+  queueChecks();
+  calibrateChecks();
+  profileChecks();
+  masterChecks();
+  idleChecks();
+
+  printf("%u checks failed\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,163 @@
+/*
+  i2cfaults - injects bus faults into the simulated TWI peripheral while the
+  library reads a sensor, checks that each fault is reported with the right
+  return value and measures how long it takes until the next read succeeds.
+
+  Every scenario runs I2c.read(address, register, 6, buffer), whose bus
+  operations are numbered 1 START, 2 SLA+W, 3 register, 4 repeated START,
+  5 SLA+R, 6 - 11 data bytes, 12 STOP. The fault strikes at the given
+  operation, the read is then repeated back to back until it succeeds.
+
+  Usage: i2cfaults [-t ms] [-h ms] [-a] [-v]
+      -t  library timeout in ms, default 10
+      -h  how long stuck lines stay stuck in ms, default 25
+      -a  use adaptive timeouts, learned before the faults are injected
+      -v  print the return value of every attempt
+  Returns 0 if every fault was reported as expected and recovered from.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "../../I2C.h"
+
+#define SENSOR 0x1E
+#define SENSOR_REGISTER 0x03
+#define SAMPLE_BYTES 6
+#define GIVE_UP_MS 5000 //attempts stop when recovery takes longer than this
+
+struct Scenario
+{
+  const char *name;
+  SimFault fault;
+  uint32_t atOperation;
+  uint8_t expected; //return value of the read the fault strikes
+};
+
+static const Scenario scenarios[] = {
+    {"stuck SCL before START", FAULT_STUCK_SCL, 1, 1},
+    {"stuck SCL on SLA+W", FAULT_STUCK_SCL, 2, 2},
+    {"stuck SCL on register", FAULT_STUCK_SCL, 3, 3},
+    {"stuck SCL on repeated START", FAULT_STUCK_SCL, 4, 4},
+    {"stuck SCL on SLA+R", FAULT_STUCK_SCL, 5, 5},
+    {"stuck SCL on data byte", FAULT_STUCK_SCL, 8, 6},
+    {"stuck SCL on STOP", FAULT_STUCK_SCL, 12, 7},
+    {"stuck SDA before START", FAULT_STUCK_SDA, 1, 1},
+    {"stuck SDA on register", FAULT_STUCK_SDA, 3, LOST_ARBTRTN},
+    {"stuck SDA on data byte", FAULT_STUCK_SDA, 8, 7},
+    {"NACK on SLA+W", FAULT_NACK, 2, MT_SLA_NACK},
+    {"NACK on register", FAULT_NACK, 3, MT_DATA_NACK},
+    {"NACK on SLA+R", FAULT_NACK, 5, MR_SLA_NACK},
+    {"arbitration lost on SLA+W", FAULT_ARBITRATION, 2, LOST_ARBTRTN},
+    {"arbitration lost on register", FAULT_ARBITRATION, 3, LOST_ARBTRTN},
+    {"arbitration lost on data byte", FAULT_ARBITRATION, 8, LOST_ARBTRTN},
+    {"missing STOP", FAULT_MISSING_STOP, 12, 7},
+};
+
+static double ms(uint64_t cycles)
+{
+  return (twiSim.cyclesToMicros(cycles) / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned timeOut = 10;
+  unsigned hold = 25;
+  bool adaptive = false;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:h:av")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      timeOut = atoi(optarg);
+      break;
+    case 'h':
+      hold = atoi(optarg);
+      break;
+    case 'a':
+      adaptive = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t ms] [-h ms] [-a] [-v]\n", argv[0]);
+      return (2);
+    }
+  }
+  if (!timeOut)
+  {
+    //Without a timeout a stuck bus hangs the library, there is nothing to measure
+    fprintf(stderr, "the timeout must be at least 1 ms\n");
+    return (2);
+  }
+
+  SimMemory sensor;
+  uint8_t sample[SAMPLE_BYTES];
+  twiSim.attach(SENSOR, &sensor);
+  I2c.begin();
+  I2c.timeOut(timeOut);
+  I2c.adaptiveTimeOut(adaptive);
+  for (uint8_t i = 0; i < ADAPTIVE_MIN_SAMPLES; i++)
+  {
+    I2c.read(SENSOR, SENSOR_REGISTER, SAMPLE_BYTES, sample);
+  }
+  uint64_t started = twiSim.cycles();
+  I2c.read(SENSOR, SENSOR_REGISTER, SAMPLE_BYTES, sample);
+  double normal = ms(twiSim.cycles() - started);
+
+  printf("timeout %u ms%s, stuck lines held %u ms, fault-free read %.3f ms\n", timeOut,
+         adaptive ? " (adaptive)" : "", hold, normal);
+  printf("%-32s %8s %8s %12s %9s %13s\n", "fault", "expected", "returned", "failed read",
+         "attempts", "recovered in");
+  unsigned failures = 0;
+  double worst = 0;
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+  {
+    const Scenario &s = scenarios[i];
+    twiSim.clearStats();
+    twiSim.inject(s.fault, s.atOperation, (uint64_t)hold * (F_CPU / 1000));
+    started = twiSim.cycles();
+    uint8_t first = I2c.read(SENSOR, SENSOR_REGISTER, SAMPLE_BYTES, sample);
+    double failedRead = ms(twiSim.cycles() - started);
+    unsigned attempts = 1;
+    uint8_t status = first;
+    if (verbose)
+    {
+      printf("  %s: 0x%02X", s.name, first);
+    }
+    while (status && ms(twiSim.cycles() - started) < GIVE_UP_MS)
+    {
+      status = I2c.read(SENSOR, SENSOR_REGISTER, SAMPLE_BYTES, sample);
+      attempts++;
+      if (verbose)
+      {
+        printf(" 0x%02X", status);
+      }
+    }
+    if (verbose)
+    {
+      printf("\n");
+    }
+    double recovered = ms(twiSim.cycles() - started);
+    bool ok = first == s.expected && !status;
+    if (!ok)
+    {
+      failures++;
+    }
+    if (recovered > worst)
+    {
+      worst = recovered;
+    }
+    printf("%-32s     0x%02X     0x%02X %9.3f ms %9u %10.3f ms%s\n", s.name, s.expected, first,
+           failedRead, attempts, recovered, !ok ? (status ? "  NOT RECOVERED" : "  WRONG RETURN VALUE") : "");
+    twiSim.inject(FAULT_NONE, 0);
+  }
+  printf("worst time to recover %.3f ms, %u of %u scenarios failed\n", worst, failures,
+         (unsigned)(sizeof(scenarios) / sizeof(scenarios[0])));
+  return (failures ? 1 : 0);
+}
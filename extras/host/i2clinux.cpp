@@ -0,0 +1,343 @@
+/*
+  i2clinux - checks the Linux i2c-dev backend of I2CMaster. Without -d the
+  backend talks to a user-space stand-in for the I2C_RDWR ioctl with
+  simulated register-pointer devices, checks the data and return value of
+  every method and that each transaction took exactly one ioctl, then lets
+  several threads share the bus through an I2CBusWorker. With -d it reads
+  registers of a real device instead.
+
+  Usage: i2clinux [-d /dev/i2c-N -a address [-r register] [-n bytes] [-w]]
+      -d  adapter to use instead of the stand-in
+      -a  7 bit address of the device to read
+      -r  first register, default 0
+      -n  number of bytes, default 16
+      -w  the device takes 16-bit register addresses
+  Returns 0 if every check passed or the read succeeded.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "TwiSim.h"
+#include "../../I2CMaster.h"
+#include "../../I2CLinux.h"
+#include "../../I2CWorker.h"
+
+#define NARROW 0x1E //8-bit registers
+#define WIDE 0x50   //16-bit registers
+#define ABSENT 0x33
+#define THREADS 4
+#define THREAD_READS 500
+
+static SimMemory narrow;
+static SimMemory wide(true);
+static unsigned calls;
+static unsigned messages;
+static std::atomic<int> inside; //threads in the stand-in at the same time
+static bool overlapped;
+
+static SimDevice *lookup(uint16_t address)
+{
+  if (address == NARROW)
+  {
+    return (&narrow);
+  }
+  if (address == WIDE)
+  {
+    return (&wide);
+  }
+  return (0);
+}
+
+//Plays the messages of one request on the simulated devices like an adapter
+//would: repeated STARTs between messages, a STOP at the end
+static int playMessages(struct i2c_rdwr_ioctl_data *request)
+{
+  calls++;
+  SimDevice *device = 0;
+  for (unsigned m = 0; m < request->nmsgs; m++)
+  {
+    struct i2c_msg &message = request->msgs[m];
+    bool read = message.flags & I2C_M_RD;
+    messages++;
+    device = lookup(message.addr);
+    if (!device || !device->address(read))
+    {
+      errno = ENXIO;
+      return (-1);
+    }
+    for (unsigned i = 0; i < message.len; i++)
+    {
+      if (read)
+      {
+        message.buf[i] = device->read(i != message.len - 1u);
+      }
+      else if (!device->write(message.buf[i]))
+      {
+        device->stop();
+        errno = EREMOTEIO;
+        return (-1);
+      }
+    }
+  }
+  if (device)
+  {
+    device->stop();
+  }
+  return (request->nmsgs);
+}
+
+//The stand-in for the I2C_RDWR ioctl, also notes when two threads are in
+//it at the same time
+static int standIn(int fd, struct i2c_rdwr_ioctl_data *request)
+{
+  if (inside.fetch_add(1))
+  {
+    overlapped = true;
+  }
+  int result = playMessages(request);
+  inside.fetch_sub(1);
+  return (result);
+}
+
+static unsigned failures;
+
+static void check(const char *name, bool ok, unsigned expectedMessages, unsigned expectedCalls = 1)
+{
+  bool played = calls == (expectedMessages ? expectedCalls : 0) && messages == expectedMessages;
+  printf("%-40s %s%s\n", name, ok ? "ok" : "WRONG RESULT",
+         played ? "" : " (not the expected ioctls and messages)");
+  if (!ok || !played)
+  {
+    failures++;
+  }
+  calls = 0;
+  messages = 0;
+}
+
+static bool matches(const uint8_t *data, uint16_t first, uint16_t numberBytes)
+{
+  for (uint16_t i = 0; i < numberBytes; i++)
+  {
+    if (data[i] != (uint8_t)(first + i))
+    {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+//THREADS threads read different registers of the same device through one
+//worker, at most maxBatch transactions per ioctl
+static void workerChecks(I2CMaster<LinuxBackend> &bus, uint8_t maxBatch)
+{
+  static uint8_t buffers[THREADS][THREAD_READS][8];
+  std::atomic<unsigned> wrong(0);
+  calls = 0;
+  messages = 0;
+  overlapped = false;
+  {
+    I2CBusWorker<I2CMaster<LinuxBackend> > worker(bus, maxBatch);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < THREADS; t++)
+    {
+      threads.push_back(std::thread([&worker, &wrong, t]() {
+        std::vector<std::future<uint8_t> > results;
+        for (unsigned i = 0; i < THREAD_READS; i++)
+        {
+          results.push_back(worker.read(NARROW, 0x80 + t * 0x20 + i % 16, 8, buffers[t][i]));
+        }
+        for (unsigned i = 0; i < THREAD_READS; i++)
+        {
+          if (results[i].get() || !matches(buffers[t][i], 0x80 + t * 0x20 + i % 16, 8))
+          {
+            wrong++;
+          }
+        }
+      }));
+    }
+    for (unsigned t = 0; t < THREADS; t++)
+    {
+      threads[t].join();
+    }
+  }
+  unsigned transactions = THREADS * THREAD_READS;
+  bool ok = !wrong && !overlapped && messages == 2 * transactions;
+  printf("%u threads, worker batching up to %-3u      %s (%u transactions in %u ioctls)\n", THREADS, maxBatch,
+         ok ? "ok" : "WRONG RESULT", transactions, calls);
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+static int standInChecks()
+{
+  I2CMaster<LinuxBackend> bus;
+  bus.begin(standIn);
+  uint8_t buffer[300];
+
+  uint8_t status = bus.read(NARROW, 0x03, 6, buffer);
+  check("read(address, register, 6, buffer)", !status && matches(buffer, 0x03, 6), 2);
+
+  status = bus.read16(WIDE, 0x0120, 8, buffer);
+  check("read16(address, register, 8, buffer)", !status && matches(buffer, 0x20, 8), 2);
+
+  status = bus.readex(NARROW, 0x00, 300, buffer);
+  check("readex(address, register, 300, buffer)", !status && matches(buffer, 0x00, 300), 2);
+
+  status = bus.read(NARROW, 0x10, 4);
+  bool ok = !status && bus.available() == 4;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    ok = ok && bus.receive() == 0x10 + i;
+  }
+  check("read(address, register, 4) and receive()", ok, 2);
+
+  status = bus.read(NARROW, 3, buffer);
+  check("read(address, 3, buffer)", !status && matches(buffer, 0x14, 3), 1);
+
+  uint8_t data[4] = {0xA0, 0xA1, 0xA2, 0xA3};
+  status = bus.write(NARROW, 0x40, data, 4);
+  check("write(address, register, data, 4)", !status && !memcmp(&narrow.memory[0x40], data, 4), 1);
+
+  status = bus.write16(WIDE, 0x0180, 0x5A);
+  check("write16(address, register, value)", !status && wide.memory[0x80] == 0x5A, 1);
+
+  status = bus.write(ABSENT, 0x00, 0x00);
+  check("write to an absent device", status == MT_SLA_NACK, 1);
+
+  status = bus.read(ABSENT, 2, buffer);
+  check("read from an absent device", status == MR_SLA_NACK, 1);
+
+  I2CTransaction muxed = {};
+  muxed.address = NARROW;
+  muxed.flags = TRANSACTION_READ;
+  muxed.dataBuffer = buffer;
+  muxed.numberBytes = 2;
+  muxed.channel = MUX_CHANNEL(0, 1);
+  status = bus.transaction(&muxed);
+  check("transaction() with a mux channel refused", status == MUX_NOT_SUPPORTED &&
+        muxed.status == MUX_NOT_SUPPORTED && !muxed.bytesDone, 0);
+  I2CTransaction plain = muxed;
+  plain.channel = 0;
+  I2CTransaction *both[2] = {&plain, &muxed};
+  status = bus.batch(both, 2);
+  check("batch() with a mux channel refused", status == MUX_NOT_SUPPORTED &&
+        plain.status == MUX_NOT_SUPPORTED && !plain.bytesDone, 0);
+
+  //Reads share an ioctl, a write gets its own so it ends with a STOP
+  uint8_t first[4], second[4], third[2];
+  uint8_t pair[2] = {0xB0, 0xB1};
+  I2CTransaction mixed[4] = {};
+  mixed[0].address = NARROW;
+  mixed[0].flags = TRANSACTION_READ;
+  mixed[0].registerAddress = 0x20;
+  mixed[0].dataBuffer = first;
+  mixed[0].numberBytes = 4;
+  mixed[1] = mixed[0];
+  mixed[1].registerAddress = 0x30;
+  mixed[1].dataBuffer = second;
+  mixed[2] = mixed[0];
+  mixed[2].flags = TRANSACTION_WRITE;
+  mixed[2].registerAddress = 0x60;
+  mixed[2].dataBuffer = pair;
+  mixed[2].numberBytes = 2;
+  mixed[3] = mixed[0];
+  mixed[3].registerAddress = 0x50;
+  mixed[3].dataBuffer = third;
+  mixed[3].numberBytes = 2;
+  I2CTransaction *inOrder[4] = {&mixed[0], &mixed[1], &mixed[2], &mixed[3]};
+  status = bus.batch(inOrder, 4);
+  check("batch() of reads and a write", !status && matches(first, 0x20, 4) && matches(second, 0x30, 4) &&
+        !memcmp(&narrow.memory[0x60], pair, 2) && matches(third, 0x50, 2), 7, 3);
+
+  //A failed ioctl of reads is run again one read at a time
+  I2CTransaction absent = mixed[0];
+  absent.address = ABSENT;
+  absent.flags = TRANSACTION_READ | TRANSACTION_NO_REGISTER;
+  absent.dataBuffer = third;
+  absent.numberBytes = 2;
+  I2CTransaction *failing[3] = {&mixed[0], &absent, &mixed[1]};
+  memset(first, 0, 4);
+  memset(second, 0, 4);
+  status = bus.batch(failing, 3);
+  check("batch() with an absent device", status == MR_SLA_NACK && !mixed[0].status && mixed[0].bytesDone == 4 &&
+        absent.status == MR_SLA_NACK && !absent.bytesDone && !mixed[1].status && matches(first, 0x20, 4) &&
+        matches(second, 0x30, 4), 3 + 5, 4);
+
+  workerChecks(bus, 1);
+  workerChecks(bus, 8);
+
+  printf("%u checks failed\n", failures);
+  return (failures ? 1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *device = 0;
+  unsigned address = 0x80;
+  unsigned reg = 0;
+  unsigned numberBytes = 16;
+  bool reg16 = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:a:r:n:w")) != -1)
+  {
+    switch (opt)
+    {
+    case 'd':
+      device = optarg;
+      break;
+    case 'a':
+      address = strtoul(optarg, 0, 0);
+      break;
+    case 'r':
+      reg = strtoul(optarg, 0, 0);
+      break;
+    case 'n':
+      numberBytes = strtoul(optarg, 0, 0);
+      break;
+    case 'w':
+      reg16 = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d /dev/i2c-N -a address [-r register] [-n bytes] [-w]]\n", argv[0]);
+      return (2);
+    }
+  }
+  if (!device)
+  {
+    return (standInChecks());
+  }
+  if (address > 0x7F || !numberBytes || numberBytes > 255)
+  {
+    fprintf(stderr, "a 7 bit address and 1 - 255 bytes are needed\n");
+    return (2);
+  }
+
+  I2CMaster<LinuxBackend, 0, FixedTimeOut<100> > bus;
+  int error = bus.begin(device);
+  if (error)
+  {
+    fprintf(stderr, "%s: %s\n", device, strerror(error));
+    return (2);
+  }
+  uint8_t buffer[255];
+  uint8_t status = reg16 ? bus.read16(address, reg, numberBytes, buffer)
+                         : bus.read(address, reg, numberBytes, buffer);
+  if (status)
+  {
+    fprintf(stderr, "read failed with status 0x%02X%s%s\n", status, status == LINUX_IO_ERROR ? ": " : "",
+            status == LINUX_IO_ERROR ? strerror(errno) : "");
+    return (1);
+  }
+  for (unsigned i = 0; i < numberBytes; i++)
+  {
+    printf("%02X%c", buffer[i], (i % 16 == 15 || i == numberBytes - 1) ? '\n' : ' ');
+  }
+  return (0);
+}
@@ -0,0 +1,515 @@
+/*
+  i2creplay - feeds a bus capture recorded with I2c.capture() back through the
+  I2C library running against the simulated TWI peripheral, and compares what
+  the library does now with what was recorded.
+
+  Every transaction in the capture (START up to STOP, or up to the step that
+  failed) is turned back into the library call that produces it, e.g. a
+  write of the register address followed by a repeated start and reads
+  becomes I2c.read(address, register, n, buffer). A scripted slave answers
+  with the recorded ACKs, NACKs, data and clock stretching, so the replay
+  shows whether the current library still takes the same steps, gets the
+  same results and how its timing compares. Transactions that don't match a
+  library call are replayed with the low-level methods.
+
+  Usage: i2creplay [-d] [-v] [-t ms] [-m us] [-o replayed.cap] capture.cap
+      -d  only dump the capture
+      -v  print every transaction, not only the ones that differ
+      -t  library timeout in ms, default derived from timed out steps
+      -m  fail if a transaction takes more than this many us longer or
+          shorter than recorded
+      -o  write the replayed capture to a file
+  Returns 0 if the replay matches, 1 if it doesn't and 2 on usage errors.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "../../I2C.h"
+
+typedef std::vector<I2CCaptureRecord> Capture;
+
+struct Transaction
+{
+  size_t first; //index of the first record in the capture
+  size_t count;
+};
+
+//Answers every address with what the next recorded step says
+class ScriptedDevice : public SimDevice
+{
+public:
+  ScriptedDevice() : script(0), cursor(0), end(0), last(0) {}
+  void play(const I2CCaptureRecord *records, size_t count)
+  {
+    script = records;
+    cursor = 0;
+    end = count;
+    last = 0;
+  }
+  bool address(bool read) { return (next(CAPTURE_ADDRESS) && !last->status); }
+  bool write(uint8_t) { return (next(CAPTURE_SEND) && !last->status); }
+  uint8_t read(bool ack)
+  {
+    next(ack ? CAPTURE_RECEIVE_ACK : CAPTURE_RECEIVE_NACK);
+    return (last ? last->data : 0xFF);
+  }
+  //Recorded time beyond the nominal byte time was spent stretching the clock,
+  //a step that timed out stretches well past any timeout
+  uint32_t stretch()
+  {
+    if (!last)
+    {
+      return (0);
+    }
+    uint64_t recorded = (uint64_t)last->duration * 1000;
+    if (last->status == 1)
+    {
+      return (recorded * 10 + 10000000);
+    }
+    uint64_t nominal = (uint64_t)9 * twiSim.sclPeriod() * 1000000000 / F_CPU;
+    return (recorded > nominal ? recorded - nominal : 0);
+  }
+
+private:
+  //Moves to the next recorded device step, which should be of the given type
+  bool next(uint8_t type)
+  {
+    last = 0;
+    while (cursor < end)
+    {
+      const I2CCaptureRecord *r = &script[cursor++];
+      if (r->type == CAPTURE_ADDRESS || r->type == CAPTURE_SEND ||
+          r->type == CAPTURE_RECEIVE_ACK || r->type == CAPTURE_RECEIVE_NACK)
+      {
+        last = r;
+        return (r->type == type);
+      }
+    }
+    return (false);
+  }
+  const I2CCaptureRecord *script;
+  size_t cursor;
+  size_t end;
+  const I2CCaptureRecord *last;
+};
+
+static Capture replayed;
+
+static void collect(const I2CCaptureRecord *record)
+{
+  replayed.push_back(*record);
+}
+
+static const char *typeName(uint8_t type)
+{
+  switch (type)
+  {
+  case CAPTURE_START:
+    return ("start");
+  case CAPTURE_ADDRESS:
+    return ("address");
+  case CAPTURE_SEND:
+    return ("send");
+  case CAPTURE_RECEIVE_ACK:
+    return ("receive+ack");
+  case CAPTURE_RECEIVE_NACK:
+    return ("receive+nack");
+  case CAPTURE_STOP:
+    return ("stop");
+  default:
+    return ("?");
+  }
+}
+
+static void printRecord(const char *prefix, const I2CCaptureRecord &r)
+{
+  printf("%s%10lu us  %-12s 0x%02X  status 0x%02X  %5u us\n", prefix,
+         (unsigned long)r.timestamp, typeName(r.type), r.data, r.status, r.duration);
+}
+
+static bool load(const char *path, Capture &capture)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    perror(path);
+    return (false);
+  }
+  uint8_t packed[CAPTURE_RECORD_SIZE];
+  size_t n = fread(packed, 1, CAPTURE_HEADER_SIZE, f);
+  if (n != CAPTURE_HEADER_SIZE || memcmp(packed, CAPTURE_HEADER, CAPTURE_HEADER_SIZE))
+  {
+    //No header, the file is a raw record stream
+    rewind(f);
+  }
+  while ((n = fread(packed, 1, CAPTURE_RECORD_SIZE, f)) == CAPTURE_RECORD_SIZE)
+  {
+    I2CCaptureRecord r;
+    r.type = packed[0];
+    r.data = packed[1];
+    r.status = packed[2];
+    r.duration = packed[3] | (packed[4] << 8);
+    r.timestamp = (uint32_t)packed[5] | ((uint32_t)packed[6] << 8) |
+                  ((uint32_t)packed[7] << 16) | ((uint32_t)packed[8] << 24);
+    capture.push_back(r);
+  }
+  if (n)
+  {
+    fprintf(stderr, "%s: ignoring %u trailing bytes\n", path, (unsigned)n);
+  }
+  fclose(f);
+  return (true);
+}
+
+static bool save(const char *path, const Capture &capture)
+{
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    perror(path);
+    return (false);
+  }
+  fwrite(CAPTURE_HEADER, 1, CAPTURE_HEADER_SIZE, f);
+  for (size_t i = 0; i < capture.size(); i++)
+  {
+    uint8_t packed[CAPTURE_RECORD_SIZE];
+    I2C::packCapture(&capture[i], packed);
+    fwrite(packed, 1, sizeof(packed), f);
+  }
+  return (fclose(f) == 0);
+}
+
+//Whether a recorded step ended the transaction
+static bool failed(const I2CCaptureRecord &r)
+{
+  if (r.type == CAPTURE_RECEIVE_ACK)
+  {
+    return (r.status != MR_DATA_ACK);
+  }
+  if (r.type == CAPTURE_RECEIVE_NACK)
+  {
+    return (r.status != MR_DATA_NACK);
+  }
+  return (r.status != 0);
+}
+
+//A transaction runs from a START to the STOP or to the first failed step,
+//since the library gives up on the transaction there
+static std::vector<Transaction> split(const Capture &capture)
+{
+  std::vector<Transaction> transactions;
+  bool open = false;
+  for (size_t i = 0; i < capture.size(); i++)
+  {
+    if (!open || transactions.empty())
+    {
+      Transaction t = {i, 0};
+      transactions.push_back(t);
+      open = true;
+    }
+    transactions.back().count++;
+    if (capture[i].type == CAPTURE_STOP || failed(capture[i]))
+    {
+      open = false;
+      //A NACK is followed by the STOP the library sends itself
+      if (capture[i].type != CAPTURE_STOP && i + 1 < capture.size() &&
+          capture[i + 1].type == CAPTURE_STOP && capture[i].status != 1)
+      {
+        transactions.back().count++;
+        i++;
+      }
+    }
+  }
+  return (transactions);
+}
+
+//Replays a transaction step by step with the low-level methods
+static void replayLowLevel(const I2CCaptureRecord *r, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    switch (r[i].type)
+    {
+    case CAPTURE_START:
+      TWBR = r[i].data;
+      I2c._start();
+      break;
+    case CAPTURE_ADDRESS:
+      I2c._sendAddress(r[i].data);
+      break;
+    case CAPTURE_SEND:
+      I2c._sendByte(r[i].data);
+      break;
+    case CAPTURE_RECEIVE_ACK:
+      I2c._receiveByte(1);
+      break;
+    case CAPTURE_RECEIVE_NACK:
+      I2c._receiveByte(0);
+      break;
+    case CAPTURE_STOP:
+      //Not after a NACK, the library sends that STOP by itself
+      if (!i || !failed(r[i - 1]))
+      {
+        I2c._stop();
+      }
+      break;
+    }
+  }
+}
+
+//Replays a transaction through the library call that produces it. Returns
+//false if it doesn't look like one.
+static bool replayCall(const I2CCaptureRecord *r, size_t count)
+{
+  size_t i = 0;
+  uint8_t buffer[MAX_BUFFER_SIZE + 2];
+  uint8_t sent[256];
+  uint8_t nSent = 0;
+  if (count < 2 || r[0].type != CAPTURE_START || r[1].type != CAPTURE_ADDRESS)
+  {
+    return (false);
+  }
+  uint8_t sla = r[1].data;
+  uint8_t address = sla >> 1;
+  for (i = 2; i < count && r[i].type == CAPTURE_SEND; i++)
+  {
+    sent[nSent++] = r[i].data;
+  }
+  size_t received = 0;
+  bool restarted = false;
+  if (i + 1 < count && r[i].type == CAPTURE_START && r[i + 1].type == CAPTURE_ADDRESS &&
+      r[i + 1].data == (sla | 0x01) && !(sla & 0x01))
+  {
+    restarted = true;
+    i += 2;
+  }
+  for (; i < count && (r[i].type == CAPTURE_RECEIVE_ACK || r[i].type == CAPTURE_RECEIVE_NACK); i++)
+  {
+    received++;
+  }
+  if (i < count && r[i].type != CAPTURE_STOP)
+  {
+    return (false);
+  }
+  if (received > MAX_BUFFER_SIZE || nSent > MAX_BUFFER_SIZE)
+  {
+    return (false);
+  }
+  if (sla & 0x01)
+  {
+    //Plain read without a register address
+    if (nSent)
+    {
+      return (false);
+    }
+    I2c.read(address, (uint8_t)(received ? received : 1), buffer);
+  }
+  else if (restarted)
+  {
+    if (nSent == 1)
+    {
+      I2c.read(address, sent[0], (uint8_t)(received ? received : 1), buffer);
+    }
+    else if (nSent == 2)
+    {
+      I2c.read16(address, (sent[0] << 8) | sent[1], (uint8_t)(received ? received : 1), buffer);
+    }
+    else
+    {
+      return (false);
+    }
+  }
+  else if (received || !nSent)
+  {
+    return (false);
+  }
+  else if (nSent == 1)
+  {
+    I2c.write(address, sent[0]);
+  }
+  else
+  {
+    I2c.write(address, sent[0], sent + 1, nSent - 1);
+  }
+  return (true);
+}
+
+//Gives a device a profile with the recorded bit rate if it differs from the
+//default one. The device table is small, so captures with many devices at
+//non-default speeds replay partly at the default speed.
+static void applySpeed(const I2CCaptureRecord *r, size_t count, uint8_t *twbr)
+{
+  if (count < 2 || r[0].type != CAPTURE_START || r[1].type != CAPTURE_ADDRESS)
+  {
+    return;
+  }
+  uint8_t address = r[1].data >> 1;
+  if (r[0].data != twbr[address])
+  {
+    twbr[address] = r[0].data;
+    I2c.profile(address, 0, F_CPU / (16 + 2 * (uint32_t)r[0].data));
+  }
+}
+
+static uint32_t span(const I2CCaptureRecord *r, size_t count)
+{
+  if (!count)
+  {
+    return (0);
+  }
+  return (r[count - 1].timestamp + r[count - 1].duration - r[0].timestamp);
+}
+
+static bool sameStep(const I2CCaptureRecord &a, const I2CCaptureRecord &b)
+{
+  return (a.type == b.type && a.data == b.data && a.status == b.status);
+}
+
+int main(int argc, char *argv[])
+{
+  bool dumpOnly = false;
+  bool verbose = false;
+  long timeOut = -1;
+  long maxDeviation = -1;
+  const char *output = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "dvt:m:o:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'd':
+      dumpOnly = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 't':
+      timeOut = atol(optarg);
+      break;
+    case 'm':
+      maxDeviation = atol(optarg);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d] [-v] [-t ms] [-m us] [-o replayed.cap] capture.cap\n", argv[0]);
+      return (2);
+    }
+  }
+  if (optind != argc - 1)
+  {
+    fprintf(stderr, "usage: %s [-d] [-v] [-t ms] [-m us] [-o replayed.cap] capture.cap\n", argv[0]);
+    return (2);
+  }
+  Capture recorded;
+  if (!load(argv[optind], recorded))
+  {
+    return (2);
+  }
+  if (dumpOnly)
+  {
+    for (size_t i = 0; i < recorded.size(); i++)
+    {
+      printRecord("", recorded[i]);
+    }
+    return (0);
+  }
+
+  if (timeOut < 0)
+  {
+    //Long enough for every step that completed, short enough to catch the
+    //ones that timed out
+    uint32_t longest = 0;
+    timeOut = 0;
+    for (size_t i = 0; i < recorded.size(); i++)
+    {
+      if (recorded[i].status == 1 && recorded[i].duration > longest)
+      {
+        longest = recorded[i].duration;
+      }
+    }
+    if (longest)
+    {
+      timeOut = longest >= 2000 ? longest / 1000 : 1;
+    }
+  }
+
+  ScriptedDevice device;
+  twiSim.attachAll(&device);
+  I2c.begin();
+  I2c.timeOut(timeOut);
+  I2c.capture(collect);
+
+  std::vector<Transaction> transactions = split(recorded);
+  uint8_t twbr[128];
+  memset(twbr, ((F_CPU / 100000) - 16) / 2, sizeof(twbr));
+  size_t mismatches = 0;
+  size_t lowLevel = 0;
+  uint64_t recordedTime = 0;
+  uint64_t replayedTime = 0;
+  long worst = 0;
+  for (size_t t = 0; t < transactions.size(); t++)
+  {
+    const I2CCaptureRecord *r = &recorded[transactions[t].first];
+    size_t count = transactions[t].count;
+    size_t from = replayed.size();
+    device.play(r, count);
+    applySpeed(r, count, twbr);
+    if (!replayCall(r, count))
+    {
+      lowLevel++;
+      replayLowLevel(r, count);
+    }
+    const I2CCaptureRecord *p = replayed.size() > from ? &replayed[from] : 0;
+    size_t replayedCount = replayed.size() - from;
+
+    bool same = replayedCount == count;
+    for (size_t i = 0; same && i < count; i++)
+    {
+      same = sameStep(r[i], p[i]);
+    }
+    long deviation = (long)span(p, replayedCount) - (long)span(r, count);
+    recordedTime += span(r, count);
+    replayedTime += span(p, replayedCount);
+    if (labs(deviation) > labs(worst))
+    {
+      worst = deviation;
+    }
+    bool slow = maxDeviation >= 0 && labs(deviation) > maxDeviation;
+    if (!same || slow)
+    {
+      mismatches++;
+    }
+    if (verbose || !same || slow)
+    {
+      printf("transaction %u: %s, %lu us recorded, %lu us replayed\n", (unsigned)t,
+             !same ? "DIFFERS" : slow ? "TOO SLOW" : "ok",
+             (unsigned long)span(r, count), (unsigned long)span(p, replayedCount));
+      for (size_t i = 0; i < count; i++)
+      {
+        printRecord("  recorded ", r[i]);
+      }
+      for (size_t i = 0; i < replayedCount; i++)
+      {
+        printRecord("  replayed ", p[i]);
+      }
+    }
+  }
+
+  printf("%u records, %u transactions (%u replayed step by step), %u differ\n",
+         (unsigned)recorded.size(), (unsigned)transactions.size(), (unsigned)lowLevel,
+         (unsigned)mismatches);
+  printf("time in transactions: %lu us recorded, %lu us replayed, worst deviation %ld us\n",
+         (unsigned long)recordedTime, (unsigned long)replayedTime, worst);
+  if (output && !save(output, replayed))
+  {
+    return (2);
+  }
+  return (mismatches ? 1 : 0);
+}
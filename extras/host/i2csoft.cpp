@@ -0,0 +1,392 @@
+/*
+  i2csoft - checks the bit-banged SoftBackend of I2CMaster (I2CSoft.h) on a
+  simulated open-drain bus. The pins of the backend pull the two lines low
+  or release them, each line is the wired-AND of everything pulling it, and
+  a slave follows the bus edge by edge: it samples SDA while SCL is high,
+  changes SDA while SCL is low and can hold SCL low. The delay of the
+  backend advances the simulated clock that micros() reads, so the timeout
+  runs on simulated time.
+
+  Checks the data and return value of reads and writes, ACK and NACK of
+  addresses and data, a slave that stretches the clock within the timeout,
+  the step returned when a slave holds SCL low at each step (2 - 7), and
+  arbitration lost to a second master or to SDA held low.
+
+  Usage: i2csoft
+  Returns 0 if every check passed.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "../../I2CSoft.h"
+
+#define SENSOR 0x1E
+#define WIDE 0x54  //16-bit registers
+#define FIFO 0x53  //NACKs the first data byte written
+#define ABSENT 0x33
+#define RIVAL 0x1C //address sent by the second master, wins on bit 2 against SENSOR
+#define LINE_CYCLES 2 //cost of a line change or read
+#define STRETCH_CYCLES 1600 //100 us at 16 MHz
+
+//Refuses the data bytes of a write, the register address is acknowledged
+class SimRefusing : public SimMemory
+{
+public:
+  SimRefusing() : written(0) {}
+  bool address(bool read)
+  {
+    written = 0;
+    return (SimMemory::address(read));
+  }
+  bool write(uint8_t value)
+  {
+    return (written++ ? false : SimMemory::write(value));
+  }
+
+private:
+  unsigned written;
+};
+
+//SDA and SCL with the master, one slave state machine for every address and
+//an optional second master pulling them low
+class SimOpenDrain
+{
+public:
+  SimOpenDrain() { reset(); }
+
+  //Releases everything and forgets the current transfer, the devices stay
+  void reset()
+  {
+    masterSda = masterScl = slaveSda = slaveScl = rivalSda = false;
+    stuckSda = false;
+    stuckAfter = 0;
+    stretching = false;
+    rival = 0;
+    rivalBit = 0;
+    edges = 0;
+    state = IDLE;
+    wasSda = wasScl = true;
+  }
+
+  //The master pulls a line low or releases it
+  void drive(bool sdaLine, bool low)
+  {
+    twiSim.advance(LINE_CYCLES);
+    (sdaLine ? masterSda : masterScl) = low;
+    update();
+  }
+
+  bool sda()
+  {
+    twiSim.advance(LINE_CYCLES);
+    return (sdaLevel());
+  }
+
+  bool scl()
+  {
+    twiSim.advance(LINE_CYCLES);
+    if (slaveScl && stretching && twiSim.cycles() >= stretchEnd)
+    {
+      slaveScl = false;
+      update();
+    }
+    return (sclLevel());
+  }
+
+  SimDevice *devices[128];
+  bool stuckSda;       //a slave holds SDA low for good
+  unsigned stuckAfter; //SCL falling edges after which a slave holds SCL low for good, 0 never
+  bool stretching;     //the addressed slave holds SCL low for STRETCH_CYCLES after every byte
+  uint8_t rival;       //byte the second master sends from the next START, 0 none
+
+private:
+  enum State
+  {
+    IDLE,    //not addressed, waits for a START
+    ADDRESS, //receives the address byte
+    WRITING, //receives data bytes
+    READING  //sends data bytes
+  };
+
+  bool sdaLevel() const { return (!(masterSda || slaveSda || rivalSda || stuckSda)); }
+  bool sclLevel() const { return (!(masterScl || slaveScl)); }
+
+  //Finds the condition or clock edge a line change made
+  void update()
+  {
+    bool sdaNow = sdaLevel();
+    bool sclNow = sclLevel();
+    if (sclNow && wasScl && sdaNow != wasSda)
+    {
+      if (sdaNow)
+      {
+        stopped();
+      }
+      else
+      {
+        started();
+      }
+    }
+    else if (sclNow && !wasScl)
+    {
+      rising(sdaNow);
+    }
+    else if (!sclNow && wasScl)
+    {
+      falling();
+    }
+    //what the slave did in reply is no condition
+    wasSda = sdaLevel();
+    wasScl = sclLevel();
+  }
+
+  void started()
+  {
+    state = ADDRESS;
+    bit = 0;
+    shift = 0;
+    pulsed = false;
+    slaveSda = false;
+    if (rival)
+    {
+      rivalBit = 0x80;
+    }
+  }
+
+  void stopped()
+  {
+    if (state != IDLE && device)
+    {
+      device->stop();
+    }
+    state = IDLE;
+    slaveSda = false;
+    rivalSda = false;
+    rivalBit = 0;
+  }
+
+  void rising(bool level)
+  {
+    pulsed = true;
+    if (bit < 8 && (state == ADDRESS || state == WRITING))
+    {
+      shift = (shift << 1) | level;
+    }
+    else if (bit == 8 && state == READING)
+    {
+      masterAck = !level;
+    }
+  }
+
+  void falling()
+  {
+    if (stuckAfter && ++edges == stuckAfter)
+    {
+      slaveScl = true;
+    }
+    //the second master puts its next bit on SDA like the first one does
+    if (rivalBit)
+    {
+      rivalSda = !(rival & rivalBit);
+      rivalBit >>= 1;
+    }
+    else
+    {
+      rivalSda = false;
+    }
+    //the SCL low after a START ends no clock pulse
+    if (state == IDLE || !pulsed)
+    {
+      return;
+    }
+    pulsed = false;
+    bit++;
+    if (bit == 8)
+    {
+      if (state == ADDRESS)
+      {
+        device = devices[shift >> 1];
+        reading = shift & 1;
+        ack = device && device->address(reading);
+      }
+      else if (state == WRITING)
+      {
+        ack = device->write(shift);
+      }
+      slaveSda = state != READING && ack;
+      return;
+    }
+    if (bit == 9)
+    {
+      slaveSda = false;
+      bit = 0;
+      shift = 0;
+      if ((state == READING && !masterAck) || (state != READING && !ack))
+      {
+        state = IDLE;
+        return;
+      }
+      if (state == ADDRESS)
+      {
+        state = reading ? READING : WRITING;
+      }
+      if (stretching)
+      {
+        slaveScl = true;
+        stretchEnd = twiSim.cycles() + STRETCH_CYCLES;
+      }
+      if (state == READING)
+      {
+        //whether the master will acknowledge the byte is not known yet
+        current = device->read(true);
+        slaveSda = !(current & 0x80);
+      }
+      return;
+    }
+    if (state == READING)
+    {
+      slaveSda = !(current & (0x80 >> bit));
+    }
+  }
+
+  bool masterSda, masterScl, slaveSda, slaveScl, rivalSda;
+  bool wasSda, wasScl;
+  uint8_t rivalBit;
+  unsigned edges;
+  uint64_t stretchEnd;
+  State state;
+  uint8_t bit;   //clock pulses of the current byte, 8 is the ACK
+  uint8_t shift; //byte received so far
+  bool pulsed;   //SCL went high since it last fell
+  SimDevice *device;
+  bool reading;
+  bool ack;
+  bool masterAck;
+  uint8_t current; //byte being sent to the master
+};
+
+static SimOpenDrain bus;
+
+struct SimSda
+{
+  static void low(uint8_t) { bus.drive(true, true); }
+  static void release(uint8_t) { bus.drive(true, false); }
+  static uint8_t high() { return (bus.sda()); }
+  static void reset() { bus.drive(true, false); }
+};
+
+struct SimScl
+{
+  static void low(uint8_t) { bus.drive(false, true); }
+  static void release(uint8_t) { bus.drive(false, false); }
+  static uint8_t high() { return (bus.scl()); }
+  static void reset() { bus.drive(false, false); }
+};
+
+struct SimDelay
+{
+  static void wait(uint32_t cycles) { twiSim.advance(cycles); }
+};
+
+static SimMemory sensor;
+static SimMemory wide(true);
+static SimRefusing fifo;
+static I2CMaster<SoftBackend<SimSda, SimScl, 400000, 0, SimDelay>, 0, FixedTimeOut<10> > soft;
+static unsigned failures;
+
+static void check(const char *name, bool ok)
+{
+  printf("%-48s %s\n", name, ok ? "ok" : "WRONG RESULT");
+  if (!ok)
+  {
+    failures++;
+  }
+  bus.reset();
+}
+
+static bool matches(const uint8_t *data, uint16_t first, uint16_t numberBytes)
+{
+  for (uint16_t i = 0; i < numberBytes; i++)
+  {
+    if (data[i] != (uint8_t)(first + i))
+    {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+//SCL falling edges of a register read of numberBytes, up to the step
+static unsigned edgesBefore(uint8_t step, uint8_t numberBytes)
+{
+  //START, SLA+W, register, repeated START, SLA+R, data
+  static const unsigned edges[] = {1, 1 + 9, 1 + 9 + 9, 1 + 9 + 9 + 1, 1 + 9 + 9 + 1 + 9};
+  return (step <= 6 ? edges[step - 2] : edges[4] + 9 * numberBytes);
+}
+
+int main()
+{
+  bus.devices[SENSOR] = &sensor;
+  bus.devices[WIDE] = &wide;
+  bus.devices[FIFO] = &fifo;
+  soft.begin();
+  uint8_t buffer[16];
+
+  uint8_t status = soft.read(SENSOR, 0x03, 6, buffer);
+  check("read(address, register, 6, buffer)", !status && matches(buffer, 0x03, 6));
+
+  status = soft.read16(WIDE, 0x0120, 8, buffer);
+  check("read16(address, register, 8, buffer)", !status && matches(buffer, 0x20, 8));
+
+  uint8_t data[4] = {0xA0, 0xA1, 0xA2, 0xA3};
+  status = soft.write(SENSOR, 0x40, data, 4);
+  check("write(address, register, data, 4)", !status && !memcmp(&sensor.memory[0x40], data, 4));
+
+  status = soft.read(SENSOR, 0x40, 4, buffer);
+  check("read back what was written", !status && !memcmp(buffer, data, 4));
+
+  status = soft.write(ABSENT, 0x00, 0x00);
+  check("write to an absent device", status == MT_SLA_NACK);
+
+  status = soft.read(ABSENT, 2, buffer);
+  check("read from an absent device", status == MR_SLA_NACK);
+
+  status = soft.write(FIFO, 0x10, data, 4);
+  check("data byte not acknowledged", status == MT_DATA_NACK && fifo.memory[0x10] == 0x10);
+
+  bus.stretching = true;
+  uint64_t started = twiSim.cycles();
+  status = soft.read(SENSOR, 0x08, 4, buffer);
+  check("clock stretched 100 us per byte", !status && matches(buffer, 0x08, 4) &&
+        twiSim.cycles() - started >= 6 * STRETCH_CYCLES);
+
+  for (uint8_t step = 2; step <= 7; step++)
+  {
+    char name[48];
+    snprintf(name, sizeof(name), "SCL held low at step %u", step);
+    bus.stuckAfter = edgesBefore(step, 2);
+    started = twiSim.cycles();
+    status = soft.read(SENSOR, 0x00, 2, buffer);
+    check(name, status == step && twiSim.cycles() - started >= 10 * (F_CPU / 1000));
+  }
+
+  bus.rival = SLA_W(RIVAL);
+  status = soft.write(SENSOR, 0x00, 0x00);
+  check("arbitration lost to another master", status == LOST_ARBTRTN);
+
+  bus.stuckSda = true;
+  status = soft.read(SENSOR, 0x00, 2, buffer);
+  check("arbitration lost to SDA held low", status == LOST_ARBTRTN);
+
+  status = soft.read(SENSOR, 0x03, 6, buffer);
+  check("bus usable again", !status && matches(buffer, 0x03, 6));
+
+  printf("%u checks failed\n", failures);
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,255 @@
+/*
+  i2ctiming - predicts the achievable sample rate of a sensor mix. The
+  workload runs through the real library against the simulated TWI
+  peripheral, so the model sees exactly the register accesses the library
+  makes (every TWCR write in _start, _sendByte, _receiveByte, _stop) and
+  adds the bus time each one starts at the given speed, SCL rise time and
+  per-device clock stretching.
+
+  For every speed the time of one sample (one pass over the workload) is
+  split into bus time (operations on the wire), held time (the library owns
+  the bus but leaves SCL idle between operations) and free time (the bus is
+  released, e.g. between transactions).
+
+  Usage: i2ctiming [-f hz[,hz...]] [-r ns] [-g cycles] [-x] workload
+      -f  bus speeds to model, default 100000,400000
+      -r  SCL rise time in ns, default 0
+      -g  CPU cycles of software work between two bus operations beyond the
+          modelled register accesses, default 40
+      -x  print the register writes of one sample at the first speed
+
+  Workload file, one transaction per line, # starts a comment:
+      read|write  address  register  bytes  [stretch_ns]  [reg16]
+  e.g.
+      read   0x1E  0x03    6          # HMC5883L sample
+      read   0x53  0x32    6  2000    # ADXL345, stretches 2 us per byte
+      write  0x50  0x0100  32 0 reg16 # 24LC256 page
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "../../I2C.h"
+
+struct Entry
+{
+  bool write;
+  uint8_t address;
+  uint16_t registerAddress;
+  uint8_t numberBytes;
+  uint32_t stretchNs;
+  bool wide;
+};
+
+struct Split
+{
+  uint64_t total;
+  uint64_t busy;
+  uint64_t held;
+};
+
+static uint64_t lastWrite;
+
+static void printAccess(uint64_t cycle, uint8_t reg, uint8_t value, bool write)
+{
+  if (!write || (reg != SIM_TWCR && reg != SIM_TWDR))
+  {
+    return;
+  }
+  printf("  %10llu  +%5llu  %s = 0x%02X", (unsigned long long)cycle,
+         (unsigned long long)(cycle - lastWrite), reg == SIM_TWCR ? "TWCR" : "TWDR", value);
+  if (reg == SIM_TWCR && (value & _BV(TWINT)))
+  {
+    printf("  %s", value & _BV(TWSTO) ? "stop" : value & _BV(TWSTA) ? "start" : value & _BV(TWEA) ? "byte, ACK" : "byte");
+  }
+  printf("\n");
+  lastWrite = cycle;
+}
+
+static bool load(const char *path, std::vector<Entry> &workload)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    perror(path);
+    return (false);
+  }
+  char line[256];
+  unsigned lineNumber = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    lineNumber++;
+    char *comment = strchr(line, '#');
+    if (comment)
+    {
+      *comment = '\0';
+    }
+    char op[16], flag[16] = "";
+    unsigned address, reg, bytes, stretch = 0;
+    int n = sscanf(line, "%15s %i %i %i %i %15s", op, (int *)&address, (int *)&reg, (int *)&bytes,
+                   (int *)&stretch, flag);
+    if (n <= 0)
+    {
+      continue;
+    }
+    if (n < 4 || (strcmp(op, "read") && strcmp(op, "write")) || address > 0x7F ||
+        !bytes || bytes > MAX_BUFFER_SIZE || (n == 6 && strcmp(flag, "reg16")))
+    {
+      fprintf(stderr, "%s:%u: expected read|write address register bytes [stretch_ns] [reg16],"
+                      " at most %u bytes\n", path, lineNumber, MAX_BUFFER_SIZE);
+      fclose(f);
+      return (false);
+    }
+    Entry e = {op[0] == 'w', (uint8_t)address, (uint16_t)reg, (uint8_t)bytes, stretch, n == 6};
+    workload.push_back(e);
+  }
+  fclose(f);
+  return (true);
+}
+
+//Runs one transaction and returns where its time went
+static Split run(const Entry &e)
+{
+  static uint8_t buffer[MAX_BUFFER_SIZE];
+  uint64_t started = twiSim.cycles();
+  uint64_t busy = twiSim.busyCycles;
+  uint64_t held = twiSim.heldCycles;
+  uint8_t status;
+  if (e.write)
+  {
+    status = I2c.writeRegister(e.address, e.registerAddress, buffer, e.numberBytes);
+  }
+  else
+  {
+    status = I2c.readRegister(e.address, e.registerAddress, e.numberBytes, buffer);
+  }
+  if (status)
+  {
+    fprintf(stderr, "transaction with 0x%02X failed with status 0x%02X\n", e.address, status);
+  }
+  Split s = {twiSim.cycles() - started, twiSim.busyCycles - busy, twiSim.heldCycles - held};
+  return (s);
+}
+
+static double us(uint64_t cycles)
+{
+  return (twiSim.cyclesToMicros(cycles));
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<uint32_t> speeds;
+  bool trace = false;
+  twiSim.stepCycles = 40;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:r:g:x")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      for (char *p = strtok(optarg, ","); p; p = strtok(0, ","))
+      {
+        speeds.push_back(strtoul(p, 0, 0));
+      }
+      break;
+    case 'r':
+      twiSim.riseTimeNs = strtoul(optarg, 0, 0);
+      break;
+    case 'g':
+      twiSim.stepCycles = strtoul(optarg, 0, 0);
+      break;
+    case 'x':
+      trace = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-f hz[,hz...]] [-r ns] [-g cycles] [-x] workload\n", argv[0]);
+      return (2);
+    }
+  }
+  if (optind != argc - 1)
+  {
+    fprintf(stderr, "usage: %s [-f hz[,hz...]] [-r ns] [-g cycles] [-x] workload\n", argv[0]);
+    return (2);
+  }
+  if (speeds.empty())
+  {
+    speeds.push_back(100000);
+    speeds.push_back(400000);
+  }
+  std::vector<Entry> workload;
+  if (!load(argv[optind], workload) || workload.empty())
+  {
+    return (2);
+  }
+
+  std::vector<SimMemory *> devices;
+  for (size_t i = 0; i < workload.size(); i++)
+  {
+    SimMemory *device = new SimMemory(workload[i].wide, workload[i].stretchNs);
+    devices.push_back(device);
+    twiSim.attach(workload[i].address, device);
+  }
+  I2c.begin();
+
+  for (size_t s = 0; s < speeds.size(); s++)
+  {
+    for (size_t i = 0; i < workload.size(); i++)
+    {
+      if (I2c.profile(workload[i].address, workload[i].wide ? PROFILE_REG16 : 0, speeds[s]))
+      {
+        fprintf(stderr, "more than %u devices in the workload\n", MAX_DEVICES);
+        return (2);
+      }
+    }
+    //The first pass switches the bit rate, measure the second
+    for (size_t i = 0; i < workload.size(); i++)
+    {
+      run(workload[i]);
+    }
+    if (trace && s == 0)
+    {
+      printf("register writes of one sample at %lu Hz:\n", (unsigned long)speeds[s]);
+      lastWrite = twiSim.cycles();
+      twiSim.traceHook = printAccess;
+    }
+    std::vector<Split> splits;
+    Split sample = {0, 0, 0};
+    for (size_t i = 0; i < workload.size(); i++)
+    {
+      Split split = run(workload[i]);
+      splits.push_back(split);
+      sample.total += split.total;
+      sample.busy += split.busy;
+      sample.held += split.held;
+    }
+    twiSim.traceHook = 0;
+
+    uint8_t twbr = TWBR;
+    uint32_t payload = 0;
+    printf("\n%lu Hz requested: TWBR %u, SCL %.0f Hz with %lu ns rise time\n", (unsigned long)speeds[s],
+           twbr, F_CPU / (double)twiSim.sclPeriod(), (unsigned long)twiSim.riseTimeNs);
+    printf("  op     address  register  bytes  stretch ns   total us    bus us   held us\n");
+    for (size_t i = 0; i < workload.size(); i++)
+    {
+      const Entry &e = workload[i];
+      payload += e.numberBytes;
+      printf("  %-6s 0x%02X     0x%04X    %5u  %10lu  %9.1f %9.1f %9.1f\n", e.write ? "write" : "read",
+             e.address, e.registerAddress, e.numberBytes, (unsigned long)e.stretchNs,
+             us(splits[i].total), us(splits[i].busy), us(splits[i].held));
+    }
+    uint64_t idle = sample.total - sample.busy - sample.held;
+    printf("  sample: %.1f us = bus %.1f us (%.0f%%) + held %.1f us + free %.1f us\n", us(sample.total),
+           us(sample.busy), 100.0 * sample.busy / sample.total, us(sample.held), us(idle));
+    printf("  throughput: %.0f samples/s, %.0f payload bytes/s (bus limit %.0f samples/s)\n",
+           1e6 / us(sample.total), payload * 1e6 / us(sample.total), 1e6 / us(sample.busy));
+  }
+  for (size_t i = 0; i < devices.size(); i++)
+  {
+    delete devices[i];
+  }
+  return (0);
+}